@@ -9,4 +9,7 @@ make clean
 make all
 
 # Running QEMU
-qemu-system-i386 -m 7G -drive file=bin/io_os.bin,format=raw
\ No newline at end of file
+# Swap drive for anonymous memory, the primary slave
+[ -f bin/swap.img ] || dd if=/dev/zero of=bin/swap.img bs=1M count=256
+
+qemu-system-i386 -m 7G -drive file=bin/io_os.bin,format=raw -drive file=bin/swap.img,format=raw,index=1
\ No newline at end of file
@@ -1,3 +1,6 @@
 
 # Running QEMU
-qemu-system-i386 -m 18G -drive file=bin/io_os.bin,format=raw
+# Swap drive for anonymous memory, the primary slave
+[ -f bin/swap.img ] || dd if=/dev/zero of=bin/swap.img bs=1M count=256
+
+qemu-system-i386 -m 18G -drive file=bin/io_os.bin,format=raw -drive file=bin/swap.img,format=raw,index=1
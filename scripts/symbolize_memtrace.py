@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# Symbolizing an allocation trace exported by a MEM_TRACE=1 kernel
+#
+# Building and capturing the trace:
+#   make clean && make MEM_TRACE=1
+#   qemu-system-i386 -m 18G -drive file=bin/io_os.bin,format=raw -serial file:memtrace.log
+#   (the trace is dumped after boot, press F12 for a fresh dump)
+#
+# Usage: scripts/symbolize_memtrace.py memtrace.log [bin/io_os.elf] [--events]
+# Needs addr2line from the cross toolchain (i686-elf-addr2line) or binutils
+
+import shutil
+import subprocess
+import sys
+
+KINDS = ["kmalloc", "kfree", "legacy_malloc", "frame_alloc", "frame_free",
+         "block_alloc", "block_free", "heap_alloc", "heap_free"]
+
+
+def parse(path):
+    """Returns the events and call sites of the last dump in the log"""
+    events, sites = [], []
+    inside = False
+
+    with open(path, errors="replace") as log:
+        for line in log:
+            fields = line.split()
+            if line.startswith("MEMTRACE BEGIN"):
+                events, sites, inside = [], [], True
+            elif line.startswith("MEMTRACE END"):
+                inside = False
+            elif inside and fields and fields[0] == "E" and len(fields) == 6:
+                events.append([int(value, 16) for value in fields[1:]])
+            elif inside and fields and fields[0] == "S" and len(fields) == 7:
+                sites.append([int(value, 16) for value in fields[1:]])
+
+    return events, sites
+
+
+def symbolize(elf, addresses):
+    """Maps return addresses to function and file:line"""
+    tool = shutil.which("i686-elf-addr2line") or shutil.which("addr2line")
+    if not tool or not addresses:
+        return {address: "?" for address in addresses}
+
+    # Return addresses point after the call, one byte back is the call itself
+    query = [hex(address - 1) for address in addresses]
+    output = subprocess.run([tool, "-f", "-C", "-s", "-e", elf] + query,
+                            capture_output=True, text=True).stdout.splitlines()
+
+    names = {}
+    for i, address in enumerate(addresses):
+        function = output[2 * i] if 2 * i < len(output) else "?"
+        location = output[2 * i + 1] if 2 * i + 1 < len(output) else "?"
+        names[address] = function + " (" + location + ")"
+    return names
+
+
+def main():
+    arguments = [argument for argument in sys.argv[1:] if not argument.startswith("--")]
+    if not arguments:
+        print(__doc__ or "usage: symbolize_memtrace.py memtrace.log [bin/io_os.elf] [--events]")
+        sys.exit(1)
+
+    log = arguments[0]
+    elf = arguments[1] if len(arguments) > 1 else "bin/io_os.elf"
+    events, sites = parse(log)
+
+    names = symbolize(elf, sorted({site[0] for site in sites} | {event[2] for event in events}))
+
+    # Leaks and hot spots: most live bytes first, then most bytes allocated
+    print("%-10s %8s %8s %10s %10s %10s  %s" % ("caller", "allocs", "frees", "live", "peak", "total", "site"))
+    for caller, allocs, frees, live, peak, total in sorted(sites, key=lambda s: (-s[3], -s[5])):
+        print("%-10s %8d %8d %10d %10d %10d  %s" % (hex(caller), allocs, frees, live, peak, total, names[caller]))
+
+    if "--events" in sys.argv:
+        print()
+        start = events[0][0] if events else 0
+        for tsc, kind, caller, address, size in events:
+            name = KINDS[kind] if kind < len(KINDS) else str(kind)
+            print("%14d %-14s %-10s %8d  %s" % (tsc - start, name, hex(address), size, names[caller]))
+
+
+if __name__ == "__main__":
+    main()
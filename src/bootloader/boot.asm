@@ -30,12 +30,20 @@ section .boot
     KERNEL_LOAD_ADDR   equ ((KERNEL_LOAD_SEG << 4) + KERNEL_LOAD_OFFSET)
 
     KERNEL_START_ADDRESS equ 0x100000    ; Kernel's final memory address (1 MiB)
+    KERNEL_VIRTUAL_BASE  equ 0xC0000000  ; Kernel symbols are linked in the higher half, paging is still off here
 
 
     ; Error messages
     disk_error_message db 'Disk Read Error!', 0
     vesa_error_message db 'VESA error!', 0
 
+    ; Disk address packet for int 0x13, AH=0x42
+    kernel_dap:
+        db 0x10, 0                             ; Packet size, reserved
+        dw 0                                   ; Sectors to read, set for every chunk
+        dw KERNEL_LOAD_OFFSET, KERNEL_LOAD_SEG ; Buffer, ES:BX=01000:0x0000 = phys address 0x10000
+        dq 1                                   ; LBA to start from, the sector after the bootloader
+
 
 ; ====================
 ; Real mode
@@ -69,22 +77,32 @@ start:
     lgdt [gdt_descriptor]
 
 
-    ; Loading kernel using CHS
-    mov bx, KERNEL_LOAD_OFFSET  ; Offset where kernel is loaded
-    push KERNEL_LOAD_SEG        ; Segment where kernel is loaded
-    pop es                      ; ES:BX=01000:0x0000 = phys address 0x10000
+    ; Loading kernel using LBA, in chunks. Many BIOSes read at most 127 sectors (64 KiB) per call
+    mov si, kernel_dap          ; DS:SI = disk address packet
+    mov di, __kernel_sectors    ; Sectors left to read
+
+load_kernel_loop:
+    mov ax, 127                 ; Largest chunk
+    cmp di, ax
+    jae load_kernel_chunk
+    mov ax, di                  ; Last chunk, whatever is left
+load_kernel_chunk:
+    mov [si + 2], ax            ; Sectors to read in this chunk
 
-    xor dh, dh                  ; Head 0 (same as mov dh, 0)
     ; Use DL value passed by BIOS to our bootloader
     mov dl, 0x80
-    mov cl, 0x02                ; Start reading from sector 2
-    xor ch, ch                  ; Cylinder 0
-    mov ah, 0x02                ; Function to read sectors
-    mov al, __kernel_sectors    ; Number of sectors to read
-
+    mov ah, 0x42                ; Function to read sectors (extended)
     int 0x13                    ; BIOS interrupt to read sectors
     jc disk_read_error          ; If carry flag is set, handle disk read error
 
+    mov ax, [si + 2]
+    add [si + 8], ax            ; Next LBA
+    sub di, ax
+    shl ax, 5                   ; 512 bytes per sector = 32 paragraphs
+    add [si + 6], ax            ; Next segment, the offset stays 0
+    test di, di
+    jnz load_kernel_loop
+
 
     ; Set VESA mode to 1024x768, 32bpp
     ; mov ax, 0x4F02      ; VBE function to set mode
@@ -188,24 +206,25 @@ protected_mode_init:
 
 
     ; Relocate the kernel to its final address (1 MiB)
+    ; All __kernel_sectors were read to KERNEL_LOAD_ADDR above, so the copy never runs past what was loaded
     extern __kernel_start
     extern __kernel_load_end
-    extern __kernel_load_sizeb
+    extern __kernel_load_sized
 
     mov esi, KERNEL_LOAD_ADDR      ; Source address
     mov edi, KERNEL_START_ADDRESS  ; Destination address (1 MiB)
-    mov ecx, __kernel_load_sizeb   ; Set size in ECX for copying
-    rep movsb                      ; Copy kernel to final address (EDI)
+    mov ecx, __kernel_load_sized   ; Size in dwords, rounded up
+    rep movsd                      ; Copy kernel to final address (EDI)
 
     ; Zero out the BSS memory
     extern __kernel_bss_start
-    extern __kernel_bss_sizeb
+    extern __kernel_bss_sized
 
-    xor eax, eax                   ; AL = 0 (value to zero memory with)
-    mov edi, __kernel_bss_start    ; Source address
-    mov ecx, __kernel_bss_sizeb    ; Set size in ECX for copying
-    rep stosb                      ; Zero fill the BBS memory
+    xor eax, eax                   ; EAX = 0 (value to zero memory with)
+    mov edi, __kernel_bss_start - KERNEL_VIRTUAL_BASE ; Physical address of the BSS
+    mov ecx, __kernel_bss_sized    ; Size in dwords
+    rep stosd                      ; Zero fill the BBS memory
 
-    ; Far jump to the kernel's entry point
-    jmp CODE_SEG_OFFSET:_start
+    ; Far jump to the kernel's entry point, _start enables paging itself
+    jmp CODE_SEG_OFFSET:(_start - KERNEL_VIRTUAL_BASE)
 
@@ -6,19 +6,106 @@
 ; 
 ; kernel_entry.asm gives control to the kernel
 ; This file contains: 
-; Jumping to kernel_main.cpp
+; The boot page directory, moving to the higher half, jumping to kernel_main.cpp, the idle loop
 ; =======================================================================
 
 
 [BITS 32] ; We are in protected mode
 
     global _start 
+    global boot_page_directory
     extern kernel_main ; External symbol of kernel_main.cpp
+    extern kernel_idle ; Background work done between interrupts
+
+    ; PAE paging: entries are 8 bytes, the four directories sit one after the other so entry X >> 21 maps X
+    KERNEL_VIRTUAL_BASE equ 0xC0000000      ; Physical memory is mapped from here on (the direct map)
+    KERNEL_PDE_INDEX    equ KERNEL_VIRTUAL_BASE >> 21
+    DIRECT_MAP_PDES     equ 384             ; 768 MiB of 2 MiB pages, up to the kernel heap
+    RECURSIVE_SLOT      equ 2044            ; The last four entries map the directories, so page tables sit at 0xFF800000
+    LARGE_PAGE_SIZE     equ 0x200000
+    LARGE_PAGE_FLAGS    equ 0x83            ; Present, writable, 2 MiB page
+    BOOT_STACK_SIZE     equ 0x4000          ; 16 KiB
+
+section .bss align=4096
+
+; Become the kernel page directories, vmm::init replaces the 2 MiB boot pages
+boot_page_directory:
+    resb 4096 * 4
+
+; What CR3 points at until vmm::init, 32 byte aligned since it follows the directories
+boot_pdpt:
+    resq 4
+
+boot_stack:
+    resb BOOT_STACK_SIZE
+boot_stack_top:
+
+section .text
 
 _start:
+    ; Paging is off and the kernel runs at its physical address, so symbols need the base taken off
+    ; The BSS is zeroed, so the high halves of the entries are already 0
+    mov edi, boot_page_directory - KERNEL_VIRTUAL_BASE
+
+    ; Identity map of the first 4 MiB, only used until the jump below
+    mov dword [edi], LARGE_PAGE_FLAGS
+    mov dword [edi + 8], LARGE_PAGE_SIZE | LARGE_PAGE_FLAGS
+
+    ; Direct map: physical address X at KERNEL_VIRTUAL_BASE + X
+    mov eax, LARGE_PAGE_FLAGS
+    lea ebx, [edi + KERNEL_PDE_INDEX * 8]
+    mov ecx, DIRECT_MAP_PDES
+.direct_map:
+    mov [ebx], eax
+    add eax, LARGE_PAGE_SIZE
+    add ebx, 8
+    loop .direct_map
+
+    ; Recursive slots: present and writable, each pointing at one of the four directories
+    mov eax, edi
+    or eax, 0x3
+    lea ebx, [edi + RECURSIVE_SLOT * 8]
+    mov ecx, 4
+.recursive:
+    mov [ebx], eax
+    add eax, 0x1000
+    add ebx, 8
+    loop .recursive
+
+    ; Pointer table: one present entry per directory
+    mov esi, boot_pdpt - KERNEL_VIRTUAL_BASE
+    mov eax, edi
+    or eax, 0x1
+    mov ecx, 4
+.pointers:
+    mov [esi], eax
+    add eax, 0x1000
+    add esi, 8
+    loop .pointers
+
+    ; Enabling PAE, then paging
+    mov eax, cr4
+    or eax, 0x20
+    mov cr4, eax
+
+    mov eax, boot_pdpt - KERNEL_VIRTUAL_BASE
+    mov cr3, eax
+
+    mov eax, cr0
+    or eax, 0x80000000
+    mov cr0, eax
+
+    ; Absolute jump into the higher half
+    mov eax, .higher_half
+    jmp eax
+
+.higher_half:
+    mov esp, boot_stack_top
+    xor ebp, ebp
 
     call kernel_main ; Connecting to kernel_main.cpp (void kernel_main())
     
 hltloop:
+    call kernel_idle ; Refilling pools while there is nothing else to do
     hlt 
     jmp hltloop
\ No newline at end of file
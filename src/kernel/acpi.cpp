@@ -0,0 +1,141 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// acpi.cpp locates the ACPI tables the firmware left in memory
+// This file contains:
+// Searching for the RSDP, checksums, mapping the tables the RSDT/XSDT lists once, looking them up
+// =======================================================================
+
+#include <acpi.hpp>
+#include <memory/virtual/vmm.hpp>
+#include <drivers/vga_print.hpp>
+
+// Root table, the XSDT has 64-bit entries. Mapped on first use, the VMM needs the PMM for that
+static uint64_t root_address = 0;
+static const acpi_sdt_header* root_table = nullptr;
+static bool extended = false;
+
+// Next free page of the ACPI window
+static uint32_t window_next = KERNEL_ACPI_START;
+
+// Every table the root table lists with a valid checksum, mapped once
+static const acpi_sdt_header* tables[ACPI_MAX_TABLES];
+static uint32_t table_count = 0;
+
+#pragma region Helper Functions
+
+// Every ACPI structure sums to zero over its length
+static bool checksum_valid(const void* address, const uint32_t length) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(address);
+    uint8_t sum = 0;
+    for(uint32_t i = 0; i < length; i++) sum += bytes[i];
+    return sum == 0;
+}
+
+static bool signature_matches(const char* found, const char* wanted, const uint32_t length) {
+    for(uint32_t i = 0; i < length; i++)
+        if(found[i] != wanted[i]) return false;
+    return true;
+}
+
+// The RSDP sits on a 16 byte boundary
+static const acpi_rsdp* scan_rsdp(const uint32_t start, const uint32_t end) {
+    for(uint32_t address = start; address + sizeof(acpi_rsdp) <= end; address += 16) {
+        const acpi_rsdp* rsdp = phys_to_virt<const acpi_rsdp>(address);
+        if(signature_matches(rsdp->signature, "RSD PTR ", 8) && checksum_valid(rsdp, 20))
+            return rsdp;
+    }
+    return nullptr;
+}
+
+/* Maps [address, address + length) into the ACPI window, nullptr once the window is full
+ * Tables are few and small, so they stay mapped. PAE reaches tables above 4 GiB too */
+static const void* map_physical(const uint64_t address, const uint32_t length) {
+    const uint64_t first = address & ~uint64_t(PAGE_SIZE - 1);
+    const uint32_t offset = uint32_t(address - first);
+    const uint32_t pages = (offset + length + PAGE_SIZE - 1) / PAGE_SIZE;
+    if(pages > (KERNEL_ACPI_END - window_next) / PAGE_SIZE) return nullptr;
+
+    const uint32_t mapped = window_next;
+    if(!vmm::map_range(mapped, first, pages, PAGE_PRESENT)) return nullptr;
+    window_next += pages * PAGE_SIZE;
+
+    return reinterpret_cast<const void*>(mapped + offset);
+}
+
+// Maps the header to learn the table's length, then the rest if it did not fit in the same pages
+static const acpi_sdt_header* map_table(const uint64_t address) {
+    const acpi_sdt_header* table = reinterpret_cast<const acpi_sdt_header*>(map_physical(address, sizeof(acpi_sdt_header)));
+    if(!table) return nullptr;
+
+    const uint32_t mapped_end = (uint32_t(table) + sizeof(acpi_sdt_header) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if(uint32_t(table) + table->length <= mapped_end) return table;
+
+    return reinterpret_cast<const acpi_sdt_header*>(map_physical(address, table->length));
+}
+
+#pragma endregion
+
+void acpi::init() {
+    root_address = 0;
+    root_table = nullptr;
+    table_count = 0;
+
+    // First KiB of the EBDA, then the BIOS ROM area, both in the direct map
+    uint32_t ebda = uint32_t(*phys_to_virt<volatile uint16_t>(EBDA_SEGMENT_ADDRESS)) << 4;
+    const acpi_rsdp* rsdp = ebda ? scan_rsdp(ebda, ebda + 1024) : nullptr;
+    if(!rsdp) rsdp = scan_rsdp(BIOS_ROM_START, BIOS_ROM_END);
+
+    if(!rsdp) {
+        vga::printf("ACPI: no RSDP found\n");
+        return;
+    }
+
+    // The XSDT is preferred, wherever it is
+    if(rsdp->revision >= 2 && rsdp->xsdt_address && checksum_valid(rsdp, rsdp->length)) {
+        root_address = rsdp->xsdt_address;
+        extended = true;
+    } else {
+        root_address = rsdp->rsdt_address;
+        extended = false;
+    }
+}
+
+// Maps the root table and every table it lists, the window would fill up if lookups mapped them again
+static bool map_tables() {
+    root_table = map_table(root_address);
+    if(!root_table || !checksum_valid(root_table, root_table->length)) {
+        vga::error("ACPI: root table checksum is invalid!\n");
+        root_address = 0;
+        root_table = nullptr;
+        return false;
+    }
+
+    const uint32_t entry_size = extended ? 8 : 4;
+    const uint32_t entries = (root_table->length - sizeof(acpi_sdt_header)) / entry_size;
+    const uint8_t* first = reinterpret_cast<const uint8_t*>(root_table + 1);
+
+    for(uint32_t i = 0; i < entries && table_count < ACPI_MAX_TABLES; i++) {
+        // Entries are not aligned in the XSDT
+        uint64_t address = 0;
+        for(uint32_t b = 0; b < entry_size; b++)
+            address |= uint64_t(first[i * entry_size + b]) << (b * 8);
+        if(!address) continue;
+
+        const acpi_sdt_header* table = map_table(address);
+        if(table && checksum_valid(table, table->length)) tables[table_count++] = table;
+    }
+    return true;
+}
+
+const acpi_sdt_header* acpi::find_table(const char* signature) {
+    if(!root_address) return nullptr;
+    if(!root_table && !map_tables()) return nullptr;
+
+    for(uint32_t i = 0; i < table_count; i++)
+        if(signature_matches(tables[i]->signature, signature, 4)) return tables[i];
+    return nullptr;
+}
@@ -8,4 +8,59 @@
 // =======================================================================
 
 #include <cpuid.hpp>
+#include <drivers/vga_print.hpp>
 
+cpuid_info_t cpuid::info {};
+
+// Executes CPUID for a leaf
+static void cpuid_leaf(const uint32_t leaf, uint32_t& eax, uint32_t& ebx, uint32_t& ecx, uint32_t& edx) {
+    asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(leaf), "c"(0));
+}
+
+void cpuid::init() {
+    uint32_t eax, ebx, ecx, edx;
+
+    // Leaf 0: vendor string in EBX, EDX, ECX
+    cpuid_leaf(0, eax, ebx, ecx, edx);
+    for(int i = 0; i < 4; i++) {
+        info.vendorString[i] = (ebx >> (i * 8)) & 0xFF;
+        info.vendorString[i + 4] = (edx >> (i * 8)) & 0xFF;
+        info.vendorString[i + 8] = (ecx >> (i * 8)) & 0xFF;
+    }
+    info.nullTerminate = '\0';
+    const uint32_t max_leaf = eax;
+
+    // Leaf 1: feature flags
+    cpuid_leaf(1, eax, ebx, ecx, edx);
+    info.features_ecx = ecx;
+    info.features_edx = edx;
+    info.apic_id = ebx >> 24;
+
+    // Leaf 7: extended feature flags, older CPUs stop at a lower leaf
+    if(max_leaf >= 7) {
+        cpuid_leaf(7, eax, ebx, ecx, edx);
+        info.features_ext_ebx = ebx;
+    }
+
+    vga::printf("CPU: ");
+    vga::printf(info.vendorString);
+    vga::printf('\n');
+}
+
+bool cpuid::has_edx_feature(const uint32_t mask) {
+    return (info.features_edx & mask) == mask;
+}
+
+bool cpuid::has_ext_feature(const uint32_t mask) {
+    return (info.features_ext_ebx & mask) == mask;
+}
+
+// Only the bootstrap processor is started for now, so it is always CPU 0
+uint32_t cpuid::cpu_index() {
+    return 0;
+}
+
+// Same as cpu_index, the bootstrap processor's ID is read once in init
+uint8_t cpuid::apic_id() {
+    return info.apic_id;
+}
@@ -0,0 +1,174 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// ata.cpp contains a polling PIO driver for the primary ATA bus
+// This file contains:
+// IDENTIFY, LBA28 sector reads and writes
+// =======================================================================
+
+#include <drivers/ata.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/ports.hpp>
+
+using namespace ports;
+
+// Register offsets from ATA_PRIMARY_IO
+#define ATA_REG_DATA 0
+#define ATA_REG_ERROR 1
+#define ATA_REG_SECTOR_COUNT 2
+#define ATA_REG_LBA_LOW 3
+#define ATA_REG_LBA_MID 4
+#define ATA_REG_LBA_HIGH 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_STATUS 7
+#define ATA_REG_COMMAND 7
+
+// Status bits
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DRQ 0x08
+#define ATA_STATUS_DF 0x20
+#define ATA_STATUS_BSY 0x80
+
+// Commands
+#define ATA_CMD_READ_PIO 0x20
+#define ATA_CMD_WRITE_PIO 0x30
+#define ATA_CMD_IDENTIFY 0xEC
+
+#define ATA_CONTROL_NIEN 0x02 // No interrupts, the driver polls
+
+struct ata_device {
+    bool present;
+    uint32_t sectors;
+};
+
+static ata_device devices[2];
+static uint8_t selected = 0xFF;
+
+#pragma region Helper Functions
+
+// Reading the alternate status four times takes the 400ns a drive select needs
+static void delay_400ns() {
+    for(int i = 0; i < 4; i++) inPortB(ATA_PRIMARY_CONTROL);
+}
+
+static void select(const uint8_t drive, const uint8_t lba_high_bits) {
+    outPortB(ATA_PRIMARY_IO + ATA_REG_DRIVE, 0xE0 | (drive << 4) | (lba_high_bits & 0x0F));
+    if(selected != drive) delay_400ns();
+    selected = drive;
+}
+
+// Waits until the drive is not busy, then for DRQ if data follows. Returns false on errors
+static bool wait_ready(const bool data) {
+    uint8_t status;
+    while((status = inPortB(ATA_PRIMARY_IO + ATA_REG_STATUS)) & ATA_STATUS_BSY);
+
+    if(status & (ATA_STATUS_ERR | ATA_STATUS_DF)) return false;
+    if(!data) return true;
+
+    while(!((status = inPortB(ATA_PRIMARY_IO + ATA_REG_STATUS)) & (ATA_STATUS_DRQ | ATA_STATUS_ERR | ATA_STATUS_DF)));
+    return !(status & (ATA_STATUS_ERR | ATA_STATUS_DF));
+}
+
+static void identify(const uint8_t drive) {
+    devices[drive].present = false;
+
+    outPortB(ATA_PRIMARY_IO + ATA_REG_DRIVE, 0xA0 | (drive << 4));
+    selected = 0xFF;
+    delay_400ns();
+
+    outPortB(ATA_PRIMARY_IO + ATA_REG_SECTOR_COUNT, 0);
+    outPortB(ATA_PRIMARY_IO + ATA_REG_LBA_LOW, 0);
+    outPortB(ATA_PRIMARY_IO + ATA_REG_LBA_MID, 0);
+    outPortB(ATA_PRIMARY_IO + ATA_REG_LBA_HIGH, 0);
+    outPortB(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+
+    // No drive at all, or a floating bus
+    uint8_t status = inPortB(ATA_PRIMARY_IO + ATA_REG_STATUS);
+    if(status == 0 || status == 0xFF) return;
+    while((status = inPortB(ATA_PRIMARY_IO + ATA_REG_STATUS)) & ATA_STATUS_BSY);
+
+    // ATAPI and SATA devices set the LBA registers and are not supported
+    if(inPortB(ATA_PRIMARY_IO + ATA_REG_LBA_MID) || inPortB(ATA_PRIMARY_IO + ATA_REG_LBA_HIGH)) return;
+    if(!wait_ready(true)) return;
+
+    uint16_t data[256];
+    inPortWords(ATA_PRIMARY_IO + ATA_REG_DATA, data, 256);
+
+    // Words 60 and 61 hold the LBA28 sector count
+    devices[drive].sectors = data[60] | (uint32_t(data[61]) << 16);
+    devices[drive].present = devices[drive].sectors != 0;
+}
+
+// Sends a read or write command for count sectors
+static bool start_transfer(const uint8_t drive, const uint32_t lba, const uint32_t count, const uint8_t command) {
+    if(drive > ATA_SLAVE || !devices[drive].present || count == 0 || count > 256 ||
+       lba + count > devices[drive].sectors) {
+        vga::error("ATA: invalid transfer!\n");
+        return false;
+    }
+
+    select(drive, lba >> 24);
+    if(!wait_ready(false)) return false;
+
+    outPortB(ATA_PRIMARY_IO + ATA_REG_SECTOR_COUNT, count & 0xFF); // 0 means 256
+    outPortB(ATA_PRIMARY_IO + ATA_REG_LBA_LOW, lba & 0xFF);
+    outPortB(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
+    outPortB(ATA_PRIMARY_IO + ATA_REG_LBA_HIGH, (lba >> 16) & 0xFF);
+    outPortB(ATA_PRIMARY_IO + ATA_REG_COMMAND, command);
+    return true;
+}
+
+#pragma endregion
+
+void ata::init() {
+    outPortB(ATA_PRIMARY_CONTROL, ATA_CONTROL_NIEN);
+
+    identify(ATA_MASTER);
+    identify(ATA_SLAVE);
+
+    vga::printf("ATA drives: ");
+    vga::printf(devices[ATA_MASTER].present ? "master " : "");
+    vga::printf(devices[ATA_SLAVE].present ? "slave" : "");
+    vga::printf('\n');
+}
+
+bool ata::present(const uint8_t drive) {
+    return drive <= ATA_SLAVE && devices[drive].present;
+}
+
+uint32_t ata::sector_count(const uint8_t drive) {
+    return present(drive) ? devices[drive].sectors : 0;
+}
+
+bool ata::read_sectors(const uint8_t drive, const uint32_t lba, const uint32_t count, void* buffer) {
+    if(!start_transfer(drive, lba, count, ATA_CMD_READ_PIO)) return false;
+
+    uint16_t* words = reinterpret_cast<uint16_t*>(buffer);
+    for(uint32_t i = 0; i < count; i++) {
+        if(!wait_ready(true)) {
+            vga::error("ATA: read failed!\n");
+            return false;
+        }
+        inPortWords(ATA_PRIMARY_IO + ATA_REG_DATA, words + i * (ATA_SECTOR_SIZE / 2), ATA_SECTOR_SIZE / 2);
+    }
+    return true;
+}
+
+bool ata::write_sectors(const uint8_t drive, const uint32_t lba, const uint32_t count, const void* buffer) {
+    if(!start_transfer(drive, lba, count, ATA_CMD_WRITE_PIO)) return false;
+
+    const uint16_t* words = reinterpret_cast<const uint16_t*>(buffer);
+    for(uint32_t i = 0; i < count; i++) {
+        if(!wait_ready(true)) {
+            vga::error("ATA: write failed!\n");
+            return false;
+        }
+        outPortWords(ATA_PRIMARY_IO + ATA_REG_DATA, words + i * (ATA_SECTOR_SIZE / 2), ATA_SECTOR_SIZE / 2);
+    }
+
+    // The command is complete once the drive is no longer busy
+    return wait_ready(false);
+}
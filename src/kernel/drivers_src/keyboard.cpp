@@ -11,12 +11,18 @@
 #include <utils/ports.hpp>
 #include <drivers/vga_print.hpp>
 #include <idt/idt.hpp>
+#include <memory/memtrace.hpp>
+#include <memory/memstats.hpp>
 
 using namespace ports;
 using namespace keyboard;
 
 bool capsOn, capsLock; // Two bool variables to manage lowercase and uppercase
 
+// Set by F11 and F12, the reports are too slow to print with interrupts off so keyboard::run_requests does it
+volatile bool statsRequested = false;
+volatile bool traceRequested = false;
+
 void keyboardHandler(InterruptRegisters* regs) {
     // Getting scancode and press state
     uint8_t scancode = inPortB(KBD_DATA_PORT) & 0x7F;
@@ -38,8 +44,18 @@ void keyboardHandler(InterruptRegisters* regs) {
         case 66:
         case 67:
         case 68:
+            break;
+
         case 87:
+            // F11 prints the memory statistics
+            if(press_state == 0)
+                statsRequested = true;
+            break;
+
         case 88:
+            // F12 exports the allocation trace over COM1
+            if(press_state == 0)
+                traceRequested = true;
             break;
 
         case 14:
@@ -86,4 +102,18 @@ void keyboard::init() {
     // Setting up IRQ handler
     idt::irq_install_handler(1,&keyboardHandler);
     vga::printf("Initialized keyboard drivers!\n");
+}
+
+void keyboard::run_requests() {
+    if(statsRequested) {
+        statsRequested = false;
+        memstats::print();
+    }
+
+    if(traceRequested) {
+        traceRequested = false;
+        #ifdef MEM_TRACE
+        memtrace::dump();
+        #endif
+    }
 }
\ No newline at end of file
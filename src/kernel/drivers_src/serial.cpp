@@ -0,0 +1,62 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// serial.cpp contains a polling COM1 driver for sending logs to the host
+// This file contains:
+// Port setup, writing characters, strings and hex numbers
+// =======================================================================
+
+#include <drivers/serial.hpp>
+#include <utils/ports.hpp>
+
+using namespace ports;
+
+// Set once the port is programmed, writes before that are dropped
+static bool ready = false;
+
+static char nibble_to_hex(const uint8_t nibble) {
+    return nibble < 10 ? '0' + nibble : 'A' + nibble - 10;
+}
+
+void serial::init() {
+    outPortB(COM1_PORT + 1, 0x00); // No interrupts
+    outPortB(COM1_PORT + 3, 0x80); // Divisor latch on
+    outPortB(COM1_PORT + 0, SERIAL_BAUD_DIVISOR & 0xFF);
+    outPortB(COM1_PORT + 1, SERIAL_BAUD_DIVISOR >> 8);
+    outPortB(COM1_PORT + 3, 0x03); // 8 bits, no parity, one stop bit
+    outPortB(COM1_PORT + 2, 0xC7); // FIFO on and cleared, 14 byte threshold
+    outPortB(COM1_PORT + 4, 0x03); // DTR and RTS
+
+    // A missing port reads back as 0xFF
+    ready = inPortB(COM1_PORT + 5) != 0xFF;
+}
+
+void serial::write(const char print_object) {
+    if(!ready) return;
+
+    // Waiting for the transmit holding register to empty
+    while(!(inPortB(COM1_PORT + 5) & 0x20));
+    outPortB(COM1_PORT, print_object);
+}
+
+void serial::write(const char* print_object) {
+    for(uint32_t i = 0; print_object[i]; i++) {
+        if(print_object[i] == '\n') write('\r');
+        write(print_object[i]);
+    }
+}
+
+void serial::write(const uint32_t print_object) {
+    write("0x");
+    for(int shift = 28; shift >= 0; shift -= 4)
+        write(nibble_to_hex((print_object >> shift) & 0xF));
+}
+
+void serial::write(const uint64_t print_object) {
+    write("0x");
+    for(int shift = 60; shift >= 0; shift -= 4)
+        write(nibble_to_hex((print_object >> shift) & 0xF));
+}
@@ -11,6 +11,7 @@
 
 #include <drivers/vga_print.hpp>
 #include <utils/ports.hpp>
+#include <utils/string.hpp>
 
 #pragma region Variables
 
@@ -32,6 +33,9 @@ uint8_t color = PRINT_COLOR_WHITE | (PRINT_COLOR_BLACK << 4); // Standard white
 
 bool printingString = false;
 
+// Text buffer, the direct map until vga::set_buffer moves it to another mapping
+uint32_t bufferAddress = VGA_ADDRESS;
+
 #pragma endregion
 
 
@@ -43,7 +47,7 @@ bool printingString = false;
 
 // Clears indicated line
 void clear_row(const size_t row) {
-    Char* buffer = reinterpret_cast<Char*>(VGA_ADDRESS);
+    Char* buffer = reinterpret_cast<Char*>(bufferAddress);
 
     // Creating an empty struct
     Char empty {' ', color};
@@ -57,7 +61,7 @@ void clear_row(const size_t row) {
 void update_cursor(const int row, const int col);
 
 void print_newline() {
-    Char* buffer = reinterpret_cast<Char*>(VGA_ADDRESS);
+    Char* buffer = reinterpret_cast<Char*>(bufferAddress);
 
     col = 0;
 
@@ -65,14 +69,8 @@ void print_newline() {
     if(row < NUM_ROWS - 1) {
         ++row;
     } else {
-        // Scrolling the screen up
-
-        for(size_t r = 1; r < NUM_ROWS; ++r) {
-            for(size_t c = 0; c < NUM_COLS; ++c) {
-                // Copying this row to the one above
-                buffer[c + NUM_COLS * (r - 1)] = buffer[c + NUM_COLS * r];
-            }   
-        }
+        // Scrolling the screen up, every row moves to the one above
+        memmove(buffer, buffer + NUM_COLS, NUM_COLS * (NUM_ROWS - 1) * sizeof(Char));
 
         clear_row(NUM_ROWS - 1);
     }
@@ -110,7 +108,7 @@ void update_cursor(const int row, const int col) {
 #pragma region Print Functions
 
 void print_char(const char character) {
-    Char* buffer = reinterpret_cast<Char*>(VGA_ADDRESS);
+    Char* buffer = reinterpret_cast<Char*>(bufferAddress);
     
     // Handeling new line character input
     if(character == '\n') {
@@ -180,6 +178,10 @@ void init() {
     printf(" ==================================== IoOS ==================================== \n");
 }
 
+void set_buffer(void* address) {
+    bufferAddress = uint32_t(address);
+}
+
 // Print formatted overloads
 
 void printf(const char print_object) {
@@ -241,7 +243,7 @@ void print_clear() {
 
 // Backspace
 void backspace() {
-    Char* buffer = reinterpret_cast<Char*>(VGA_ADDRESS);
+    Char* buffer = reinterpret_cast<Char*>(bufferAddress);
 
     if (row * NUM_COLS + col > 0) {
         // Decrementing column variable
@@ -0,0 +1,234 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// fpu.cpp manages the x87 and SSE registers
+// This file contains:
+// Enabling FXSR and SSE, lazy saving and restoring through CR0.TS and #NM,
+// kernel FPU sections
+// =======================================================================
+
+#include <fpu.hpp>
+#include <cpuid.hpp>
+#include <idt/idt.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+fpu::fpu_stats_t fpu::stats;
+
+static bool fpu_enabled = false;
+
+static fpu_context_t kernel_context; // The boot context, running until the first switch
+static fpu_context_t reset_state;    // What a context that never used the FPU starts with
+
+static fpu_context_t* current = nullptr; // Context that is running
+static fpu_context_t* owner = nullptr;   // Context whose state is in the registers, nullptr if none
+static bool in_section = false;          // Between kernel_fpu_begin and kernel_fpu_end
+
+#pragma region Helper Functions
+
+static inline void clear_ts() {
+    asm volatile ("clts" : : : "memory");
+}
+
+static inline void set_ts() {
+    uint32_t cr0;
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile ("mov %0, %%cr0" : : "r"(cr0 | CR0_TS) : "memory");
+}
+
+static inline void fxsave(fpu_context_t* context) {
+    asm volatile ("fxsave (%0)" : : "r"(context->area) : "memory");
+}
+
+static inline void fxrstor(const fpu_context_t* context) {
+    asm volatile ("fxrstor (%0)" : : "r"(context->area) : "memory");
+}
+
+// Writes the owner's registers back to its area, the registers are free afterwards
+static void save_owner() {
+    if(!owner) return;
+    fxsave(owner);
+    owner->used = true;
+    owner = nullptr;
+    fpu::stats.saves++;
+}
+
+// #NM: the running context touched the FPU after a switch or a kernel section, its state gets loaded now
+static bool device_not_available(InterruptRegisters*) {
+    clear_ts();
+    fpu::stats.traps++;
+    if(owner == current) return true;
+
+    save_owner();
+    fxrstor(current->used ? current : &reset_state);
+    current->used = true;
+    owner = current;
+    fpu::stats.restores++;
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Contexts
+
+void fpu::init() {
+    if(!cpuid::has_edx_feature(CPUID_FEAT_EDX_FXSR | CPUID_FEAT_EDX_SSE2)) {
+        vga::printf("FPU: no FXSR or SSE2, vector registers stay disabled\n");
+        return;
+    }
+
+    uint32_t cr0, cr4;
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile ("mov %0, %%cr0" : : "r"(((cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE)) : "memory");
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4 | CR4_OSFXSR | CR4_OSXMMEXCPT) : "memory");
+
+    // The reset state: x87 initialized, SIMD exceptions masked, XMM registers zeroed (FNINIT leaves them alone)
+    const uint32_t mxcsr = MXCSR_DEFAULT;
+    asm volatile ("fninit\n\tldmxcsr %0" : : "m"(mxcsr));
+    fxsave(&reset_state);
+    memset(reset_state.area + 160, 0, 256);
+
+    idt::isr_install_handler(7, &device_not_available);
+
+    init_context(&kernel_context);
+    current = &kernel_context;
+    owner = nullptr;
+    fpu_enabled = true;
+    set_ts();
+}
+
+bool fpu::enabled() {
+    return fpu_enabled;
+}
+
+void fpu::init_context(fpu_context_t* context) {
+    context->used = false;
+}
+
+// Switching never touches the registers, CR0.TS makes the next FPU instruction load them. No switch may happen inside a kernel section
+void fpu::switch_context(fpu_context_t* context) {
+    uint32_t flags = irq_save();
+    current = context;
+    if(fpu_enabled) {
+        if(owner == context) clear_ts();
+        else set_ts();
+    }
+    irq_restore(flags);
+}
+
+void fpu::release_context(fpu_context_t* context) {
+    uint32_t flags = irq_save();
+    if(owner == context) owner = nullptr;
+    irq_restore(flags);
+}
+
+#pragma endregion
+
+#pragma region Kernel Sections
+
+bool kernel_fpu_begin() {
+    if(!fpu_enabled) return false;
+
+    uint32_t flags = irq_save();
+    if(in_section) {
+        fpu::stats.kernel_fallbacks++;
+        irq_restore(flags);
+        return false;
+    }
+    in_section = true;
+
+    // The registers may hold a context's state, it is saved once here instead of on every interrupt
+    clear_ts();
+    save_owner();
+    fpu::stats.kernel_sections++;
+    irq_restore(flags);
+    return true;
+}
+
+void kernel_fpu_end() {
+    uint32_t flags = irq_save();
+    in_section = false;
+    // The section left garbage in the registers, the running context reloads its state on its next FPU instruction
+    set_ts();
+    irq_restore(flags);
+}
+
+#pragma endregion
+
+#pragma region Statistics and Testing
+
+void fpu::print_stats() {
+    vga::printf("FPU: traps ");
+    vga::printf(stats.traps);
+    vga::printf(", saves ");
+    vga::printf(stats.saves);
+    vga::printf(", restores ");
+    vga::printf(stats.restores);
+    vga::printf(", kernel sections ");
+    vga::printf(stats.kernel_sections);
+    vga::printf(" (refused ");
+    vga::printf(stats.kernel_fallbacks);
+    vga::printf(")\n");
+}
+
+// The kernel is built without SSE, so XMM0 is only reached through inline assembly
+static void write_xmm0(const uint32_t value) {
+    const uint32_t words[4] = {value, value, value, value};
+    asm volatile ("movdqu %0, %%xmm0" : : "m"(words));
+}
+
+static uint32_t read_xmm0() {
+    uint32_t words[4];
+    asm volatile ("movdqu %%xmm0, %0" : "=m"(words));
+    return words[0];
+}
+
+void fpu::test_fpu() {
+    if(!fpu_enabled) {
+        vga::error("FPU test needs FXSR and SSE2!\n");
+        return;
+    }
+
+    static fpu_context_t first, second;
+    fpu_context_t* previous = current;
+    const uint32_t trapsBefore = stats.traps;
+
+    init_context(&first);
+    init_context(&second);
+
+    switch_context(&first);
+    write_xmm0(0x11111111);
+    switch_context(&second);
+    if(read_xmm0() != 0) vga::error("A fresh context did not start from the reset state!\n");
+    write_xmm0(0x22222222);
+
+    switch_context(&first);
+    if(read_xmm0() != 0x11111111) vga::error("First context lost its XMM0!\n");
+
+    // A kernel section clobbers the registers, the context gets them back afterwards
+    if(!kernel_fpu_begin()) {
+        vga::error("Kernel FPU section was refused!\n");
+    } else {
+        if(kernel_fpu_begin()) vga::error("Kernel FPU sections nested!\n");
+        write_xmm0(0x33333333);
+        kernel_fpu_end();
+    }
+    if(read_xmm0() != 0x11111111) vga::error("Kernel section leaked into the context!\n");
+
+    switch_context(&second);
+    if(read_xmm0() != 0x22222222) vga::error("Second context lost its XMM0!\n");
+
+    // Every switch to a context that did not own the registers trapped once
+    if(stats.traps - trapsBefore != 5) vga::error("FPU state was not loaded lazily!\n");
+
+    switch_context(previous);
+    release_context(&first);
+    release_context(&second);
+    print_stats();
+}
+
+#pragma endregion
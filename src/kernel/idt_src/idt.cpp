@@ -163,10 +163,21 @@ const char* idt::exception_messages[] = {
 };
 
 
+// Exception handlers that can recover, e.g. the page fault handler
+bool (*isr_routines[32])(struct InterruptRegisters* regs) = {};
+
+void idt::isr_install_handler(const int isr_num, bool (*handler)(struct InterruptRegisters* regs)) {
+    isr_routines[isr_num] = handler;
+}
+
 // Interrupt Service Routine error message
 extern "C" void isr_handler(struct InterruptRegisters* regs) {
 
     if(regs->interr_no < 32) {
+        // Returning resumes the faulting instruction
+        if(isr_routines[regs->interr_no] && isr_routines[regs->interr_no](regs))
+            return;
+
         kernel_panic(regs->interr_no);
     }
 }
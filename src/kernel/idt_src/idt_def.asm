@@ -127,6 +127,7 @@ isr_common_stub:
     mov es, ax
     mov fs, ax
     mov gs, ax
+    cld ; C code expects the direction flag clear, IRET brings back the interrupted code's
 
     push esp
     call isr_handler
@@ -163,6 +164,7 @@ irq_common_stub:
     mov es, ax
     mov fs, ax
     mov gs, ax
+    cld ; C code expects the direction flag clear, IRET brings back the interrupted code's
 
     push esp
     call irq_handler
@@ -0,0 +1,55 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef ACPI_HPP
+#define ACPI_HPP
+
+#include <stdint.h>
+
+#define EBDA_SEGMENT_ADDRESS 0x40E // BIOS data area word holding the EBDA segment
+#define BIOS_ROM_START 0xE0000
+#define BIOS_ROM_END 0x100000
+#define ACPI_MAX_TABLES 64 // Tables listed by the root table that get mapped and kept
+
+// Header shared by every ACPI table
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length; // Whole table, header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// Root System Description Pointer, version 2 fields are only valid if revision >= 2
+struct acpi_rsdp {
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+namespace acpi {
+    // Finds the RSDP and the root table's address, works before the PMM is up
+    void init();
+
+    // First table with this signature mapped in the ACPI window, nullptr if missing or invalid
+    // The first call maps every table once, so the PMM has to be initialized. Later calls only search them
+    const acpi_sdt_header* find_table(const char* signature);
+} // Namespace acpi
+
+#endif // ACPI_HPP
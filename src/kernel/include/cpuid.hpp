@@ -12,6 +12,17 @@
 
 #include <stdint.h>
 
+#define MAX_CPUS 8
+
+// Feature bits returned by CPUID leaf 1 in EDX
+#define CPUID_FEAT_EDX_PGE (1 << 13)
+#define CPUID_FEAT_EDX_PAT (1 << 16)
+#define CPUID_FEAT_EDX_FXSR (1 << 24)
+#define CPUID_FEAT_EDX_SSE2 (1 << 26)
+
+// Feature bits returned by CPUID leaf 7 in EBX
+#define CPUID_FEAT_EXT_EBX_ERMS (1 << 9) // Enhanced rep movsb and rep stosb
+
 // CPUID info struct
 struct cpuid_info_t {
     char vendorString[12];
@@ -19,6 +30,24 @@ struct cpuid_info_t {
 
     uint32_t features_ecx;
     uint32_t features_edx;
+    uint32_t features_ext_ebx; // Leaf 7, 0 if the CPU does not have it
+    uint8_t apic_id; // Initial local APIC ID, from leaf 1
 } __attribute__((packed));
 
+namespace cpuid {
+    void init(); // Reads the vendor string and feature flags
+
+    extern cpuid_info_t info;
+
+    // Returns true if every bit of the mask is set in EDX of leaf 1
+    bool has_edx_feature(const uint32_t mask);
+    // Returns true if every bit of the mask is set in EBX of leaf 7
+    bool has_ext_feature(const uint32_t mask);
+
+    // Index of the executing CPU, used for per-CPU data
+    uint32_t cpu_index();
+    // Local APIC ID of the executing CPU, used for NUMA node lookups
+    uint8_t apic_id();
+} // Namespace cpuid
+
 #endif // CPUID_HPP
\ No newline at end of file
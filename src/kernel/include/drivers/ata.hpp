@@ -0,0 +1,36 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef ATA_HPP
+#define ATA_HPP
+
+#include <stdint.h>
+
+// Primary bus, the boot disk is the master
+#define ATA_PRIMARY_IO 0x1F0
+#define ATA_PRIMARY_CONTROL 0x3F6
+#define ATA_SECTOR_SIZE 512
+
+#define ATA_MASTER 0
+#define ATA_SLAVE 1
+
+namespace ata {
+    void init(); // Identifies both drives on the primary bus, interrupts stay off
+
+    // True if an ATA disk answered IDENTIFY
+    bool present(const uint8_t drive);
+    // Number of LBA28 addressable sectors
+    uint32_t sector_count(const uint8_t drive);
+
+    // PIO transfers of count sectors (1 - 256), polling. Return false on a device error
+    bool read_sectors(const uint8_t drive, const uint32_t lba, const uint32_t count, void* buffer);
+    bool write_sectors(const uint8_t drive, const uint32_t lba, const uint32_t count, const void* buffer);
+} // Namespace ata
+
+#endif // ATA_HPP
@@ -17,6 +17,7 @@
 namespace keyboard {
 
     void init(); // Initializes keyboard driver
+    void run_requests(); // Prints what F11 and F12 asked for, called from the idle loop
 
 #pragma region Key Codes
     
@@ -0,0 +1,30 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef SERIAL_HPP
+#define SERIAL_HPP
+
+#define COM1_PORT 0x3F8
+#define SERIAL_BAUD_DIVISOR 3 // 115200 / 3 = 38400 baud
+
+#include <stdint.h>
+
+namespace serial {
+
+void init(); // Initializes COM1, output only
+
+// Serial printing functions, numbers are written in hex like vga::printf
+void write(const char print_object);
+void write(const char* print_object);
+void write(const uint32_t print_object);
+void write(const uint64_t print_object);
+
+} // Namespace serial
+
+#endif // SERIAL_HPP
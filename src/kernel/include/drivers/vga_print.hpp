@@ -10,7 +10,9 @@
 #ifndef VGA_PRINT_HPP
 #define VGA_PRINT_HPP
 
-#define VGA_ADDRESS 0xB8000 // VGA address
+#define VGA_PHYSICAL 0xB8000   // VGA text buffer
+#define VGA_ADDRESS 0xC00B8000 // VGA text buffer in the direct map
+#define VGA_SIZE 0x8000        // The text mode window, up to 0xC0000
 
 #include <stdint.h>
 #include <stddef.h>
@@ -40,6 +42,7 @@ enum VGA_Print_Colors {
 namespace vga {
 
 void init(); // Initializes VGA text
+void set_buffer(void* address); // Writes go through another mapping of VGA_PHYSICAL from now on, like a write-combining one
 
 // VGA printing functions
 
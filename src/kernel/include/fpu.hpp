@@ -0,0 +1,66 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef FPU_HPP
+#define FPU_HPP
+
+#include <stdint.h>
+
+#define FXSAVE_SIZE 512
+#define MXCSR_DEFAULT 0x1F80 // Every SIMD floating point exception masked, round to nearest
+
+// CR0 and CR4 bits that let the kernel use the FPU and SSE
+#define CR0_MP 0x2           // WAIT checks TS too
+#define CR0_EM 0x4           // x87 and SSE instructions fault when set
+#define CR0_TS 0x8           // The next FPU or SSE instruction raises #NM
+#define CR0_NE 0x20          // x87 errors are reported with #MF instead of IRQ 13
+#define CR4_OSFXSR 0x200     // FXSAVE, FXRSTOR and SSE instructions are enabled
+#define CR4_OSXMMEXCPT 0x400 // SIMD floating point exceptions are reported with #XM
+
+// x87 and SSE registers of one execution context, FXSAVE needs them 16 byte aligned
+struct fpu_context_t {
+    uint8_t area[FXSAVE_SIZE];
+    bool used; // Holds saved state, a context that never touched the FPU starts from the reset state
+} __attribute__((aligned(16)));
+
+namespace fpu {
+
+/* Enables FXSR and SSE if the CPU has them and installs the #NM handler, needs the IDT.
+ * Leaves CR0.TS set, the first FPU instruction of a context loads its state */
+void init();
+bool enabled(); // False on CPUs without FXSR and SSE2, nothing may use XMM registers then
+
+void init_context(fpu_context_t* context); // A fresh context, its first FPU use gets the reset state
+/* Makes context the one running. Its registers are only loaded on its first FPU instruction,
+ * contexts that never touch the FPU cost nothing */
+void switch_context(fpu_context_t* context);
+void release_context(fpu_context_t* context); // Before freeing a context, the live registers may still belong to it
+
+struct fpu_stats_t {
+    uint32_t traps;             // #NM exceptions handled
+    uint32_t saves;             // FXSAVEs of a context's registers
+    uint32_t restores;          // FXRSTORs of a context's registers
+    uint32_t kernel_sections;   // kernel_fpu_begin calls that got the registers
+    uint32_t kernel_fallbacks;  // kernel_fpu_begin calls refused because a section was already running
+};
+extern fpu_stats_t stats;
+
+void print_stats();
+// Two contexts keeping different XMM values across switches, and a kernel section in between
+void test_fpu();
+
+} // namespace fpu
+
+/* Lets kernel code use the XMM registers until kernel_fpu_end. Saves the registers of the context that owns them
+ * first, so interrupts never have to. Returns false if a section is already running (an interrupt came during one),
+ * the caller has to do its work without vector registers then */
+bool kernel_fpu_begin();
+void kernel_fpu_end();
+
+#endif // FPU_HPP
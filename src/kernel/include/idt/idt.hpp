@@ -36,12 +36,16 @@ struct idt_ptr {
 
 #pragma region IDT Functions
 
+struct InterruptRegisters;
+
 namespace idt {
 
 void init(); // Initializes IDT
 void setIdtGate(const uint8_t num, const uint32_t base, const uint16_t selector, const uint8_t flags);
 extern "C" void irq_install_handler(int irq_num, void (*handler)(struct InterruptRegisters* regs));
 extern "C" void irq_uninstall_handler(int irq_num);
+// Exception handlers return true if they resolved the exception, otherwise the kernel panics
+void isr_install_handler(const int isr_num, bool (*handler)(InterruptRegisters* regs));
 
 // This will frow an ISR. If it successfully throws an ISR that means it works
 void test_isr();
@@ -11,5 +11,6 @@
 #define KERNEL_MAIN_HPP
 
 extern "C" void kernel_main();
+extern "C" void kernel_idle(); // Background work, called from the idle loop in kernel_entry.asm
 
 #endif // KERNEL_MAIN_HPP
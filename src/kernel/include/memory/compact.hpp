@@ -0,0 +1,46 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef COMPACT_HPP
+#define COMPACT_HPP
+
+#include <stdint.h>
+#include <pit.hpp>
+#include <memory/physical/pmm.hpp>
+
+#define COMPACT_BLOCK_FRAMES 1024 // Compaction empties one aligned 4 MiB block at a time
+#define COMPACT_BLOCK_SIZE (COMPACT_BLOCK_FRAMES * BLOCK_SIZE)
+#define COMPACT_FRAGMENTATION 75 // The idle loop compacts above this fragmentation (percent)
+#define COMPACT_CHECK_TICKS PIT_FREQUENCY // Fragmentation is checked once a second
+#define COMPACT_BACKOFF_TICKS (PIT_FREQUENCY * 30) // Wait after a pass that found nothing to do
+
+namespace compact {
+
+/* Empties the cheapest 4 MiB aligned block that only holds free and movable frames.
+ * Movable frames are the ones behind the kernel heap and the anonymous window, they are
+ * copied to frames outside the block and remapped. Returns true if the block was freed */
+bool run();
+
+// Compacts when free memory is fragmented past COMPACT_FRAGMENTATION, called from the idle loop
+void balance();
+
+struct compact_stats_t {
+    uint32_t runs;         // Passes started
+    uint32_t blocks_freed; // 4 MiB blocks handed back to the bitmap
+    uint32_t pages_moved;  // Pages copied to a new frame
+    uint32_t last_moved;   // Pages moved by the last pass
+    uint32_t failures;     // Passes that found no block or had to give up
+};
+extern compact_stats_t stats;
+
+void print_stats();
+
+} // namespace compact
+
+#endif // COMPACT_HPP
@@ -0,0 +1,50 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef MEMSTATS_HPP
+#define MEMSTATS_HPP
+
+#include <stdint.h>
+#include <pit.hpp>
+
+#define MEMSTATS_SAMPLE_TICKS PIT_FREQUENCY        // Rates are measured over one second
+#define MEMSTATS_REPORT_TICKS (PIT_FREQUENCY * 60) // Serial report once a minute, 0 turns it off
+
+namespace memstats {
+
+// Everything the report shows, gathered at one point in time
+struct snapshot_t {
+    uint32_t total_frames;     // Frames managed by the PMM
+    uint32_t free_frames;      // Free in the bitmap plus frames cached in magazines
+    uint32_t cached_frames;    // Free frames sitting in magazines
+    uint32_t largest_free_run; // Longest run of free frames in the bitmap
+    uint32_t alloc_rate;       // Frames allocated per second, last sample
+    uint32_t free_rate;        // Frames freed per second, last sample
+    uint32_t alloc_failures;
+    uint32_t fault_rate;       // Page faults resolved per second, last sample
+    uint32_t page_table_pages; // Frames used for paging structures
+    uint32_t heap_mapped_pages;
+    uint32_t heap_used_pages;
+    uint32_t heap_high_water_pages;
+    uint32_t kmalloc_bytes;    // Bytes handed out by kmalloc
+};
+
+// Reads every counter, the bitmap scans make this cost O(frames / 64)
+snapshot_t collect();
+
+// Samples the allocation rates and sends the periodic serial report, called from the idle loop
+void update();
+
+// Full report with per region usage, on screen (F11) or over COM1
+void print();
+void report_serial();
+
+} // namespace memstats
+
+#endif // MEMSTATS_HPP
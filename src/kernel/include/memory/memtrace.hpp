@@ -0,0 +1,62 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef MEMTRACE_HPP
+#define MEMTRACE_HPP
+
+#include <stdint.h>
+
+#define MEMTRACE_RING_SIZE 4096 // Newest events kept, must be a power of two
+#define MEMTRACE_SITES 512      // Distinct call sites, must be a power of two
+#define MEMTRACE_LIVE 16384     // Live allocations tracked, must be a power of two
+
+// Allocator entry points that get traced
+enum memtrace_kind : uint8_t {
+    MEMTRACE_KMALLOC,
+    MEMTRACE_KFREE,
+    MEMTRACE_LEGACY_MALLOC,
+    MEMTRACE_FRAME_ALLOC,  // pmm::allocate_frame
+    MEMTRACE_FRAME_FREE,   // pmm::free_frame
+    MEMTRACE_BLOCK_ALLOC,  // pmm::allocate_frames (buddy)
+    MEMTRACE_BLOCK_FREE,   // pmm::free_frames (buddy)
+    MEMTRACE_HEAP_ALLOC,   // heap::allocate_pages
+    MEMTRACE_HEAP_FREE     // heap::free_pages
+};
+
+/* Tracing is only compiled in with "make MEM_TRACE=1", otherwise the hooks are empty.
+ * The hooks have to sit in the allocator itself, so the return address is its caller */
+#ifdef MEM_TRACE
+
+namespace memtrace {
+
+// Records an allocation of size bytes at address, made by caller
+void record_alloc(const memtrace_kind kind, const uint32_t caller, const uint32_t address, const uint32_t size);
+// Records a free, the bytes are taken off the call site that allocated address
+void record_free(const memtrace_kind kind, const uint32_t caller, const uint32_t address);
+
+// Writes the event ring and the call site table to COM1, for scripts/symbolize_memtrace.py
+void dump();
+// Prints the totals on screen
+void print_summary();
+
+} // namespace memtrace
+
+#define MEM_TRACE_ALLOC(kind, address, size) \
+    memtrace::record_alloc(kind, uint32_t(__builtin_return_address(0)), uint32_t(address), size)
+#define MEM_TRACE_FREE(kind, address) \
+    memtrace::record_free(kind, uint32_t(__builtin_return_address(0)), uint32_t(address))
+
+#else
+
+#define MEM_TRACE_ALLOC(kind, address, size) ((void)0)
+#define MEM_TRACE_FREE(kind, address) ((void)0)
+
+#endif // MEM_TRACE
+
+#endif // MEMTRACE_HPP
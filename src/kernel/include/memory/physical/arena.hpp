@@ -0,0 +1,67 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_CHUNK_ORDER 2 // Chunks are at least 2^2 pages (16 KiB)
+#define ARENA_POOL_KEEP 16  // Released chunks kept for reuse, the rest goes back to the PMM
+
+struct arena_chunk;
+
+/* Memory for allocations that all die together. Objects are bump allocated
+ * and never freed one by one, the whole arena is released at once.
+ * A zeroed arena is empty and ready to use */
+struct arena {
+    arena_chunk* chunks; // Newest first, allocations come from the first one
+    arena_chunk* last;   // Oldest chunk, lets release splice the list in O(1)
+    uint32_t chunk_count;
+    uint32_t allocations;
+    uint32_t bytes;      // Bytes handed out, alignment padding included
+};
+
+// Position in an arena to roll back to
+struct arena_checkpoint {
+    arena_chunk* chunk;
+    uint32_t used;
+    uint32_t allocations;
+    uint32_t bytes;
+};
+
+void arena_init(arena* a);
+// Bump allocates size bytes, align has to be a power of two. Returns nullptr on failure
+void* arena_alloc(arena* a, size_t size, size_t align = 8);
+
+arena_checkpoint arena_save(const arena* a);
+// Frees everything allocated since the checkpoint was taken
+void arena_rollback(arena* a, const arena_checkpoint& checkpoint);
+// Frees everything in the arena in O(1), its chunks are pooled for the next arena
+void arena_release(arena* a);
+
+// Gives pooled chunks back to the PMM until at most keep are left
+void arena_trim_pool(const uint32_t keep);
+
+// Rolls an arena back when it goes out of scope
+class arena_scope {
+public:
+    explicit arena_scope(arena* a) : a(a), checkpoint(arena_save(a)) {}
+    ~arena_scope() { arena_rollback(a, checkpoint); }
+
+private:
+    arena* a;
+    arena_checkpoint checkpoint;
+};
+
+// Testing bump allocation, checkpoints and chunk reuse
+void test_arena();
+
+#endif // ARENA_HPP
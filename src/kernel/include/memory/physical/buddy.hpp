@@ -0,0 +1,45 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef BUDDY_HPP
+#define BUDDY_HPP
+
+#include <stdint.h>
+
+#define BUDDY_MAX_ORDER 10 // 2^10 blocks = 4 MiB
+#define BUDDY_ORDERS (BUDDY_MAX_ORDER + 1)
+#define BUDDY_MAX_CHUNKS 256 // At most 256 * 4 MiB = 1 GiB owned by the buddy allocator
+
+namespace pmm {
+
+// Per order counters, used for watching fragmentation
+struct buddy_order_stats {
+    uint32_t free_count;  // Free blocks of this order right now
+    uint32_t allocs;      // Successful allocations of this order
+    uint32_t frees;       // Frees of this order
+    uint32_t splits;      // Blocks of this order split into two halves
+    uint32_t merges;      // Buddy pairs of this order merged into one block
+    uint32_t failures;    // Allocations of this order that could not be satisfied
+};
+
+extern buddy_order_stats buddy_stats[BUDDY_ORDERS];
+
+// Allocates 2^order physically contiguous blocks, aligned to their size
+uint32_t allocate_frames(const uint8_t order);
+// Frees 2^order blocks previously returned by allocate_frames
+void free_frames(const uint32_t address, const uint8_t order);
+
+// Prints the per order counters
+void print_buddy_stats();
+// Testing splitting and coalescing
+void test_buddy();
+
+} // namespace pmm
+
+#endif // BUDDY_HPP
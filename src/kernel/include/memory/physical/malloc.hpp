@@ -13,12 +13,35 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define KMALLOC_MIN_SHIFT 4 // Smallest size class is 16 bytes
+#define KMALLOC_CLASSES 7 // 16, 32, ... 1024 bytes
+#define KMALLOC_MAX_SMALL (1 << (KMALLOC_MIN_SHIFT + KMALLOC_CLASSES - 1))
+
 namespace pmm {
 // Heap allocation
 uint32_t legacy_malloc(size_t size);
 
-void init_heap();
-
 } // namespace pmm
 
+// General purpose kernel allocator
+void* kmalloc(size_t size);
+void kfree(void* pointer);
+void* krealloc(void* pointer, size_t size);
+
+// Allocation counters
+struct kmalloc_stats_t {
+    uint32_t allocs[KMALLOC_CLASSES]; // Allocations per size class
+    uint32_t frees[KMALLOC_CLASSES];  // Frees per size class
+    uint32_t class_pages;             // Pages carved into size classes
+    uint32_t large_allocs;            // Page granular allocations
+    uint32_t large_frees;
+    uint32_t failures;                // Allocations that could not be satisfied
+    uint32_t bytes_in_use;            // Bytes handed out (rounded to class or page size)
+};
+extern kmalloc_stats_t kmalloc_stats;
+
+void print_kmalloc_stats();
+// Comparing kmalloc/kfree with the bump allocator under a mixed workload
+void bench_kmalloc();
+
 #endif // MALLOC_HPP
@@ -0,0 +1,68 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef MEMBLOCK_HPP
+#define MEMBLOCK_HPP
+
+#include <stdint.h>
+
+#define MEMBLOCK_MAX_REGIONS 64
+
+// E820 region types
+#define E820_USABLE 1
+#define E820_RESERVED 2
+#define E820_ACPI_RECLAIMABLE 3
+#define E820_ACPI_NVS 4
+#define E820_BAD_MEMORY 5
+
+// Address of the E820 entries stored by get_mmap in hardware_init.asm
+#define E820_MAP_ADDRESS 0x8000
+// Everything below 1 MiB belongs to the BIOS, the bootloader and VGA
+#define LOW_MEMORY_END 0x100000
+
+namespace memblock {
+
+// A physical memory range
+struct region {
+    uint64_t base;
+    uint64_t size;
+    uint32_t type;
+};
+
+// Sorted and merged list of ranges
+struct region_list {
+    region entries[MEMBLOCK_MAX_REGIONS];
+    uint32_t count;
+};
+
+extern region_list firmware; // Every E820 range, sorted and merged per type
+extern region_list memory;   // Usable RAM with all non usable ranges cut out
+extern region_list reserved; // Ranges already in use before the PMM takes over
+
+// Builds the region tables from the E820 map and reserves the kernel
+void init();
+
+// Adds a range to a list, merging it with overlapping or adjacent ranges of the same type
+void add(region_list& list, uint64_t base, uint64_t size, uint32_t type = E820_USABLE);
+// Cuts a range out of a list, splitting ranges if needed
+void remove(region_list& list, uint64_t base, uint64_t size);
+
+// Marks a range as in use
+void reserve(uint64_t base, uint64_t size);
+// Allocates from free usable memory below `limit`, returns 0 on failure
+uint32_t alloc(uint32_t size, uint32_t alignment, uint64_t limit = 0x100000000ULL);
+// Called by the PMM once it owns memory, later allocations are an error
+void retire();
+
+// Prints the region tables
+void print_regions();
+
+} // namespace memblock
+
+#endif // MEMBLOCK_HPP
@@ -0,0 +1,57 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <stdint.h>
+
+#define NUMA_MAX_NODES 8
+#define NUMA_MAX_RANGES 32
+#define NUMA_LOCAL_DISTANCE 10  // SLIT distance of a node to itself
+#define NUMA_REMOTE_DISTANCE 20 // Assumed distance between nodes without a SLIT
+#define NUMA_NO_NODE 0xFF
+
+namespace numa {
+
+/* Memory of one node, in frame bitmap words (64 frames, 256 KiB)
+ * Node boundaries are rounded down to whole words */
+struct memory_range {
+    uint32_t first_word;
+    uint32_t end_word;
+    uint8_t node;
+};
+
+struct node_t {
+    uint32_t proximity_domain;        // Domain number used by SRAT and SLIT
+    uint32_t total_blocks;            // Frames of the node the PMM manages
+    uint32_t allocs;                  // Frames handed out from this node
+    uint32_t fallback_allocs;         // Of those, frames that another node asked for
+    uint8_t fallback[NUMA_MAX_NODES]; // Every node ordered by distance, this one first
+};
+
+extern uint32_t node_count; // Always at least 1
+extern node_t nodes[NUMA_MAX_NODES];
+extern memory_range ranges[NUMA_MAX_RANGES];
+extern uint32_t range_count;
+extern uint8_t distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+// Builds the nodes from SRAT and SLIT, or a single node without them. Called by pmm::init
+void init(const uint32_t num_blocks);
+
+// Node of the executing CPU, 0 if it is unknown
+uint8_t cpu_node();
+// Node a frame belongs to, NUMA_NO_NODE if no SRAT range covers it
+uint8_t node_of(const uint32_t address);
+
+void print_stats();
+
+} // namespace numa
+
+#endif // NUMA_HPP
@@ -14,7 +14,34 @@
 
 #define BLOCK_SIZE 4096 // 4KiB
 #define TOTAL_MEMORY
+#define KERNEL_VIRTUAL_BASE 0xC0000000 // The kernel runs here, physical memory is mapped from here on (the direct map)
+#define PMM_MAX_ADDRESS 0x30000000ULL // Frames must be reachable through the direct map, which ends at the kernel heap
+#define HIGHMEM_MAX_ADDRESS 0x1000000000ULL // 64 GiB, the physical address width of most PAE CPUs
 
+#define MAGAZINE_SIZE 32 // Frames cached per CPU in front of the bitmap
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2) // Frames moved between a magazine and the bitmap at once
+
+#define ZERO_POOL_SIZE 256 // Zeroed frames kept ready (1 MiB)
+#define ZERO_POOL_BATCH 16 // Frames zeroed per idle loop iteration
+#define ZERO_POOL_RESERVE 1024 // The pool stops growing below this many free blocks
+
+// allocate_contiguous flags
+#define PMM_NO_COMPACT 0x1 // Fail instead of compacting, for callers that can do without contiguous memory
+
+#define FRAME_REFS_PINNED 0xFFFF // Reference count of a frame that is never freed
+#define HIGHMEM_REFS_PINNED 0xFF  // Same for high memory frames, which only keep 8 bits
+
+
+// Address of a frame below PMM_MAX_ADDRESS in the direct map
+template<typename T = void>
+inline T* phys_to_virt(const uint32_t physicalAddress) {
+    return reinterpret_cast<T*>(physicalAddress + KERNEL_VIRTUAL_BASE);
+}
+
+// Physical address behind a pointer into the direct map
+inline uint32_t virt_to_phys(const void* virtualAddress) {
+    return uint32_t(virtualAddress) - KERNEL_VIRTUAL_BASE;
+}
 
 namespace pmm {
     void init(); // Initializes the PMM
@@ -23,14 +50,95 @@ namespace pmm {
     uint32_t allocate_frame();
     // Frees a block of physical memory
     void free_frame(const uint32_t address);
+    // Allocates up to count frames into frames[], whole bitmap words at a time. Returns how many were allocated
+    uint32_t allocate_frames_batch(const uint32_t count, uint32_t* frames);
+    // Frees count frames, clearing bits that share a bitmap word together
+    void free_frames_batch(const uint32_t count, const uint32_t* frames);
+    // Allocates a frame filled with zeroes, from the zeroed pool if possible
+    uint32_t allocate_zeroed_frame();
+    // Zeroes up to max_frames more frames for the pool, called from the idle loop
+    void refill_zero_pool(const uint32_t max_frames);
+    // Takes a frame out of the pool without counting it as a hit, -1 if empty
+    uint32_t take_zero_pool_frame();
+    void print_zero_pool_stats();
+
+    struct zero_pool_stats_t {
+        uint32_t hits;     // Zeroed frames served from the pool
+        uint32_t misses;   // Frames zeroed on the allocation path
+        uint32_t refilled; // Frames zeroed by the idle loop
+    };
+    extern zero_pool_stats_t zero_pool_stats;
+
+    /* Allocates `count` contiguous blocks starting at an `alignment` aligned address
+     * Compacts memory once if no run is free, unless flags has PMM_NO_COMPACT */
+    uint32_t allocate_contiguous(const uint32_t count, const uint32_t alignment, const uint32_t flags = 0);
+    // Frees `count` contiguous blocks starting at address
+    void free_contiguous(const uint32_t address, const uint32_t count);
+
+    /* Frames shared by several mappings (copy on write) count the extra mappings, 0 for a single owner
+     * A pinned frame stays allocated for good, counts that would overflow pin the frame too. High memory frames work too */
+    void ref_frame(const uint64_t address);
+    // Drops one mapping of a frame, the last one frees it. Returns true if the frame was freed
+    bool unref_frame(const uint64_t address);
+    // Extra mappings of a frame, 0 if it has one owner
+    uint32_t frame_refs(const uint64_t address);
+    void pin_frame(const uint32_t address);
+
+    /* High memory: RAM past PMM_MAX_ADDRESS, up to HIGHMEM_MAX_ADDRESS. It is outside the direct map,
+     * so it only backs pages reached through their own mapping. Kernel structures stay in low memory */
+    void init_highmem(); // Called by init while memblock can still allocate the bitmap
+    // Allocates a high memory frame, -1 if there is none
+    uint64_t allocate_high_frame();
+    void free_high_frame(const uint64_t address);
+    // Frame for user and copy on write pages, high memory first and low memory once it runs out. -1 on failure
+    uint64_t allocate_user_frame();
+    void print_highmem_stats();
+    // Reference counts of high memory frames, ref_frame and friends hand high addresses to these
+    void ref_high_frame(const uint64_t address);
+    bool unref_high_frame(const uint64_t address);
+    uint32_t high_frame_refs(const uint64_t address);
+
+    inline bool is_high_frame(const uint64_t address) {
+        return address >= PMM_MAX_ADDRESS;
+    }
+
+    struct highmem_stats_t {
+        uint32_t total_frames;
+        uint32_t free_frames;
+        uint32_t allocs;
+        uint32_t frees;
+        uint32_t fallbacks; // User frames that had to come from low memory
+    };
+    extern highmem_stats_t highmem_stats;
+
+    // Gives every frame cached in the magazines back to the bitmap
+    void drain_magazines();
+    // Marks one specific block allocated, false if it is not free in the bitmap
+    bool take_block(const uint32_t block);
+
+    // Counters cheap enough to stay on in every build
+    struct pmm_stats_t {
+        uint32_t frame_allocs; // Frames handed out by allocate_frame
+        uint32_t frame_frees;  // Frames given back with free_frame
+        uint32_t failures;     // allocate_frame calls that found no memory
+    };
+    extern pmm_stats_t stats;
+
+    // Free blocks of the bitmap in [first, first + count)
+    uint32_t count_free_blocks(const uint32_t first, const uint32_t count);
+    // Longest run of free blocks in the bitmap
+    uint32_t largest_free_run();
+    // Frames cached in the per CPU magazines, free but not in the bitmap
+    uint32_t magazine_frames();
+
     // Testing the PMM allocation and deallocation functions
     void test_pmm();
+    // Comparing the summary bitmap search against a linear bit scan, and timing allocate + free pairs
+    void bench_pmm();
 
     extern uint64_t usable_ram_amount;
     extern uint64_t num_blocks;
-
-    // Start address of process data
-    const uint32_t data_start_address = 0x500000;
+    extern uint64_t free_blocks; // Free in the bitmap, frames cached in magazines are not counted
 
 } // Namespace pmm
 
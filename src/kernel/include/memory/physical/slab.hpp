@@ -0,0 +1,70 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef SLAB_HPP
+#define SLAB_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_NAME_LENGTH 24
+#define SLAB_MAX_ORDER 3 // Slabs are at most 2^3 pages (32 KiB)
+#define SLAB_MIN_OBJECTS 8 // A slab grows in order until this many objects fit
+#define CACHE_LINE_SIZE 64
+
+struct slab;
+
+// Usage counters of one cache
+struct kmem_cache_stats {
+    uint32_t allocs;         // Objects handed out
+    uint32_t frees;          // Objects given back
+    uint32_t active_objects; // Objects in use right now
+    uint32_t total_objects;  // Objects in all slabs
+    uint32_t slabs;          // Slabs owned by the cache
+    uint32_t grows;          // Slabs created
+    uint32_t shrinks;        // Slabs given back to the PMM
+};
+
+// A cache of equally sized objects
+struct kmem_cache {
+    char name[SLAB_NAME_LENGTH];
+    uint32_t object_size;     // Size of one object, rounded up to the alignment
+    uint32_t align;
+    uint8_t order;            // Every slab is 2^order pages
+    uint32_t objects_per_slab;
+    uint32_t first_object;    // Offset of the first object, without color
+    uint32_t colors;          // Number of different color offsets
+    uint32_t next_color;      // Color given to the next slab
+    void (*ctor)(void*);      // Runs once per object when a slab is created
+
+    slab* partial; // Slabs with free and used objects
+    slab* full;    // Slabs without free objects
+    slab* empty;   // Slabs without used objects
+
+    kmem_cache_stats stats;
+    kmem_cache* next; // All caches, for printing
+};
+
+// Creates a cache, ctor may be null. Objects keep their constructed state between uses
+kmem_cache* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*));
+// Frees a cache, every object must have been freed before
+void kmem_cache_destroy(kmem_cache* cache);
+
+void* kmem_cache_alloc(kmem_cache* cache);
+void kmem_cache_free(kmem_cache* cache, void* object);
+
+// Gives every empty slab back to the PMM
+void kmem_cache_shrink(kmem_cache* cache);
+
+// Prints the counters of every cache
+void print_slab_stats();
+// Testing constructors, coloring and slab reuse
+void test_slab();
+
+#endif // SLAB_HPP
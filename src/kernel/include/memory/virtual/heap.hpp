@@ -0,0 +1,42 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef HEAP_HPP
+#define HEAP_HPP
+
+#include <stdint.h>
+
+#define HEAP_KEEP_PAGES 16 // Free pages kept mapped at the end of the heap when it shrinks
+#define HEAP_MAP_BATCH 64  // Frames a grow maps with one range call
+
+namespace heap {
+
+void init(); // Initializes the kernel heap, paging has to be enabled
+
+// Allocates count virtually contiguous pages, mapping new frames if needed. Returns 0 on failure
+uint32_t allocate_pages(const uint32_t count);
+// Frees pages, a free tail past HEAP_KEEP_PAGES is unmapped and given back to the PMM
+void free_pages(const uint32_t address, const uint32_t count);
+
+struct heap_stats_t {
+    uint32_t mapped_pages;     // Pages currently backed by frames
+    uint32_t used_pages;       // Pages handed out
+    uint32_t high_water_pages; // Most pages ever handed out at once
+    uint32_t grows;            // Times the heap mapped new frames
+    uint32_t shrinks;          // Times the heap gave frames back
+    uint32_t failures;         // Allocations that did not fit
+    uint32_t large_pages;      // 2 MiB pages mapped, each one directory entry instead of a page table
+};
+extern heap_stats_t stats;
+
+void print_stats();
+
+} // namespace heap
+
+#endif // HEAP_HPP
@@ -0,0 +1,56 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef SWAP_HPP
+#define SWAP_HPP
+
+#include <stdint.h>
+
+#define SWAP_DRIVE 1 // Primary slave, the second -drive given to QEMU
+#define SWAP_MAX_SLOTS 65536 // Pages of swap at most (256 MiB)
+#define SWAP_MAX_TRACKED 32768 // Resident anonymous pages the CLOCK hand can reclaim
+#define SWAP_NO_SLOT 0xFFFFFFFF
+#define SWAP_RECLAIM_BATCH 16 // Frames reclaimed per step
+#define SWAP_LOW_WATERMARK 512 // The idle loop reclaims below this many free frames
+
+namespace swap {
+
+void init(); // Finds the swap drive, anonymous memory works without one but cannot be written out
+
+/* Backs an anonymous page with a fresh zeroed frame, or the page read back from swap, mapped with flags
+ * Called by the VMA fault handler for areas without a fill callback */
+bool handle_fault(const uint32_t address, const uint32_t flags);
+
+// Runs the CLOCK hand until target frames were freed or nothing is left to reclaim. Returns frames freed
+uint32_t reclaim(const uint32_t target);
+// Reclaims ahead of time when free memory runs low, called from the idle loop
+void balance();
+
+// Frees count anonymous pages starting at address, resident or swapped out
+void release_anonymous(const uint32_t address, const uint32_t count);
+
+struct swap_stats_t {
+    uint32_t slots;          // Pages the swap drive holds
+    uint32_t used_slots;
+    uint32_t resident_pages; // Anonymous pages in memory, tracked by the CLOCK hand
+    uint32_t zero_faults;    // First touches, given a zeroed frame
+    uint32_t swap_ins;
+    uint32_t swap_outs;      // Dirty pages written out
+    uint32_t clean_drops;    // Clean pages dropped without writing
+    uint32_t scans;          // Pages the hand looked at
+};
+extern swap_stats_t stats;
+
+void print_stats();
+// Touching more pages than it keeps resident, then checking every page's contents
+void test_swap();
+
+} // namespace swap
+
+#endif // SWAP_HPP
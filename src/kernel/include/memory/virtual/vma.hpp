@@ -0,0 +1,65 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef VMA_HPP
+#define VMA_HPP
+
+#include <stdint.h>
+
+#define VMA_MAX_AREAS 64
+#define VMA_FAULT_AROUND_PAGES 8 // Aligned window of pages populated around a fault
+
+// Area flags
+#define VMA_WRITABLE 0x1     // Mapped writable, read only otherwise
+#define VMA_FAULT_AROUND 0x2 // A fault also populates the missing pages of its window
+
+namespace vma {
+
+/* Fills a fresh frame for the page at address, page points at the frame through the direct map
+ * Returns false if the page cannot be provided, the fault then fails */
+typedef bool (*fill_t)(const uint32_t address, void* page, void* context);
+
+// A reserved range of the anonymous window, its pages are only backed on first touch
+struct area_t {
+    uint32_t start;
+    uint32_t end;     // Exclusive
+    uint32_t flags;   // VMA_ flags
+    fill_t fill;      // nullptr for anonymous zero fill, these pages can be swapped out
+    void* context;    // Handed to fill
+    uint32_t faults;  // Faults resolved in this area
+};
+
+// Reserves pages of virtual memory, nothing is allocated until they are touched. Returns the start, 0 if no room is left
+uint32_t reserve(const uint32_t pages, const uint32_t flags, fill_t fill = nullptr, void* context = nullptr);
+// Releases an area by its start address, frames and swap slots behind it are freed
+void release(const uint32_t address);
+// Area containing an address, nullptr if none does
+const area_t* find(const uint32_t address);
+
+// Resolves a not present fault inside an area, anything else is left to the caller
+bool handle_fault(const uint32_t address, const uint32_t errorCode);
+
+struct vma_stats_t {
+    uint32_t areas;          // Areas reserved right now
+    uint32_t reserved_pages; // Pages reserved by them
+    uint32_t faults;         // Faults resolved
+    uint32_t fills;          // Pages populated by a fill callback
+    uint32_t around_pages;   // Pages populated ahead by fault-around
+    uint32_t zero_maps;      // Reads of untouched anonymous pages, given the shared zero page
+    uint32_t bad_faults;     // Faults outside any area or on protection
+};
+extern vma_stats_t stats;
+
+void print_stats();
+// Reserving a large area, then touching a few pages of it
+void test_vma();
+
+} // namespace vma
+
+#endif // VMA_HPP
@@ -0,0 +1,66 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef VMALLOC_HPP
+#define VMALLOC_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VRANGE_MAX_REGIONS 256  // Free, used and lazily freed regions together
+#define VRANGE_GUARD_PAGES 1    // Unmapped pages after every used region, running off its end faults
+#define VRANGE_LAZY_PAGES 1024  // Freed pages that may wait for a purge, 4 MiB
+#define VMALLOC_MAP_BATCH 64    // Frames vmalloc maps with one range call
+
+// Region flags
+#define VRANGE_OWNS_FRAMES 0x1 // The frames mapped in the region are freed with it
+
+namespace vrange {
+
+void init(); // The whole vmalloc window becomes one free region, paging has to be enabled
+
+/* Best fit range of pages in the vmalloc window, start aligned to alignment (a power of two, at least PAGE_SIZE).
+ * Nothing gets mapped. Returns the start, 0 if no free region fits */
+uint32_t allocate(const uint32_t pages, const uint32_t alignment, const uint32_t flags);
+/* Frees a range by its start address. It stays mapped and unusable until the next purge,
+ * which unmaps every freed range with one TLB flush */
+void free(const uint32_t address);
+// Unmaps the freed ranges and gives their space back, called on its own once VRANGE_LAZY_PAGES are waiting
+void purge();
+// True if address lies in a range that is handed out with VRANGE_OWNS_FRAMES, like a vmalloc buffer
+bool owns_frames(const uint32_t address);
+
+struct vrange_stats_t {
+    uint32_t used_regions;
+    uint32_t used_pages;   // Guard pages included
+    uint32_t free_regions; // Neighbouring free regions are always merged
+    uint32_t free_pages;
+    uint32_t lazy_pages;   // Freed, waiting for a purge
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t purges;
+    uint32_t full_flushes; // Purges that flushed the whole TLB instead of single pages
+    uint32_t failures;     // Allocations that did not fit
+};
+extern vrange_stats_t stats;
+
+void print_stats();
+// vmalloc buffers of several sizes, their guard pages, an aligned range, and merging everything back
+void test_vmalloc();
+
+} // namespace vrange
+
+// Virtually contiguous kernel memory, backed page by page so no contiguous physical memory is needed
+void* vmalloc(const size_t size);
+void vfree(void* pointer);
+/* Maps pages of physical memory the caller keeps owning, like device memory, with extra PAGE_ flags such as a PAGE_CACHE_
+ * type. Returns nullptr if the window or the page tables run out. vfree unmaps it and leaves the frames alone */
+void* vmap(const uint64_t physicalAddress, const uint32_t pages, const uint32_t flags);
+
+#endif // VMALLOC_HPP
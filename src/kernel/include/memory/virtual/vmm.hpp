@@ -10,18 +10,69 @@
 #ifndef VMM_HPP
 #define VMM_HPP
 
+// PAE paging: a 4 entry pointer table, four page directories and page tables, all with 64-bit entries
 #define PAGE_SIZE 4096 // 4 KiB
-#define PAGE_TABLE_ENTRIES 1024
+#define PAGE_TABLE_ENTRIES 512
+#define PAGE_DIRECTORY_ENTRIES 2048 // The four directories of an address space, one after the other
+#define PAGE_DIRECTORY_POINTERS 4
+#define LARGE_PAGE_SIZE 0x200000 // 2 MiB, mapped by one directory entry
 #define PAGE_PRESENT 0X1
 #define PAGE_WRITABLE 0X2
 #define PAGE_USER 0X4
+#define PAGE_WRITE_THROUGH 0x8  // PWT, together with PCD and PAGE_PAT it picks a PAT entry
+#define PAGE_CACHE_DISABLE 0x10 // PCD
+#define PAGE_ACCESSED 0x20 // Set by the CPU on any access
+#define PAGE_DIRTY 0x40    // Set by the CPU on a write
+#define PAGE_LARGE 0x80    // Directory entry mapping a 2 MiB page instead of a page table
+#define PAGE_PAT 0x80      // The same bit in a page table entry, third bit of the PAT index. 4 KiB pages only
+#define PAGE_GLOBAL 0x100  // Kept in the TLB across CR3 reloads, needs CR4.PGE
+#define PAGE_SWAPPED 0x200 // Not present entry whose address bits hold a swap slot
+#define PAGE_COW 0x400     // Read only share of a writable page, a write fault gives it a frame of its own
+
+// Memory types, PAT entries as vmm::init programs them. Without PAT the power-on entries apply, WC is then WT
+#define PAT_MSR 0x277
+#define PAT_VALUE 0x0007040600070106ULL // WB, WC, UC-, UC, WB, WT, UC-, UC
+#define PAGE_CACHE_WB 0                                          // Write-back, everything by default
+#define PAGE_CACHE_WC PAGE_WRITE_THROUGH                         // Write-combining, for framebuffers
+#define PAGE_CACHE_UC_MINUS PAGE_CACHE_DISABLE                   // Uncached unless the MTRRs say write-combining
+#define PAGE_CACHE_UC (PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH)  // Uncached, for device registers
+#define PAGE_CACHE_WT (PAGE_PAT | PAGE_WRITE_THROUGH)            // Write-through
+#define PAGE_CACHE_MASK (PAGE_PAT | PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH)
+
+// Kernel virtual address space layout, the kernel and the direct map start at KERNEL_VIRTUAL_BASE
+#define KERNEL_HEAP_START 0xF0000000 // Reserved for the kernel heap, grows on demand
+#define KERNEL_HEAP_MAX 0xF8000000   // 128 MiB of heap at most
+#define KERNEL_ANON_START 0xF8000000 // Anonymous memory, paged in on demand and swappable
+#define KERNEL_ANON_END 0xFC000000
+#define KERNEL_VMALLOC_START 0xFC000000 // Ranges handed out by vrange, vmalloc buffers among them
+#define KERNEL_VMALLOC_END 0xFF200000
+#define KERNEL_KMAP_START 0xFF200000 // Temporary mappings of frames outside the direct map
+#define KERNEL_KMAP_END 0xFF400000
+#define KERNEL_ACPI_START 0xFF400000 // Firmware tables outside the direct map
+#define KERNEL_ACPI_END 0xFF800000
+
+// Every address space has its own mappings below KERNEL_VIRTUAL_BASE and shares the kernel's above it
+#define VMM_MAX_ADDRESS_SPACES 16
+
+// Range operations
+#define VMM_FLUSH_THRESHOLD 32 // Changed pages a range flushes one by one, past that the whole TLB is flushed
+#define VMM_TABLE_BATCH 16     // Page tables a range takes from the PMM at once
+#define VMM_RELEASE_BATCH 64   // Frames an unmap holds until their translations are flushed
+
+// The last four directory entries point at the four directories
+#define RECURSIVE_SLOT 2044
+#define PAGE_TABLES_ADDRESS 0xFF800000    // Page table of virtual address X at PAGE_TABLES_ADDRESS + (X >> 21) * PAGE_SIZE
+#define PAGE_DIRECTORY_ADDRESS 0xFFFFC000 // The four active page directories
 
 #include <stdint.h>
+#include <memory/physical/pmm.hpp>
 
-// Page Table entry
+// Page Table entry, GCC fills bitfields from the lowest bit so flags come first
 struct PageTableEntry {
-    uint32_t address : 20; // 20 bit address pointing to a 4 KiB frame in physical memory
-    uint32_t flags : 12; // 12 bits of flags e.g. read/write, present, user mode...
+    uint64_t flags : 12;     // 12 bits of flags e.g. read/write, present, user mode...
+    uint64_t address : 40;   // Frame number, so physical memory above 4 GiB can be mapped
+    uint64_t available : 11;
+    uint64_t no_execute : 1; // Only honoured once EFER.NXE is set
 } __attribute__((packed));
 
 // Page Table
@@ -31,20 +82,129 @@ struct PageTable {
 
 // Page Directory entry
 struct PageDirectoryEntry {
-    uint32_t address : 20; // 20 bit address
-    uint32_t flags : 12; // 12 bits of flags e.g. read/write, present, user mode...
+    uint64_t flags : 12;     // 12 bits of flags e.g. read/write, present, user mode...
+    uint64_t address : 40;   // Page table frame, or the 2 MiB page for PAGE_LARGE
+    uint64_t available : 11;
+    uint64_t no_execute : 1;
 } __attribute__((packed));
 
-// Page Directory
+// The four page directories of an address space, entry X >> 21 covers virtual address X
 struct PageDirectory {
-    PageDirectoryEntry entries[PAGE_TABLE_ENTRIES];
+    PageDirectoryEntry entries[PAGE_DIRECTORY_ENTRIES];
 } __attribute__((packed));
 
+// What CR3 points at, one entry per directory. Only the present bit is used, and it has to sit below 4 GiB
+struct PageDirectoryPointerTable {
+    uint64_t entries[PAGE_DIRECTORY_POINTERS];
+} __attribute__((packed, aligned(32)));
+
+extern PageDirectory* kernelPageDirectory; // nullptr until vmm::init, the boot directory is active before that
+// Built by kernel_entry.asm before paging is enabled
+extern "C" PageDirectory boot_page_directory;
+
 namespace vmm {
     void init();
 
+    // Maps a virtual page to a physical frame in the active page directory, through the recursive slot
+    void map_page(const uint32_t virtualAddress, const uint64_t physicalAddress, const uint32_t flags);
+    // Removes a mapping and returns the frame it pointed to, -1 if it was not mapped
+    uint64_t unmap_page(const uint32_t virtualAddress);
+    // Physical address a virtual address is mapped to, -1 if not mapped
+    uint64_t get_physical(const uint32_t virtualAddress);
+
+    // Maps a frame that may be outside the direct map into the temporary window, nullptr once it is full
+    void* map_temporary(const uint64_t physicalAddress);
+    void unmap_temporary(const void* address);
+    // Copies a whole frame, either one may be in high memory. False if the temporary window is full
+    bool copy_frame(const uint64_t destination, const uint64_t source);
+    // Drops the TLB entry of one page, global or not
+    void flush_page(const uint32_t virtualAddress);
+    // Drops every non-global TLB entry by reloading CR3, kernel mappings stay cached
+    void flush_tlb();
+    // Drops every TLB entry including global ones, for changes to kernel mappings that cannot be flushed page by page
+    void flush_tlb_all();
+    // Page table entry of a virtual address, nullptr if its page table does not exist or a 2 MiB page maps it
+    PageTableEntry* get_entry(const uint32_t virtualAddress);
+
+    /* Maps pages of contiguous physical memory, walking each page table once. Aligned 2 MiB pieces become large pages,
+     * missing page tables are taken in batches and the TLB is flushed once at the end. On failure nothing stays mapped */
+    bool map_range(const uint32_t virtualAddress, const uint64_t physicalAddress, const uint32_t pages, const uint32_t flags);
+    // Same for frames that are not contiguous, frames[i] is mapped at virtualAddress + i * PAGE_SIZE
+    bool map_frames(const uint32_t virtualAddress, const uint64_t* frames, const uint32_t pages, const uint32_t flags);
+
+    // Hands back what a range unmap removed: a frame, or the first frame of a 2 MiB page with pages = PAGE_TABLE_ENTRIES
+    typedef void (*release_t)(const uint64_t frame, const uint32_t pages);
+    /* Unmaps pages, 2 MiB pages the range covers in one piece and the others split. Every removed frame goes to release
+     * (if given) once its translation is flushed */
+    void unmap_range(const uint32_t virtualAddress, const uint32_t pages, release_t release);
+    // Gives the present pages of a range new flags, accessed and dirty bits are kept. False if a 2 MiB page could not be split
+    bool protect_range(const uint32_t virtualAddress, const uint32_t pages, const uint32_t flags);
+    /* Changes only the memory type (a PAGE_CACHE_ value) of the present pages of a range, then writes back the caches so
+     * no line of the old type is left. 2 MiB pages are split for WT */
+    bool set_cache_range(const uint32_t virtualAddress, const uint32_t pages, const uint32_t cache);
+
+    struct range_stats_t {
+        uint32_t ranges;       // Range operations done
+        uint32_t pages;        // Pages they changed
+        uint32_t large_pages;  // 2 MiB pages map_range used
+        uint32_t tables;       // Page tables taken in batches
+        uint32_t page_flushes; // Pages flushed one by one
+        uint32_t full_flushes; // Whole TLB flushes instead
+    };
+    extern range_stats_t range_stats;
+
+    // Comparing map_page/unmap_page in a loop with one map_range/unmap_range
+    void bench_ranges();
+    // Comparing uncached and write-combining writes to VGA memory, needs vmalloc
+    void bench_write_combining();
+
+    // Maps a 2 MiB page, both addresses aligned to LARGE_PAGE_SIZE. Fails if a page table is in the way or for WT
+    bool map_large_page(const uint32_t virtualAddress, const uint32_t physicalAddress, const uint32_t flags);
+    // Removes a 2 MiB mapping and returns its first frame, -1 if there was none
+    uint32_t unmap_large_page(const uint32_t virtualAddress);
+    // Replaces the 2 MiB page around an address by a page table with the same mappings. False without memory for it
+    bool split_large_page(const uint32_t virtualAddress);
+    // Turns a page table mapping 2 MiB of aligned, contiguous memory with equal permissions back into a 2 MiB page
+    bool merge_large_page(const uint32_t virtualAddress);
+
+    // Comparing a TLB heavy walk over the direct map with 2 MiB pages and split into 4 KiB pages
+    void bench_large_pages();
+
+    /* Copies the active address space: every present page below KERNEL_VIRTUAL_BASE is shared with the copy,
+     * writable ones become read only copy on write pages in both. Only the page tables are allocated. nullptr on failure */
+    PageDirectory* clone_address_space();
+    // Loads another address space, only translations that are not global get flushed
+    void switch_address_space(PageDirectory* directory);
+    // Drops every page below KERNEL_VIRTUAL_BASE and the directory itself, it must not be active
+    void destroy_address_space(PageDirectory* directory);
+    // Resolves a write to a copy on write page in the active address space
+    bool handle_cow_fault(const uint32_t address, const uint32_t errorCode);
+
+    // Frame of zeroes shared read only by untouched anonymous pages
+    extern uint32_t zero_page;
+
+    struct cow_stats_t {
+        uint32_t clones;        // Address spaces cloned
+        uint32_t shared_pages;  // Pages shared by clones instead of copied
+        uint32_t copies;        // Write faults that copied a page
+        uint32_t reuses;        // Write faults on a page no longer shared, made writable in place
+    };
+    extern cow_stats_t cow_stats;
+
+    // Cloning an address space, writing in both copies and checking neither sees the other's writes
+    void test_cow();
+    // Writing a high memory frame through the temporary window and reading it back
+    void test_highmem();
+
+    extern uint32_t page_table_pages; // Frames used by page directories and page tables
+    extern uint32_t global_flag;      // PAGE_GLOBAL if the CPU supports PGE, 0 otherwise
+    extern bool pat_enabled;          // PAT_VALUE is programmed, every PAGE_CACHE_ type is what it says
+
 } // namespace vmm
 
+// Maps a page in any directory, its page tables are reached through the direct map. Kernel pages become global
+void map_page(uint32_t virtualAddress, uint64_t physicalAddress, PageDirectory* directory, uint32_t flags);
+
 extern "C" void enable_paging(uint32_t);
 
 #endif // VMM_HPP
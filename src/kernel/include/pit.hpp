@@ -12,9 +12,12 @@
 
 #include <stdint.h>
 
+#define PIT_FREQUENCY 100 // Ticks per second
+
 namespace pit {
     void init(); // Initializes the PIT
     void delay(uint64_t ms);
+    uint64_t get_ticks(); // Ticks since the PIT was initialized, PIT_FREQUENCY per second
     
     void test();
 } // Namespace pit
@@ -22,6 +22,12 @@ void outPortB(const uint16_t Port, const uint8_t Value);
 // Receives a 8-bit value from a specific I/O port
 uint8_t inPortB(const uint16_t port);
 
+// Reads count 16-bit values from a port into buffer (rep insw)
+void inPortWords(const uint16_t port, uint16_t* buffer, const uint32_t count);
+
+// Writes count 16-bit values from buffer to a port (rep outsw)
+void outPortWords(const uint16_t port, const uint16_t* buffer, const uint32_t count);
+
 } // Namespace ports
 
 // Registers related to an interrupt
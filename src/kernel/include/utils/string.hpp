@@ -0,0 +1,42 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+// =======================================================================
+
+#pragma once
+
+#ifndef STRING_HPP
+#define STRING_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STRING_SSE_MIN 512              // Smaller blocks always use rep string instructions
+#define STRING_NONTEMPORAL_MIN 0x100000 // 1 MiB, larger copies and fills bypass the cache
+
+namespace string {
+
+/* Picks the routines for each size class from CPUID, the SSE2 ones only if fpu::init enabled SSE
+ * Until then everything goes through rep movsd and rep stosd, which work on any CPU */
+void init();
+
+// Cycles of every copy and fill routine for block sizes from 8 B to 4 MiB, needs vmalloc
+void bench_string();
+
+} // namespace string
+
+// Standard signatures, GCC may emit calls to these on its own
+extern "C" {
+void* memcpy(void* destination, const void* source, size_t count);
+void* memmove(void* destination, const void* source, size_t count); // The ranges may overlap
+void* memset(void* destination, int value, size_t count);
+int memcmp(const void* left, const void* right, size_t count);
+
+// Same as memcpy and memset, but large blocks skip the cache. For memory nobody reads soon, like frames zeroed ahead of time
+void* memcpy_nt(void* destination, const void* source, size_t count);
+void* memset_nt(void* destination, int value, size_t count);
+}
+
+#endif // STRING_HPP
@@ -12,9 +12,22 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <utils/string.hpp> // memcpy, memmove, memset, memcmp
+
+#define EFLAGS_IF 0x200 // Interrupts enabled, in the EFLAGS irq_save returns
 
 // Functions defined in util.cpp
-void memset(const void *dest, const char val, uint32_t count);
+uint64_t rdtsc(); // Reads the CPU timestamp counter
+uint64_t rdmsr(const uint32_t msr); // Reads a model specific register
+void wrmsr(const uint32_t msr, const uint64_t value);
+uint32_t irq_save(); // Disables interrupts and returns the previous EFLAGS
+void irq_restore(const uint32_t flags); // Restores EFLAGS saved by irq_save
 namespace pmm { constexpr size_t align_up(size_t value, size_t alignment); }
 
+// Index of the lowest set bit, split in halves so no libgcc helper is needed on i686
+static inline uint32_t ctz64(const uint64_t value) {
+    uint32_t low = uint32_t(value);
+    return low ? __builtin_ctz(low) : 32 + __builtin_ctz(uint32_t(value >> 32));
+}
+
 #endif // UTIL_HPP
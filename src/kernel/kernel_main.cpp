@@ -12,28 +12,58 @@
 #include <kernel_main.hpp>
 #include <drivers/vga_print.hpp>
 #include <drivers/keyboard.hpp>
+#include <drivers/serial.hpp>
 #include <idt/idt.hpp>
 #include <pit.hpp>
 #include <gdt.hpp>
+#include <cpuid.hpp>
+#include <fpu.hpp>
+#include <utils/string.hpp>
+#include <acpi.hpp>
 #include <memory/physical/pmm.hpp>
+#include <memory/physical/buddy.hpp>
+#include <memory/physical/memblock.hpp>
+#include <memory/physical/malloc.hpp>
+#include <memory/physical/slab.hpp>
+#include <memory/physical/arena.hpp>
+#include <memory/physical/numa.hpp>
 #include <memory/virtual/vmm.hpp>
+#include <memory/virtual/heap.hpp>
+#include <memory/virtual/swap.hpp>
+#include <memory/virtual/vma.hpp>
+#include <memory/virtual/vmalloc.hpp>
+#include <memory/memtrace.hpp>
+#include <memory/memstats.hpp>
+#include <memory/compact.hpp>
 
 
 extern "C" void kernel_main() {
     #pragma region Initialization
 
     vga::init(); // VGA text
+    cpuid::init(); // CPU features
 
     gdt::init(); // Global Descriptor Table
     idt::init(); // Interrupt Descriptor Table
+    fpu::init(); // FXSR and SSE, registers saved lazily through #NM
+    string::init(); // memcpy and memset routines picked from the CPU features
 
     // Drivers
     pit::init(); // Programmable Interval Timer
     keyboard::init(); // PS2 keyboard drivers
+    serial::init(); // COM1, used for exporting logs to the host
+
+    // Firmware tables: only finds the RSDP, the tables are mapped into the ACPI window on the first lookup (needs the PMM)
+    acpi::init();
 
     // Memory managers
-    pmm::init();
-    // vmm::init();
+    pmm::init(); // Also builds the NUMA nodes from the ACPI SRAT
+    vmm::init();
+    heap::init(); // Kernel heap, needs paging
+    vrange::init(); // Kernel virtual ranges and vmalloc
+    // Text output only writes to VGA memory, a write-combining alias lets a whole line go out in one burst
+    if(void* text = vmap(VGA_PHYSICAL, VGA_SIZE / PAGE_SIZE, PAGE_CACHE_WC)) vga::set_buffer(text);
+    swap::init(); // Swap drive for anonymous memory
 
     #pragma endregion
 
@@ -42,8 +72,62 @@ extern "C" void kernel_main() {
 
     #pragma region Testing
 
+    // Only uncomment if you want to see the physical memory map
+    // memblock::print_regions();
+    // Only uncomment if you want to see the NUMA nodes
+    // numa::print_stats();
     pmm::test_pmm();
+    // Only uncomment if you want to benchmark the PMM
+    // pmm::bench_pmm();
+    // Only uncomment if you want to test the buddy allocator
+    // pmm::test_buddy();
+    // Only uncomment if you want to benchmark kmalloc (the legacy allocations are never freed)
+    // bench_kmalloc();
+    // Only uncomment if you want to test the slab caches
+    // test_slab();
+    // Only uncomment if you want to test the arena allocator
+    // test_arena();
+    // Only uncomment if you want to test demand paged areas
+    // vma::test_vma();
+    // Only uncomment if you want to test vmalloc and the virtual range allocator
+    // vrange::test_vmalloc();
+    // Only uncomment if you want to test copy on write address space clones
+    // vmm::test_cow();
+    // Only uncomment if you want to test frames above 4 GiB (run with -m 7G or more)
+    // vmm::test_highmem();
+    // Only uncomment if you want to test reclaim and swap (needs the swap drive, see scripts/run_qemu.sh)
+    // swap::test_swap();
+    // Only uncomment if you want to compare TLB misses of 2 MiB and 4 KiB pages
+    // vmm::bench_large_pages();
+    // Only uncomment if you want to compare mapping page by page with range calls
+    // vmm::bench_ranges();
+    // Only uncomment if you want to compare uncached and write-combining VGA writes
+    // vmm::bench_write_combining();
+    // Only uncomment if you want to test lazy FPU switching and kernel FPU sections
+    // fpu::test_fpu();
+    // Only uncomment if you want to compare the memcpy and memset routines
+    // string::bench_string();
     pit::test();
 
+    #ifdef MEM_TRACE
+    // Allocations made during boot, F12 dumps them again later
+    memtrace::dump();
+    #endif
+
     #pragma endregion
 }
+
+extern "C" void kernel_idle() {
+    // Zeroing frames ahead of time so page tables don't pay for it
+    pmm::refill_zero_pool(ZERO_POOL_BATCH);
+    // Chunks of released arenas beyond the pool limit go back to the PMM
+    arena_trim_pool(ARENA_POOL_KEEP);
+    // Writing anonymous pages out before allocations start failing
+    swap::balance();
+    // Rebuilding 4 MiB runs when free memory is badly fragmented
+    compact::balance();
+    // Allocation rates and the periodic serial report
+    memstats::update();
+    // Reports asked for with F11 and F12
+    keyboard::run_requests();
+}
@@ -0,0 +1,238 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// compact.cpp moves pages around physical memory to rebuild contiguous runs
+// This file contains:
+// Finding movable frames through the page tables, picking a block, isolating it,
+// migrating its pages, the background trigger
+// =======================================================================
+
+#include <memory/compact.hpp>
+#include <memory/physical/pmm.hpp>
+#include <memory/virtual/vmm.hpp>
+#include <memory/virtual/vmalloc.hpp>
+#include <memory/memtrace.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+compact::compact_stats_t compact::stats;
+
+// Virtual ranges whose pages may be moved to another frame
+struct movable_window {
+    uint32_t start;
+    uint32_t end;
+};
+
+static const movable_window windows[] = {
+    {KERNEL_HEAP_START, KERNEL_HEAP_MAX},
+    {KERNEL_ANON_START, KERNEL_ANON_END},
+    {KERNEL_VMALLOC_START, KERNEL_VMALLOC_END}
+};
+
+// Movable frames in every 4 MiB block of physical memory
+static uint16_t movable_frames[1024];
+
+// Frames of the block being emptied that the pass holds already, one bit each
+static uint32_t owned[COMPACT_BLOCK_FRAMES / 32];
+static uint32_t owned_count = 0;
+
+static uint64_t next_check = 0;
+static bool running = false; // A pass is going on, allocations it makes must not start another one
+
+#pragma region Migration
+
+/* Calls visit(virtual address, entry) for every present page in the movable windows
+ * Stops and returns false as soon as visit returns false */
+template<typename Visit>
+static bool for_each_movable(Visit visit) {
+    for(const movable_window& window : windows) {
+        for(uint32_t table = window.start; table < window.end; table += PAGE_SIZE * PAGE_TABLE_ENTRIES) {
+            // The windows are 2 MiB aligned, so this is the first entry of a page table
+            PageTableEntry* entries = vmm::get_entry(table);
+            if(!entries) continue;
+
+            for(uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+                if((entries[i].flags & PAGE_PRESENT) && !visit(table + i * PAGE_SIZE, entries[i]))
+                    return false;
+        }
+    }
+    return true;
+}
+
+/* Shared frames (copy on write clones, the zero page) have more than one entry pointing at them and pinned frames
+ * must never move, both show up in the reference count. High frames are not in the bitmap. In the vmalloc window
+ * only vmalloc's own frames move, vmap mappings point at memory someone else owns, like VGA memory */
+static bool is_movable(const uint32_t address, const PageTableEntry& entry) {
+    const uint64_t frame = uint64_t(entry.address) << 12;
+    if(frame == vmm::zero_page || pmm::is_high_frame(frame) || pmm::frame_refs(frame)) return false;
+    return address < KERNEL_VMALLOC_START || address >= KERNEL_VMALLOC_END || vrange::owns_frames(address);
+}
+
+static inline void own(const uint32_t index) {
+    owned[index / 32] |= 1u << (index % 32);
+    owned_count++;
+}
+
+// Moves the page at address out of the block starting at frame number first
+static bool migrate(const uint32_t address, PageTableEntry& entry, const uint32_t first) {
+    uint32_t frame = pmm::allocate_frame();
+
+    // Frames freed into the block after it was isolated come back here, the pass keeps them
+    while(frame != uint32_t(-1) && frame / BLOCK_SIZE - first < COMPACT_BLOCK_FRAMES) {
+        own(frame / BLOCK_SIZE - first);
+        frame = pmm::allocate_frame();
+    }
+    if(frame == uint32_t(-1)) return false;
+
+    // Heap pages are used by interrupt handlers, so the copy and the switch happen together
+    uint32_t flags = irq_save();
+
+    // Allocating may have reclaimed or shared the page in the meantime
+    const uint32_t old = entry.address;
+    if(!(entry.flags & PAGE_PRESENT) || old - first >= COMPACT_BLOCK_FRAMES || !is_movable(address, entry)) {
+        irq_restore(flags);
+        pmm::free_frame(frame);
+        return true;
+    }
+
+    if(!vmm::copy_frame(frame, uint64_t(old) * BLOCK_SIZE)) {
+        irq_restore(flags);
+        pmm::free_frame(frame);
+        return false;
+    }
+    entry.address = frame / BLOCK_SIZE;
+    vmm::flush_page(address);
+    irq_restore(flags);
+
+    // The new frame carries the allocation from now on
+    MEM_TRACE_FREE(MEMTRACE_FRAME_FREE, old * BLOCK_SIZE);
+    own(old - first);
+    compact::stats.pages_moved++;
+    compact::stats.last_moved++;
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Compaction
+
+// One pass of compact::run, with no other pass going on
+static bool run_pass() {
+    compact::stats.runs++;
+    compact::stats.last_moved = 0;
+
+    // Frames parked in the magazines and the zeroed pool look used in the bitmap
+    uint32_t flags = irq_save();
+    pmm::drain_magazines();
+    irq_restore(flags);
+    for(uint32_t frame = pmm::take_zero_pool_frame(); frame != uint32_t(-1); frame = pmm::take_zero_pool_frame())
+        pmm::free_contiguous(frame, 1);
+
+    memset(movable_frames, 0, sizeof(movable_frames));
+    for_each_movable([](uint32_t address, PageTableEntry& entry) {
+        if(is_movable(address, entry)) movable_frames[entry.address / COMPACT_BLOCK_FRAMES]++;
+        return true;
+    });
+
+    // The block with the fewest pages to move, every used frame in it has to be movable
+    const uint32_t blocks = pmm::num_blocks / COMPACT_BLOCK_FRAMES;
+    uint32_t best = blocks;
+    uint32_t best_moves = COMPACT_BLOCK_FRAMES + 1;
+
+    for(uint32_t block = 0; block < blocks; block++) {
+        uint32_t free = pmm::count_free_blocks(block * COMPACT_BLOCK_FRAMES, COMPACT_BLOCK_FRAMES);
+        if(free + movable_frames[block] != COMPACT_BLOCK_FRAMES) continue;
+
+        if(movable_frames[block] < best_moves) {
+            best = block;
+            best_moves = movable_frames[block];
+        }
+    }
+
+    // The moved pages need a block's worth of free frames outside of it
+    if(best == blocks || pmm::free_blocks < COMPACT_BLOCK_FRAMES) {
+        compact::stats.failures++;
+        return false;
+    }
+    if(best_moves == 0) return true;
+
+    // Isolating the block: its free frames are taken so nothing new lands in it
+    const uint32_t first = best * COMPACT_BLOCK_FRAMES;
+    memset(owned, 0, sizeof(owned));
+    owned_count = 0;
+    for(uint32_t i = 0; i < COMPACT_BLOCK_FRAMES; i++)
+        if(pmm::take_block(first + i)) own(i);
+
+    for_each_movable([first](uint32_t address, PageTableEntry& entry) {
+        if(uint64_t(entry.address) - first >= COMPACT_BLOCK_FRAMES || !is_movable(address, entry)) return true;
+        return migrate(address, entry, first);
+    });
+
+    if(owned_count == COMPACT_BLOCK_FRAMES) {
+        pmm::free_contiguous(first * BLOCK_SIZE, COMPACT_BLOCK_FRAMES);
+        compact::stats.blocks_freed++;
+        return true;
+    }
+
+    // Something pinned a frame during the pass, the held frames go back one by one
+    for(uint32_t i = 0; i < COMPACT_BLOCK_FRAMES; i++)
+        if(owned[i / 32] & (1u << (i % 32)))
+            pmm::free_contiguous((first + i) * BLOCK_SIZE, 1);
+
+    compact::stats.failures++;
+    return false;
+}
+
+bool compact::run() {
+    // Movable pages are only found through the page tables
+    if(!kernelPageDirectory) return false;
+
+    // Migrating allocates frames, and an interrupt handler may want contiguous memory meanwhile. Those get no pass
+    uint32_t flags = irq_save();
+    if(running) {
+        irq_restore(flags);
+        return false;
+    }
+    running = true;
+    irq_restore(flags);
+
+    const bool freed = run_pass();
+    running = false;
+    return freed;
+}
+
+void compact::balance() {
+    uint64_t now = pit::get_ticks();
+    if(now < next_check) return;
+    next_check = now + COMPACT_CHECK_TICKS;
+
+    // Compaction needs a block's worth of free memory, and is pointless once a whole block is free
+    if(pmm::free_blocks < 2 * COMPACT_BLOCK_FRAMES) return;
+    uint32_t largest = pmm::largest_free_run();
+    if(largest >= COMPACT_BLOCK_FRAMES) return;
+
+    // Share of free memory outside the largest run, like the memstats report
+    uint32_t fragmentation = 100 - largest * 100 / uint32_t(pmm::free_blocks);
+    if(fragmentation < COMPACT_FRAGMENTATION) return;
+
+    if(!run()) next_check = now + COMPACT_BACKOFF_TICKS;
+}
+
+#pragma endregion
+
+void compact::print_stats() {
+    vga::printf("Compaction: runs ");
+    vga::printf(stats.runs);
+    vga::printf(", blocks freed ");
+    vga::printf(stats.blocks_freed);
+    vga::printf(", pages moved ");
+    vga::printf(stats.pages_moved);
+    vga::printf(" (last ");
+    vga::printf(stats.last_moved);
+    vga::printf("), failures ");
+    vga::printf(stats.failures);
+    vga::printf('\n');
+}
@@ -0,0 +1,185 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// memstats.cpp reports how memory is used across the PMM, VMM and heap
+// This file contains:
+// Collecting counters, allocation rates, per region usage and fragmentation,
+// printing reports on screen and over the serial port
+// =======================================================================
+
+#include <memory/memstats.hpp>
+#include <memory/physical/pmm.hpp>
+#include <memory/physical/memblock.hpp>
+#include <memory/physical/buddy.hpp>
+#include <memory/physical/malloc.hpp>
+#include <memory/virtual/vmm.hpp>
+#include <memory/virtual/heap.hpp>
+#include <memory/virtual/vma.hpp>
+#include <memory/compact.hpp>
+#include <drivers/vga_print.hpp>
+#include <drivers/serial.hpp>
+
+// Rate sampling
+static uint64_t last_sample = 0;
+static uint64_t last_report = 0;
+static uint32_t last_allocs = 0;
+static uint32_t last_frees = 0;
+static uint32_t last_faults = 0;
+static uint32_t alloc_rate = 0;
+static uint32_t free_rate = 0;
+static uint32_t fault_rate = 0;
+
+#pragma region Collecting
+
+memstats::snapshot_t memstats::collect() {
+    snapshot_t snapshot;
+
+    snapshot.total_frames = pmm::num_blocks;
+    snapshot.cached_frames = pmm::magazine_frames();
+    snapshot.free_frames = pmm::free_blocks + snapshot.cached_frames;
+    snapshot.largest_free_run = pmm::largest_free_run();
+    snapshot.alloc_rate = alloc_rate;
+    snapshot.free_rate = free_rate;
+    snapshot.alloc_failures = pmm::stats.failures;
+    snapshot.fault_rate = fault_rate;
+    snapshot.page_table_pages = vmm::page_table_pages;
+    snapshot.heap_mapped_pages = heap::stats.mapped_pages;
+    snapshot.heap_used_pages = heap::stats.used_pages;
+    snapshot.heap_high_water_pages = heap::stats.high_water_pages;
+    snapshot.kmalloc_bytes = kmalloc_stats.bytes_in_use;
+
+    return snapshot;
+}
+
+void memstats::update() {
+    uint64_t now = pit::get_ticks();
+    uint32_t elapsed = uint32_t(now - last_sample);
+
+    if(elapsed >= MEMSTATS_SAMPLE_TICKS) {
+        uint32_t allocs = pmm::stats.frame_allocs;
+        uint32_t frees = pmm::stats.frame_frees;
+        uint32_t faults = vma::stats.faults;
+
+        alloc_rate = (allocs - last_allocs) * PIT_FREQUENCY / elapsed;
+        free_rate = (frees - last_frees) * PIT_FREQUENCY / elapsed;
+        fault_rate = (faults - last_faults) * PIT_FREQUENCY / elapsed;
+
+        last_allocs = allocs;
+        last_frees = frees;
+        last_faults = faults;
+        last_sample = now;
+    }
+
+    if(MEMSTATS_REPORT_TICKS != 0 && now - last_report >= MEMSTATS_REPORT_TICKS) {
+        last_report = now;
+        report_serial();
+    }
+}
+
+#pragma endregion
+
+#pragma region Reports
+
+// Writes the report through print, which takes the same types as vga::printf
+template<typename Print>
+static void write_report(Print print) {
+    memstats::snapshot_t snapshot = memstats::collect();
+
+    print("Memory: free frames ");
+    print(snapshot.free_frames);
+    print(" of ");
+    print(snapshot.total_frames);
+    print(" (cached ");
+    print(snapshot.cached_frames);
+    print(")\n");
+
+    // Share of free memory outside the largest run, in percent. 0 means one contiguous run
+    uint32_t fragmentation = pmm::free_blocks ? 100 - snapshot.largest_free_run * 100 / uint32_t(pmm::free_blocks) : 0;
+    print("  largest free run ");
+    print(snapshot.largest_free_run);
+    print(", fragmentation % ");
+    print(fragmentation);
+    print('\n');
+
+    print("  compaction runs ");
+    print(compact::stats.runs);
+    print(", blocks freed ");
+    print(compact::stats.blocks_freed);
+    print(", pages moved ");
+    print(compact::stats.pages_moved);
+    print('\n');
+
+    print("  frames/s alloc ");
+    print(snapshot.alloc_rate);
+    print(", free ");
+    print(snapshot.free_rate);
+    print(", failures ");
+    print(snapshot.alloc_failures);
+    print('\n');
+
+    print("  page faults/s ");
+    print(snapshot.fault_rate);
+    print(", faults ");
+    print(vma::stats.faults);
+    print(", bad ");
+    print(vma::stats.bad_faults);
+    print(", areas ");
+    print(vma::stats.areas);
+    print(", reserved pages ");
+    print(vma::stats.reserved_pages);
+    print('\n');
+
+    print("  page table pages ");
+    print(snapshot.page_table_pages);
+    print(", heap pages mapped ");
+    print(snapshot.heap_mapped_pages);
+    print(", used ");
+    print(snapshot.heap_used_pages);
+    print(", high water ");
+    print(snapshot.heap_high_water_pages);
+    print(", kmalloc bytes ");
+    print(snapshot.kmalloc_bytes);
+    print('\n');
+
+    // Buddy free blocks per order show how contiguous the borrowed chunks still are
+    print("  buddy free blocks per order:");
+    for(uint32_t order = 0; order < BUDDY_ORDERS; order++) {
+        print(' ');
+        print(pmm::buddy_stats[order].free_count);
+    }
+    print('\n');
+
+    print("  regions (base, size, free frames, used frames):\n");
+    for(uint32_t i = 0; i < memblock::memory.count; i++) {
+        const memblock::region& range = memblock::memory.entries[i];
+        if(range.base >= pmm::num_blocks * BLOCK_SIZE) continue;
+
+        uint32_t first = range.base / BLOCK_SIZE;
+        uint32_t count = range.size / BLOCK_SIZE;
+        if(first + count > pmm::num_blocks) count = pmm::num_blocks - first;
+        uint32_t free = pmm::count_free_blocks(first, count);
+
+        print("    ");
+        print(range.base);
+        print(' ');
+        print(range.size);
+        print(' ');
+        print(free);
+        print(' ');
+        print(count - free);
+        print('\n');
+    }
+}
+
+void memstats::print() {
+    write_report([](auto value) { vga::printf(value); });
+}
+
+void memstats::report_serial() {
+    write_report([](auto value) { serial::write(value); });
+}
+
+#pragma endregion
@@ -0,0 +1,231 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// memtrace.cpp records allocator events when built with MEM_TRACE=1
+// This file contains:
+// The event ring buffer, per call site aggregates, live allocation lookup,
+// exporting everything over the serial port
+// =======================================================================
+
+#include <memory/memtrace.hpp>
+
+#ifdef MEM_TRACE
+
+#include <drivers/serial.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+// One allocator call
+struct trace_event {
+    uint64_t tsc;
+    uint32_t caller;  // Return address into the caller
+    uint32_t address;
+    uint32_t size;    // Bytes allocated, or freed if the allocation was known
+    uint32_t kind;
+};
+
+// Aggregates of one call site
+struct trace_site {
+    uint32_t caller;      // 0 for an unused slot
+    uint32_t allocs;
+    uint32_t frees;       // Frees of allocations made here, from anywhere
+    uint32_t live_bytes;
+    uint32_t peak_bytes;
+    uint32_t total_bytes;
+};
+
+// An allocation that was not freed yet
+struct live_allocation {
+    uint32_t address; // 0 for an unused slot
+    uint32_t size;
+    uint16_t site;
+    uint16_t reserved;
+};
+
+static trace_event events[MEMTRACE_RING_SIZE];
+static uint32_t event_count = 0; // Events ever recorded, the ring holds the newest
+
+static trace_site sites[MEMTRACE_SITES];
+static uint32_t site_count = 0;
+
+static live_allocation live[MEMTRACE_LIVE];
+static uint32_t live_count = 0;
+
+// Allocations that could not be attributed because a table was full
+static uint32_t dropped = 0;
+
+#pragma region Tables
+
+static inline uint32_t hash(const uint32_t key, const uint32_t mask) {
+    return ((key >> 4) * 2654435761u) & mask;
+}
+
+// Slot of a call site, created on first use. -1 if the table is full
+static int32_t find_site(const uint32_t caller) {
+    for(uint32_t i = hash(caller, MEMTRACE_SITES - 1);; i = (i + 1) & (MEMTRACE_SITES - 1)) {
+        if(sites[i].caller == caller) return i;
+        if(sites[i].caller) continue;
+
+        // Keeping one slot empty so lookups always stop
+        if(site_count == MEMTRACE_SITES - 1) return -1;
+        sites[i].caller = caller;
+        site_count++;
+        return i;
+    }
+}
+
+// Slot of a live allocation, -1 if it is not tracked
+static int32_t find_live(const uint32_t address) {
+    for(uint32_t i = hash(address, MEMTRACE_LIVE - 1); live[i].address; i = (i + 1) & (MEMTRACE_LIVE - 1))
+        if(live[i].address == address) return i;
+    return -1;
+}
+
+// Linear probing removal, later entries of the same chain move into the hole
+static void remove_live(uint32_t hole) {
+    const uint32_t mask = MEMTRACE_LIVE - 1;
+
+    for(uint32_t next = (hole + 1) & mask; live[next].address; next = (next + 1) & mask) {
+        uint32_t home = hash(live[next].address, mask);
+        if(((next - home) & mask) >= ((next - hole) & mask)) {
+            live[hole] = live[next];
+            hole = next;
+        }
+    }
+
+    live[hole].address = 0;
+    live_count--;
+}
+
+static void push_event(const memtrace_kind kind, const uint32_t caller, const uint32_t address, const uint32_t size) {
+    trace_event& event = events[event_count++ & (MEMTRACE_RING_SIZE - 1)];
+    event.tsc = rdtsc();
+    event.caller = caller;
+    event.address = address;
+    event.size = size;
+    event.kind = kind;
+}
+
+#pragma endregion
+
+#pragma region Recording
+
+void memtrace::record_alloc(const memtrace_kind kind, const uint32_t caller, const uint32_t address, const uint32_t size) {
+    uint32_t flags = irq_save();
+    push_event(kind, caller, address, size);
+
+    int32_t site = find_site(caller);
+    if(site < 0 || live_count == MEMTRACE_LIVE - 1) {
+        dropped++;
+        irq_restore(flags);
+        return;
+    }
+
+    trace_site& entry = sites[site];
+    entry.allocs++;
+    entry.total_bytes += size;
+    entry.live_bytes += size;
+    if(entry.live_bytes > entry.peak_bytes) entry.peak_bytes = entry.live_bytes;
+
+    // Same address handed out twice without a traced free, the old record is stale
+    int32_t stale = find_live(address);
+    if(stale >= 0) {
+        sites[live[stale].site].live_bytes -= live[stale].size;
+        remove_live(stale);
+    }
+
+    uint32_t i = hash(address, MEMTRACE_LIVE - 1);
+    while(live[i].address) i = (i + 1) & (MEMTRACE_LIVE - 1);
+    live[i].address = address;
+    live[i].size = size;
+    live[i].site = site;
+    live_count++;
+
+    irq_restore(flags);
+}
+
+void memtrace::record_free(const memtrace_kind kind, const uint32_t caller, const uint32_t address) {
+    uint32_t flags = irq_save();
+
+    int32_t slot = find_live(address);
+    uint32_t size = 0;
+    if(slot >= 0) {
+        size = live[slot].size;
+        trace_site& entry = sites[live[slot].site];
+        entry.frees++;
+        entry.live_bytes -= size;
+        remove_live(slot);
+    }
+
+    push_event(kind, caller, address, size);
+    irq_restore(flags);
+}
+
+#pragma endregion
+
+#pragma region Exporting
+
+void memtrace::dump() {
+    uint32_t flags = irq_save();
+
+    // Oldest event still in the ring first
+    uint32_t first = event_count > MEMTRACE_RING_SIZE ? event_count - MEMTRACE_RING_SIZE : 0;
+
+    serial::write("MEMTRACE BEGIN\n");
+    for(uint32_t i = first; i < event_count; i++) {
+        const trace_event& event = events[i & (MEMTRACE_RING_SIZE - 1)];
+        serial::write("E ");
+        serial::write(event.tsc);
+        serial::write(' ');
+        serial::write(event.kind);
+        serial::write(' ');
+        serial::write(event.caller);
+        serial::write(' ');
+        serial::write(event.address);
+        serial::write(' ');
+        serial::write(event.size);
+        serial::write('\n');
+    }
+
+    for(uint32_t i = 0; i < MEMTRACE_SITES; i++) {
+        const trace_site& site = sites[i];
+        if(!site.caller) continue;
+
+        serial::write("S ");
+        serial::write(site.caller);
+        serial::write(' ');
+        serial::write(site.allocs);
+        serial::write(' ');
+        serial::write(site.frees);
+        serial::write(' ');
+        serial::write(site.live_bytes);
+        serial::write(' ');
+        serial::write(site.peak_bytes);
+        serial::write(' ');
+        serial::write(site.total_bytes);
+        serial::write('\n');
+    }
+    serial::write("MEMTRACE END\n");
+
+    irq_restore(flags);
+    print_summary();
+}
+
+void memtrace::print_summary() {
+    vga::printf("Memtrace: events ");
+    vga::printf(event_count);
+    vga::printf(", call sites ");
+    vga::printf(site_count);
+    vga::printf(", live allocations ");
+    vga::printf(live_count);
+    vga::printf(", dropped ");
+    vga::printf(dropped);
+    vga::printf('\n');
+}
+
+#pragma endregion
+
+#endif // MEM_TRACE
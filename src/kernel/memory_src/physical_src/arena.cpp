@@ -0,0 +1,220 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// arena.cpp provides region allocation for short lived groups of objects
+// This file contains:
+// Bump allocation inside chunks, checkpoints and rollback, releasing whole
+// arenas, the pool of released chunks
+// =======================================================================
+
+#include <memory/physical/arena.hpp>
+#include <memory/physical/buddy.hpp>
+#include <memory/physical/pmm.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+// Header at the start of every chunk
+struct arena_chunk {
+    arena_chunk* next;
+    uint32_t size;  // Bytes in the chunk, header included
+    uint32_t used;  // Offset of the first free byte
+    uint8_t order;  // Buddy order of the chunk
+};
+
+// Chunks of released arenas, in no particular order
+static arena_chunk* chunk_pool = nullptr;
+static uint32_t pool_chunks = 0;
+
+#pragma region Chunks
+
+static inline uint32_t align_up_32(const uint32_t value, const uint32_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// A chunk with at least bytes of room, from the pool if its head is big enough
+static arena_chunk* get_chunk(const uint32_t bytes) {
+    uint32_t flags = irq_save();
+    if(chunk_pool && chunk_pool->size >= bytes) {
+        arena_chunk* chunk = chunk_pool;
+        chunk_pool = chunk->next;
+        pool_chunks--;
+        irq_restore(flags);
+
+        chunk->used = sizeof(arena_chunk);
+        return chunk;
+    }
+    irq_restore(flags);
+
+    uint8_t order = ARENA_CHUNK_ORDER;
+    while(order <= BUDDY_MAX_ORDER && (uint32_t(BLOCK_SIZE) << order) < bytes) order++;
+    if(order > BUDDY_MAX_ORDER) return nullptr;
+
+    uint32_t block = pmm::allocate_frames(order);
+    if(block == uint32_t(-1)) return nullptr;
+
+    arena_chunk* chunk = phys_to_virt<arena_chunk>(block);
+    chunk->size = BLOCK_SIZE << order;
+    chunk->used = sizeof(arena_chunk);
+    chunk->order = order;
+    return chunk;
+}
+
+static void put_chunk(arena_chunk* chunk) {
+    uint32_t flags = irq_save();
+    chunk->next = chunk_pool;
+    chunk_pool = chunk;
+    pool_chunks++;
+    irq_restore(flags);
+}
+
+void arena_trim_pool(const uint32_t keep) {
+    for(;;) {
+        uint32_t flags = irq_save();
+        if(pool_chunks <= keep) {
+            irq_restore(flags);
+            return;
+        }
+        arena_chunk* chunk = chunk_pool;
+        chunk_pool = chunk->next;
+        pool_chunks--;
+        irq_restore(flags);
+
+        pmm::free_frames(virt_to_phys(chunk), chunk->order);
+    }
+}
+
+#pragma endregion
+
+#pragma region Arenas
+
+void arena_init(arena* a) {
+    a->chunks = a->last = nullptr;
+    a->chunk_count = a->allocations = a->bytes = 0;
+}
+
+void* arena_alloc(arena* a, const size_t size, size_t align) {
+    if(size == 0) return nullptr;
+    if(align == 0) align = 8;
+    if(align & (align - 1)) {
+        vga::error("arena_alloc: alignment is not a power of two!\n");
+        return nullptr;
+    }
+
+    arena_chunk* chunk = a->chunks;
+    uint32_t start = chunk ? align_up_32(uint32_t(chunk) + chunk->used, align) : 0;
+
+    // Starting a new chunk, the rest of the current one stays unused
+    if(!chunk || start + size > uint32_t(chunk) + chunk->size) {
+        chunk = get_chunk(sizeof(arena_chunk) + align - 1 + size);
+        if(!chunk) {
+            vga::error("arena_alloc: out of memory!\n");
+            return nullptr;
+        }
+
+        chunk->next = a->chunks;
+        if(!a->chunks) a->last = chunk;
+        a->chunks = chunk;
+        a->chunk_count++;
+        start = align_up_32(uint32_t(chunk) + chunk->used, align);
+    }
+
+    a->bytes += start + size - (uint32_t(chunk) + chunk->used);
+    a->allocations++;
+    chunk->used = start + size - uint32_t(chunk);
+    return reinterpret_cast<void*>(start);
+}
+
+arena_checkpoint arena_save(const arena* a) {
+    arena_checkpoint checkpoint;
+    checkpoint.chunk = a->chunks;
+    checkpoint.used = a->chunks ? a->chunks->used : 0;
+    checkpoint.allocations = a->allocations;
+    checkpoint.bytes = a->bytes;
+    return checkpoint;
+}
+
+void arena_rollback(arena* a, const arena_checkpoint& checkpoint) {
+    // Chunks started after the checkpoint are in front of its chunk
+    while(a->chunks && a->chunks != checkpoint.chunk) {
+        arena_chunk* chunk = a->chunks;
+        a->chunks = chunk->next;
+        a->chunk_count--;
+        put_chunk(chunk);
+    }
+
+    if(a->chunks) a->chunks->used = checkpoint.used;
+    else a->last = nullptr;
+
+    a->allocations = checkpoint.allocations;
+    a->bytes = checkpoint.bytes;
+}
+
+void arena_release(arena* a) {
+    if(a->chunks) {
+        // The whole chunk list joins the pool at once
+        uint32_t flags = irq_save();
+        a->last->next = chunk_pool;
+        chunk_pool = a->chunks;
+        pool_chunks += a->chunk_count;
+        irq_restore(flags);
+    }
+
+    arena_init(a);
+}
+
+#pragma endregion
+
+#pragma region Testing
+
+#define TEST_ARENA_ALLOCATIONS 2000
+
+void test_arena() {
+    arena a;
+    arena_init(&a);
+
+    // Small allocations fill several chunks
+    for(uint32_t i = 0; i < TEST_ARENA_ALLOCATIONS; i++) {
+        uint32_t* value = reinterpret_cast<uint32_t*>(arena_alloc(&a, 24));
+        if(!value) return;
+        *value = i;
+    }
+
+    // Everything after a checkpoint is gone after the rollback, so the same address comes back
+    uint32_t chunks = a.chunk_count;
+    void* first;
+    {
+        arena_scope scope(&a);
+        first = arena_alloc(&a, 100, 64);
+        for(uint32_t i = 0; i < TEST_ARENA_ALLOCATIONS; i++)
+            arena_alloc(&a, 48);
+    }
+    const bool dropped = a.chunk_count == chunks;
+    void* again = arena_alloc(&a, 100, 64);
+
+    if(!dropped || first != again || uint32_t(first) & 63) {
+        vga::error("Arena rollback failed!\n");
+        return;
+    }
+
+    vga::printf("Arena: chunks ");
+    vga::printf(a.chunk_count);
+    vga::printf(", allocations ");
+    vga::printf(a.allocations);
+    vga::printf(", bytes ");
+    vga::printf(a.bytes);
+    vga::printf('\n');
+
+    // Released chunks are reused without going to the PMM
+    arena_release(&a);
+    uint32_t pooled = pool_chunks;
+    arena_alloc(&a, 24);
+    if(pool_chunks != pooled - 1) vga::error("Arena chunk was not reused!\n");
+
+    arena_release(&a);
+    arena_trim_pool(ARENA_POOL_KEEP);
+}
+
+#pragma endregion
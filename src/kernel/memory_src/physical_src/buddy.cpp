@@ -0,0 +1,278 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// buddy.cpp is a buddy allocator for contiguous physical memory
+// This file contains:
+// Per order free lists, splitting and coalescing blocks, per order counters
+// The allocator borrows 4 MiB chunks from the PMM bitmap on demand
+// and gives them back once they are completely free again
+// =======================================================================
+
+#include <memory/physical/buddy.hpp>
+#include <memory/physical/pmm.hpp>
+#include <memory/memtrace.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+#define CHUNK_SIZE (BLOCK_SIZE << BUDDY_MAX_ORDER)
+#define CHUNK_BLOCKS (1 << BUDDY_MAX_ORDER)
+// Free 4 MiB chunks kept before handing them back to the bitmap
+#define BUDDY_KEEP_CHUNKS 1
+
+pmm::buddy_order_stats pmm::buddy_stats[BUDDY_ORDERS];
+
+#pragma region Variables
+
+// A free block stores the list links in its own first bytes, reached through the direct map
+struct free_block {
+    free_block* next;
+    free_block* prev;
+};
+
+static free_block* free_lists[BUDDY_ORDERS];
+
+// Chunk owned by each slot (0 = unused slot)
+static uint32_t slot_base[BUDDY_MAX_CHUNKS];
+// Maps (address / 4 MiB) to slot + 1 (0 = chunk not owned by the buddy allocator)
+static uint16_t chunk_slot[1024];
+
+/* One bit per block of every order inside a chunk, set when that block is free
+ * Order k starts at bit 2048 - (2048 >> k), so all orders fit in 2048 bits */
+static uint64_t free_map[BUDDY_MAX_CHUNKS][2 * CHUNK_BLOCKS / 64];
+
+#pragma endregion
+
+#pragma region Helper Functions
+
+// Bit index of a block inside its chunk's free map
+static inline uint32_t map_index(const uint32_t address, const uint8_t order) {
+    uint32_t offset = address & (CHUNK_SIZE - 1);
+    return (2 * CHUNK_BLOCKS - ((2 * CHUNK_BLOCKS) >> order)) + (offset >> (12 + order));
+}
+
+// Returns the slot owning this address, or -1 if the buddy allocator does not own it
+static inline int owner_slot(const uint32_t address) {
+    return int(chunk_slot[address / CHUNK_SIZE]) - 1;
+}
+
+static bool is_free(const uint32_t address, const uint8_t order) {
+    int slot = owner_slot(address);
+    if(slot < 0) return false;
+
+    uint32_t bit = map_index(address, order);
+    return free_map[slot][bit / 64] & (uint64_t(1) << (bit % 64));
+}
+
+// Pushes a block to the front of its order's free list and marks it free
+static void push_block(const uint32_t address, const uint8_t order) {
+    free_block* block = phys_to_virt<free_block>(address);
+    block->prev = nullptr;
+    block->next = free_lists[order];
+    if(free_lists[order]) free_lists[order]->prev = block;
+    free_lists[order] = block;
+
+    uint32_t bit = map_index(address, order);
+    free_map[owner_slot(address)][bit / 64] |= (uint64_t(1) << (bit % 64));
+    pmm::buddy_stats[order].free_count++;
+}
+
+// Unlinks a block from anywhere in its order's free list and marks it used
+static void remove_block(const uint32_t address, const uint8_t order) {
+    free_block* block = phys_to_virt<free_block>(address);
+    if(block->prev) block->prev->next = block->next;
+    else free_lists[order] = block->next;
+    if(block->next) block->next->prev = block->prev;
+
+    uint32_t bit = map_index(address, order);
+    free_map[owner_slot(address)][bit / 64] &= ~(uint64_t(1) << (bit % 64));
+    pmm::buddy_stats[order].free_count--;
+}
+
+// True if the block is free, or lies inside a larger free block
+static bool inside_free(const uint32_t address, const uint8_t order) {
+    for(uint8_t current = order; current <= BUDDY_MAX_ORDER; current++)
+        if(is_free(address & ~((BLOCK_SIZE << current) - 1), current)) return true;
+    return false;
+}
+
+// Smallest order from order up that has a free block, above BUDDY_MAX_ORDER if none does
+static uint8_t smallest_free(const uint8_t order) {
+    uint8_t current = order;
+    while(current <= BUDDY_MAX_ORDER && !free_lists[current]) current++;
+    return current;
+}
+
+/* Borrows one 4 MiB chunk from the bitmap, called without the buddy lock since the PMM may compact memory first.
+ * A caller that had interrupts off gets no compaction, a whole pass would run with them off */
+static bool grow(const uint32_t callerFlags) {
+    uint32_t chunk = pmm::allocate_contiguous(CHUNK_BLOCKS, CHUNK_SIZE, (callerFlags & EFLAGS_IF) ? 0 : PMM_NO_COMPACT);
+    if(chunk == uint32_t(-1)) return false;
+
+    uint32_t irq = irq_save();
+    int slot = 0;
+    while(slot < BUDDY_MAX_CHUNKS && slot_base[slot]) slot++;
+    if(slot == BUDDY_MAX_CHUNKS) {
+        irq_restore(irq);
+        pmm::free_contiguous(chunk, CHUNK_BLOCKS);
+        return false;
+    }
+
+    slot_base[slot] = chunk;
+    chunk_slot[chunk / CHUNK_SIZE] = slot + 1;
+    push_block(chunk, BUDDY_MAX_ORDER);
+    irq_restore(irq);
+    return true;
+}
+
+// Gives a completely free chunk back to the bitmap
+static void release(const uint32_t chunk) {
+    int slot = owner_slot(chunk);
+
+    remove_block(chunk, BUDDY_MAX_ORDER);
+    slot_base[slot] = 0;
+    chunk_slot[chunk / CHUNK_SIZE] = 0;
+    pmm::free_contiguous(chunk, CHUNK_BLOCKS);
+}
+
+#pragma endregion
+
+#pragma region Block Handling
+
+uint32_t pmm::allocate_frames(const uint8_t order) {
+    if(order > BUDDY_MAX_ORDER) {
+        vga::error("Buddy allocation order too large!\n");
+        return -1;
+    }
+
+    // Interrupt handlers may allocate and free blocks too
+    uint32_t irq = irq_save();
+    uint8_t current = smallest_free(order);
+
+    if(current > BUDDY_MAX_ORDER) {
+        irq_restore(irq);
+        const bool grown = grow(irq);
+        irq = irq_save();
+
+        // An interrupt may have taken the new chunk already
+        current = smallest_free(order);
+        if(!grown || current > BUDDY_MAX_ORDER) {
+            buddy_stats[order].failures++;
+            irq_restore(irq);
+            vga::error("No contiguous memory left for buddy allocation!\n");
+            return -1;
+        }
+    }
+
+    uint32_t address = virt_to_phys(free_lists[current]);
+    remove_block(address, current);
+
+    // Splitting down, the upper halves go back to the free lists
+    while(current > order) {
+        buddy_stats[current].splits++;
+        current--;
+        push_block(address + (BLOCK_SIZE << current), current);
+    }
+
+    buddy_stats[order].allocs++;
+    irq_restore(irq);
+    MEM_TRACE_ALLOC(MEMTRACE_BLOCK_ALLOC, address, BLOCK_SIZE << order);
+    return address;
+}
+
+void pmm::free_frames(uint32_t address, uint8_t order) {
+    uint32_t irq = irq_save();
+
+    // A block freed twice may have merged into a larger free block since
+    if(order > BUDDY_MAX_ORDER || (address & ((BLOCK_SIZE << order) - 1)) ||
+       owner_slot(address) < 0 || inside_free(address, order)) {
+        irq_restore(irq);
+        vga::error("Invalid buddy block freed: ");
+        vga::error(address);
+        vga::printf('\n');
+        return;
+    }
+
+    buddy_stats[order].frees++;
+    MEM_TRACE_FREE(MEMTRACE_BLOCK_FREE, address);
+
+    // Merging with the buddy for as long as it is free too
+    while(order < BUDDY_MAX_ORDER) {
+        uint32_t buddy = address ^ (BLOCK_SIZE << order);
+        if(!is_free(buddy, order)) break;
+
+        remove_block(buddy, order);
+        buddy_stats[order].merges++;
+        address &= ~(BLOCK_SIZE << order);
+        order++;
+    }
+
+    push_block(address, order);
+
+    // Whole chunk is free again
+    if(order == BUDDY_MAX_ORDER && buddy_stats[BUDDY_MAX_ORDER].free_count > BUDDY_KEEP_CHUNKS)
+        release(address);
+    irq_restore(irq);
+}
+
+#pragma endregion
+
+#pragma region Statistics and Testing
+
+void pmm::print_buddy_stats() {
+    vga::printf("Buddy: order, free, allocs, frees, splits, merges, failures\n");
+
+    for(uint8_t order = 0; order < BUDDY_ORDERS; order++) {
+        const buddy_order_stats& stats = buddy_stats[order];
+        if(!stats.free_count && !stats.allocs && !stats.splits && !stats.merges && !stats.failures)
+            continue;
+
+        vga::printf(uint32_t(order));
+        vga::printf(' ');
+        vga::printf(stats.free_count);
+        vga::printf(' ');
+        vga::printf(stats.allocs);
+        vga::printf(' ');
+        vga::printf(stats.frees);
+        vga::printf(' ');
+        vga::printf(stats.splits);
+        vga::printf(' ');
+        vga::printf(stats.merges);
+        vga::printf(' ');
+        vga::printf(stats.failures);
+        vga::printf('\n');
+    }
+}
+
+void pmm::test_buddy() {
+    uint32_t single = allocate_frames(0);
+    uint32_t eight = allocate_frames(3);
+    uint32_t large = allocate_frames(BUDDY_MAX_ORDER);
+
+    vga::printf("Buddy order 0: ");
+    vga::printf(single);
+    vga::printf("\nBuddy order 3: ");
+    vga::printf(eight);
+    vga::printf("\nBuddy order 10: ");
+    vga::printf(large);
+    vga::printf('\n');
+
+    // Every block has to be aligned to its own size
+    if((eight & ((BLOCK_SIZE << 3) - 1)) || (large & (CHUNK_SIZE - 1)))
+        vga::error("Buddy block is misaligned!\n");
+
+    free_frames(single, 0);
+    free_frames(eight, 3);
+    free_frames(large, BUDDY_MAX_ORDER);
+
+    // After freeing everything only whole chunks should be left
+    for(uint8_t order = 0; order < BUDDY_MAX_ORDER; order++)
+        if(buddy_stats[order].free_count)
+            vga::error("Buddy blocks did not coalesce!\n");
+
+    print_buddy_stats();
+}
+
+#pragma endregion
@@ -0,0 +1,182 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// highmem.cpp manages RAM past the direct map, up to 64 GiB with PAE
+// This file contains:
+// The high memory bitmap, allocating and freeing 64-bit frames,
+// their reference counts, user frame allocation
+// =======================================================================
+
+#include <memory/physical/pmm.hpp>
+#include <memory/physical/memblock.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+pmm::highmem_stats_t pmm::highmem_stats;
+
+// One bit per frame from PMM_MAX_ADDRESS on (1 = allocated), kept in low memory like the main bitmap
+static uint64_t* high_bitmap = nullptr;
+static uint8_t* high_refs = nullptr;
+static uint32_t high_frames = 0;
+static uint32_t high_hint = 0; // Bitmap word of the last allocation
+
+// Frame index inside high memory
+static inline uint32_t high_index(const uint64_t address) {
+    return uint32_t((address - PMM_MAX_ADDRESS) >> 12);
+}
+
+static inline uint64_t high_address(const uint32_t index) {
+    return PMM_MAX_ADDRESS + (uint64_t(index) << 12);
+}
+
+#pragma region Initialization
+
+void pmm::init_highmem() {
+    uint64_t max_address = 0;
+    for(uint32_t i = 0; i < memblock::memory.count; i++) {
+        const memblock::region& range = memblock::memory.entries[i];
+        if(range.base + range.size > max_address) max_address = range.base + range.size;
+    }
+    if(max_address > HIGHMEM_MAX_ADDRESS) max_address = HIGHMEM_MAX_ADDRESS;
+    if(max_address <= PMM_MAX_ADDRESS) return;
+
+    high_frames = high_index(max_address);
+    const uint32_t words = (high_frames + 63) / 64;
+    uint32_t bitmap_address = memblock::alloc(words * sizeof(uint64_t), BLOCK_SIZE, PMM_MAX_ADDRESS);
+    uint32_t refs_address = memblock::alloc(high_frames, BLOCK_SIZE, PMM_MAX_ADDRESS);
+    if(!bitmap_address || !refs_address) {
+        vga::error("Failed to allocate the high memory bitmap!\n");
+        high_frames = 0;
+        return;
+    }
+
+    high_bitmap = phys_to_virt<uint64_t>(bitmap_address);
+    high_refs = phys_to_virt<uint8_t>(refs_address);
+    memset(high_bitmap, 0xFF, words * sizeof(uint64_t));
+    memset(high_refs, 0, high_frames);
+
+    // Like the main bitmap: usable RAM is freed, holes and reserved ranges stay allocated
+    for(uint32_t i = 0; i < memblock::memory.count; i++) {
+        const memblock::region& range = memblock::memory.entries[i];
+        uint64_t start = range.base < PMM_MAX_ADDRESS ? PMM_MAX_ADDRESS : range.base;
+        uint64_t end = range.base + range.size > max_address ? max_address : range.base + range.size;
+
+        for(uint64_t address = start; address < end; address += BLOCK_SIZE) {
+            uint32_t index = high_index(address);
+            high_bitmap[index / 64] &= ~(uint64_t(1) << (index % 64));
+            highmem_stats.free_frames++;
+        }
+    }
+
+    for(uint32_t i = 0; i < memblock::reserved.count; i++) {
+        const memblock::region& range = memblock::reserved.entries[i];
+        uint64_t start = range.base < PMM_MAX_ADDRESS ? PMM_MAX_ADDRESS : range.base;
+        uint64_t end = range.base + range.size > max_address ? max_address : range.base + range.size;
+
+        for(uint64_t address = start; address < end; address += BLOCK_SIZE) {
+            uint32_t index = high_index(address);
+            if(high_bitmap[index / 64] & (uint64_t(1) << (index % 64))) continue;
+            high_bitmap[index / 64] |= uint64_t(1) << (index % 64);
+            highmem_stats.free_frames--;
+        }
+    }
+
+    highmem_stats.total_frames = highmem_stats.free_frames;
+}
+
+#pragma endregion
+
+#pragma region Frame Handling
+
+uint64_t pmm::allocate_high_frame() {
+    uint32_t flags = irq_save();
+    const uint32_t words = (high_frames + 63) / 64;
+
+    // Next fit over whole words, a full word is skipped with one compare
+    for(uint32_t n = 0; n < words; n++) {
+        uint32_t word = high_hint + n < words ? high_hint + n : high_hint + n - words;
+        if(high_bitmap[word] == ~uint64_t(0)) continue;
+
+        uint32_t index = word * 64 + ctz64(~high_bitmap[word]);
+        high_bitmap[word] |= uint64_t(1) << (index % 64);
+        high_hint = word;
+        highmem_stats.free_frames--;
+        highmem_stats.allocs++;
+        irq_restore(flags);
+        return high_address(index);
+    }
+
+    irq_restore(flags);
+    return -1;
+}
+
+void pmm::free_high_frame(const uint64_t address) {
+    const uint32_t index = high_index(address);
+    if(!is_high_frame(address) || index >= high_frames || !(high_bitmap[index / 64] & (uint64_t(1) << (index % 64)))) {
+        vga::error("Invalid high memory frame freed: ");
+        vga::printf(address);
+        vga::printf('\n');
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    high_bitmap[index / 64] &= ~(uint64_t(1) << (index % 64));
+    high_refs[index] = 0;
+    highmem_stats.free_frames++;
+    highmem_stats.frees++;
+    irq_restore(flags);
+}
+
+uint64_t pmm::allocate_user_frame() {
+    uint64_t frame = allocate_high_frame();
+    if(frame != uint64_t(-1)) return frame;
+
+    highmem_stats.fallbacks++;
+    uint32_t low = allocate_frame();
+    return low == uint32_t(-1) ? uint64_t(-1) : low;
+}
+
+void pmm::ref_high_frame(const uint64_t address) {
+    uint32_t flags = irq_save();
+    uint8_t& refs = high_refs[high_index(address)];
+    if(refs != HIGHMEM_REFS_PINNED) refs++;
+    irq_restore(flags);
+}
+
+bool pmm::unref_high_frame(const uint64_t address) {
+    uint32_t flags = irq_save();
+    uint8_t& refs = high_refs[high_index(address)];
+
+    if(refs) {
+        if(refs != HIGHMEM_REFS_PINNED) refs--;
+        irq_restore(flags);
+        return false;
+    }
+
+    irq_restore(flags);
+    free_high_frame(address);
+    return true;
+}
+
+uint32_t pmm::high_frame_refs(const uint64_t address) {
+    return high_refs[high_index(address)];
+}
+
+#pragma endregion
+
+void pmm::print_highmem_stats() {
+    vga::printf("High memory: free frames ");
+    vga::printf(highmem_stats.free_frames);
+    vga::printf(" of ");
+    vga::printf(highmem_stats.total_frames);
+    vga::printf(", allocs ");
+    vga::printf(highmem_stats.allocs);
+    vga::printf(", frees ");
+    vga::printf(highmem_stats.frees);
+    vga::printf(", low fallbacks ");
+    vga::printf(highmem_stats.fallbacks);
+    vga::printf('\n');
+}
@@ -5,48 +5,293 @@
 // http://www.opensource.org/licenses/MIT_1_0.txt)
 //
 // malloc.cpp provide heap allocation and different memory management functions
+// This file contains:
+// The legacy bump allocator (an arena that is never released), kmalloc/kfree/krealloc with power of two size classes
 // =======================================================================
 
 #include <memory/physical/malloc.hpp>
 #include <memory/physical/pmm.hpp>
+#include <memory/physical/arena.hpp>
+#include <memory/virtual/heap.hpp>
+#include <memory/memtrace.hpp>
 #include <stdint.h>
 #include <drivers/vga_print.hpp>
 #include <utils/util.hpp>
 
-// Constants
-constexpr size_t HEAP_START = 0x200000; // Example heap start (2 MB mark)
-constexpr size_t HEAP_SIZE = 0x100000;  // 1 MB heap size
-
-// Heap Allocator Variables
-static char* heap_start = nullptr;   // Pointer to heap start
-static size_t heap_offset = 0;       // Current heap offset
-static size_t heap_size = 0;         // Total heap size
+// Bump allocations that are never given back
+static arena legacy_arena;
 
 // Utility: Align Up
 constexpr size_t pmm::align_up(size_t value, size_t alignment) {
     return (value + alignment - 1) & ~(alignment - 1);
 }
 
-// Initialize the Heap
-void pmm::init_heap() {
-    heap_start = reinterpret_cast<char*>(HEAP_START);
-    heap_offset = 0;
-    heap_size = HEAP_SIZE;
-
-    vga::printf("Heap initialized!\n");
-}
-
 // Simple Malloc Implementation
 uint32_t pmm::legacy_malloc(size_t size) {
     size = align_up(size, 8); // Align to 8 bytes for safety
 
-    if (!heap_start || heap_offset + size > heap_size) {
+    void* block = arena_alloc(&legacy_arena, size, 8);
+    if (!block) {
         vga::printf("Out of memory!\n");
-        return -1; // Out of memory
+        return 0; // Out of memory, callers check for a null pointer
+    }
+
+    MEM_TRACE_ALLOC(MEMTRACE_LEGACY_MALLOC, block, size);
+    return uint32_t(block);
+}
+
+#pragma region kmalloc
+
+#define KMALLOC_MAGIC 0x4B4D4C43 // "KMLC"
+#define KMALLOC_LARGE 0xFFFF     // Page kind for page granular allocations
+
+kmalloc_stats_t kmalloc_stats;
+
+/* Every page kmalloc owns starts with this header, so kfree can find
+ * the size class of any pointer by rounding it down to its page */
+struct kmalloc_page {
+    uint32_t magic;
+    uint16_t kind;  // Size class index, or KMALLOC_LARGE
+    uint16_t pages; // Large allocations: heap pages of the block
+    uint32_t size;  // Large allocations: requested size
+    uint32_t reserved;
+};
+
+// Free objects are linked through their own first bytes
+struct free_object {
+    free_object* next;
+};
+
+static free_object* class_free_lists[KMALLOC_CLASSES];
+
+// Smallest size class that fits
+static inline uint32_t size_class(const size_t size) {
+    if(size <= (1 << KMALLOC_MIN_SHIFT)) return 0;
+    return 32 - __builtin_clz(uint32_t(size - 1)) - KMALLOC_MIN_SHIFT;
+}
+
+static inline uint32_t class_size(const uint32_t size_class) {
+    return 1 << (KMALLOC_MIN_SHIFT + size_class);
+}
+
+static inline kmalloc_page* page_of(const void* pointer) {
+    return reinterpret_cast<kmalloc_page*>(uint32_t(pointer) & ~(BLOCK_SIZE - 1));
+}
+
+// Carves a fresh page into objects of one size class
+static bool refill_class(const uint32_t size_class) {
+    uint32_t frame = heap::allocate_pages(1);
+    if(!frame) return false;
+
+    kmalloc_page* page = reinterpret_cast<kmalloc_page*>(frame);
+    page->magic = KMALLOC_MAGIC;
+    page->kind = size_class;
+
+    const uint32_t size = class_size(size_class);
+    for(uint32_t offset = sizeof(kmalloc_page); offset + size <= BLOCK_SIZE; offset += size) {
+        free_object* object = reinterpret_cast<free_object*>(frame + offset);
+        object->next = class_free_lists[size_class];
+        class_free_lists[size_class] = object;
+    }
+
+    kmalloc_stats.class_pages++;
+    return true;
+}
+
+// Heap pages holding size bytes plus the page header
+static inline uint32_t large_pages(const size_t size) {
+    return (size + sizeof(kmalloc_page) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+void* kmalloc(const size_t size) {
+    if(size == 0) return nullptr;
+
+    // Large sizes get their own pages
+    if(size > KMALLOC_MAX_SMALL) {
+        uint32_t pages = large_pages(size);
+        uint32_t block = pages <= 0xFFFF ? heap::allocate_pages(pages) : 0;
+        if(!block) {
+            kmalloc_stats.failures++;
+            return nullptr;
+        }
+
+        kmalloc_page* page = reinterpret_cast<kmalloc_page*>(block);
+        page->magic = KMALLOC_MAGIC;
+        page->kind = KMALLOC_LARGE;
+        page->pages = pages;
+        page->size = size;
+
+        uint32_t flags = irq_save();
+        kmalloc_stats.large_allocs++;
+        kmalloc_stats.bytes_in_use += pages * BLOCK_SIZE;
+        irq_restore(flags);
+        MEM_TRACE_ALLOC(MEMTRACE_KMALLOC, page + 1, size);
+        return page + 1;
+    }
+
+    const uint32_t index = size_class(size);
+    uint32_t flags = irq_save();
+
+    if(!class_free_lists[index] && !refill_class(index)) {
+        kmalloc_stats.failures++;
+        irq_restore(flags);
+        return nullptr;
+    }
+
+    // Popping the first free object, O(1)
+    free_object* object = class_free_lists[index];
+    class_free_lists[index] = object->next;
+
+    kmalloc_stats.allocs[index]++;
+    kmalloc_stats.bytes_in_use += class_size(index);
+    irq_restore(flags);
+    MEM_TRACE_ALLOC(MEMTRACE_KMALLOC, object, size);
+    return object;
+}
+
+void kfree(void* pointer) {
+    if(!pointer) return;
+
+    kmalloc_page* page = page_of(pointer);
+    if(page->magic != KMALLOC_MAGIC) {
+        vga::error("kfree: pointer not from kmalloc: ");
+        vga::error(uint32_t(pointer));
+        vga::printf('\n');
+        return;
+    }
+    MEM_TRACE_FREE(MEMTRACE_KFREE, pointer);
+
+    if(page->kind == KMALLOC_LARGE) {
+        uint32_t flags = irq_save();
+        kmalloc_stats.large_frees++;
+        kmalloc_stats.bytes_in_use -= page->pages * BLOCK_SIZE;
+        irq_restore(flags);
+
+        page->magic = 0;
+        heap::free_pages(uint32_t(page), page->pages);
+        return;
+    }
+
+    // Pushing the object back to its class list, O(1)
+    const uint32_t index = page->kind;
+    uint32_t flags = irq_save();
+
+    free_object* object = reinterpret_cast<free_object*>(pointer);
+    object->next = class_free_lists[index];
+    class_free_lists[index] = object;
+
+    kmalloc_stats.frees[index]++;
+    kmalloc_stats.bytes_in_use -= class_size(index);
+    irq_restore(flags);
+}
+
+void* krealloc(void* pointer, const size_t size) {
+    if(!pointer) return kmalloc(size);
+    if(size == 0) {
+        kfree(pointer);
+        return nullptr;
+    }
+
+    // Usable bytes of the current allocation
+    kmalloc_page* page = page_of(pointer);
+    size_t capacity = page->kind == KMALLOC_LARGE
+        ? page->pages * BLOCK_SIZE - sizeof(kmalloc_page)
+        : class_size(page->kind);
+
+    if(size <= capacity) {
+        if(page->kind == KMALLOC_LARGE) page->size = size;
+        return pointer;
+    }
+
+    void* moved = kmalloc(size);
+    if(!moved) return nullptr;
+
+    // Copying 4 bytes at a time, every allocation is 16 byte aligned
+    uint32_t* source = reinterpret_cast<uint32_t*>(pointer);
+    uint32_t* destination = reinterpret_cast<uint32_t*>(moved);
+    for(size_t i = 0; i < capacity / 4; i++)
+        destination[i] = source[i];
+
+    kfree(pointer);
+    return moved;
+}
+
+#pragma endregion
+
+#pragma region Statistics and Benchmark
+
+void print_kmalloc_stats() {
+    vga::printf("kmalloc: class, allocs, frees\n");
+    for(uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+        vga::printf(class_size(i));
+        vga::printf(' ');
+        vga::printf(kmalloc_stats.allocs[i]);
+        vga::printf(' ');
+        vga::printf(kmalloc_stats.frees[i]);
+        vga::printf('\n');
+    }
+
+    vga::printf("class pages ");
+    vga::printf(kmalloc_stats.class_pages);
+    vga::printf(", large ");
+    vga::printf(kmalloc_stats.large_allocs);
+    vga::printf('/');
+    vga::printf(kmalloc_stats.large_frees);
+    vga::printf(", failures ");
+    vga::printf(kmalloc_stats.failures);
+    vga::printf(", bytes in use ");
+    vga::printf(kmalloc_stats.bytes_in_use);
+    vga::printf('\n');
+}
+
+#define BENCH_ALLOCATIONS 20000
+#define BENCH_LIVE 64 // Allocations kept alive at once
+
+// Small linear congruential generator, so both allocators see the same sizes
+static inline uint32_t next_size(uint32_t& seed) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t size = (seed >> 16) & 0x7FF; // Up to 2 KiB, mostly small
+    return size & 0x400 ? (size & 0x7F) + 1 : size + 1;
+}
+
+void bench_kmalloc() {
+    void* live[BENCH_LIVE] = {};
+    uint32_t seed = 1;
+
+    // kmalloc: a sliding window of live allocations, the oldest is freed first
+    uint64_t start = rdtsc();
+    uint32_t kmalloc_done = 0;
+    for(uint32_t i = 0; i < BENCH_ALLOCATIONS; i++) {
+        kfree(live[i % BENCH_LIVE]);
+        live[i % BENCH_LIVE] = kmalloc(next_size(seed));
+        if(live[i % BENCH_LIVE]) kmalloc_done++;
     }
+    uint64_t kmalloc_cycles = rdtsc() - start;
 
-    uint32_t block = uint32_t(heap_start) + heap_offset;
-    heap_offset += size;
+    for(uint32_t i = 0; i < BENCH_LIVE; i++)
+        kfree(live[i]);
+
+    // Bump allocator: the same sizes, but nothing can be given back
+    seed = 1;
+    start = rdtsc();
+    uint32_t legacy_done = 0;
+    for(uint32_t i = 0; i < BENCH_ALLOCATIONS; i++) {
+        if(!pmm::legacy_malloc(next_size(seed))) break;
+        legacy_done++;
+    }
+    uint64_t legacy_cycles = rdtsc() - start;
+
+    vga::printf("kmalloc bench, allocations requested: ");
+    vga::printf(uint32_t(BENCH_ALLOCATIONS));
+    vga::printf("\n  kmalloc served: ");
+    vga::printf(kmalloc_done);
+    vga::printf(", cycles/op: ");
+    vga::printf(kmalloc_done ? uint32_t(kmalloc_cycles) / kmalloc_done : 0);
+    vga::printf("\n  legacy served:  ");
+    vga::printf(legacy_done);
+    vga::printf(", cycles/op: ");
+    vga::printf(legacy_done ? uint32_t(legacy_cycles) / legacy_done : 0);
+    vga::printf('\n');
+}
 
-    return block;
-}
\ No newline at end of file
+#pragma endregion
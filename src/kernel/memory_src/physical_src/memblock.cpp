@@ -0,0 +1,245 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// memblock.cpp builds the physical memory map and the early boot allocator
+// This file contains:
+// Parsing E820 entries, sorted and merged region tables, reserving ranges,
+// allocating memory before the PMM is up
+// =======================================================================
+
+#include <memory/physical/memblock.hpp>
+#include <memory/physical/pmm.hpp>
+#include <drivers/vga_print.hpp>
+
+// Linker symbols (linker.ld)
+extern "C" char __kernel_start[];
+extern "C" char __kernel_end[];
+
+memblock::region_list memblock::firmware;
+memblock::region_list memblock::memory;
+memblock::region_list memblock::reserved;
+
+// Set once the PMM owns all memory
+static bool retired = false;
+
+#pragma region Helper Functions
+
+static inline uint64_t align_up_64(const uint64_t value, const uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static inline uint64_t align_down_64(const uint64_t value, const uint64_t alignment) {
+    return value & ~(alignment - 1);
+}
+
+// Removes the entry at index, keeping the list sorted
+static void remove_entry(memblock::region_list& list, const uint32_t index) {
+    for(uint32_t i = index; i + 1 < list.count; i++)
+        list.entries[i] = list.entries[i + 1];
+    list.count--;
+}
+
+// Inserts an entry keeping the list sorted by base
+static void insert_entry(memblock::region_list& list, const uint64_t base, const uint64_t size, const uint32_t type) {
+    if(list.count == MEMBLOCK_MAX_REGIONS) {
+        vga::error("memblock: too many regions!\n");
+        return;
+    }
+
+    uint32_t position = 0;
+    while(position < list.count && list.entries[position].base < base) position++;
+
+    for(uint32_t i = list.count; i > position; i--)
+        list.entries[i] = list.entries[i - 1];
+
+    list.entries[position].base = base;
+    list.entries[position].size = size;
+    list.entries[position].type = type;
+    list.count++;
+}
+
+#pragma endregion
+
+#pragma region Region Lists
+
+void memblock::add(region_list& list, uint64_t base, const uint64_t size, const uint32_t type) {
+    if(size == 0) return;
+    uint64_t end = base + size;
+
+    // Absorbing every range of the same type that overlaps or touches the new one
+    for(uint32_t i = 0; i < list.count;) {
+        region& entry = list.entries[i];
+        uint64_t entry_end = entry.base + entry.size;
+
+        if(entry.type == type && entry.base <= end && base <= entry_end) {
+            if(entry.base < base) base = entry.base;
+            if(entry_end > end) end = entry_end;
+            remove_entry(list, i);
+            continue;
+        }
+        i++;
+    }
+
+    insert_entry(list, base, end - base, type);
+}
+
+void memblock::remove(region_list& list, const uint64_t base, const uint64_t size) {
+    const uint64_t end = base + size;
+
+    for(uint32_t i = 0; i < list.count;) {
+        region& entry = list.entries[i];
+        uint64_t entry_end = entry.base + entry.size;
+
+        // No overlap
+        if(entry_end <= base || entry.base >= end) {
+            i++;
+            continue;
+        }
+
+        // Completely covered
+        if(entry.base >= base && entry_end <= end) {
+            remove_entry(list, i);
+            continue;
+        }
+
+        if(entry.base < base) {
+            // Keeping the head, and the tail if the cut is in the middle
+            entry.size = base - entry.base;
+            if(entry_end > end)
+                insert_entry(list, end, entry_end - end, entry.type);
+        } else {
+            // Keeping only the tail
+            entry.base = end;
+            entry.size = entry_end - end;
+        }
+        i++;
+    }
+}
+
+#pragma endregion
+
+#pragma region Initialization
+
+void memblock::init() {
+    firmware.count = memory.count = reserved.count = 0;
+    retired = false;
+
+    uint16_t entry_count = *phys_to_virt<uint16_t>(E820_MAP_ADDRESS);
+    uint8_t* entries = phys_to_virt<uint8_t>(E820_MAP_ADDRESS + 4);
+
+    // Every entry is 24 bytes: base, length, type and ACPI 3.X attributes
+    for(uint16_t i = 0; i < entry_count; i++) {
+        uint8_t* entry = entries + i * 24;
+
+        uint64_t base = *reinterpret_cast<uint64_t*>(entry);
+        uint64_t length = *reinterpret_cast<uint64_t*>(entry + 8);
+        uint32_t type = *reinterpret_cast<uint32_t*>(entry + 16);
+
+        add(firmware, base, length, type);
+        if(type == E820_USABLE)
+            add(memory, base, length);
+    }
+
+    // Firmware can report overlapping ranges, anything not usable wins
+    for(uint32_t i = 0; i < firmware.count; i++)
+        if(firmware.entries[i].type != E820_USABLE)
+            remove(memory, firmware.entries[i].base, firmware.entries[i].size);
+
+    // Only whole pages can be managed
+    for(uint32_t i = 0; i < memory.count;) {
+        uint64_t base = align_up_64(memory.entries[i].base, BLOCK_SIZE);
+        uint64_t end = align_down_64(memory.entries[i].base + memory.entries[i].size, BLOCK_SIZE);
+
+        if(end <= base) {
+            remove_entry(memory, i);
+            continue;
+        }
+        memory.entries[i].base = base;
+        memory.entries[i].size = end - base;
+        i++;
+    }
+
+    // BIOS data, the bootloader, the memory map and VGA, then the kernel image
+    reserve(0, LOW_MEMORY_END);
+    reserve(virt_to_phys(__kernel_start), uint32_t(__kernel_end) - uint32_t(__kernel_start));
+}
+
+void memblock::reserve(const uint64_t base, const uint64_t size) {
+    add(reserved, align_down_64(base, BLOCK_SIZE), align_up_64(base + size, BLOCK_SIZE) - align_down_64(base, BLOCK_SIZE));
+}
+
+void memblock::retire() {
+    retired = true;
+}
+
+#pragma endregion
+
+#pragma region Allocation
+
+uint32_t memblock::alloc(uint32_t size, uint32_t alignment, const uint64_t limit) {
+    if(retired) {
+        vga::error("memblock: allocation after the PMM took over!\n");
+        return 0;
+    }
+
+    // Allocations are whole pages so the PMM can mark them exactly
+    size = align_up_64(size, BLOCK_SIZE);
+    if(alignment < BLOCK_SIZE) alignment = BLOCK_SIZE;
+
+    // Bottom up, so early structures stay close to the kernel
+    for(uint32_t i = 0; i < memory.count; i++) {
+        const region& range = memory.entries[i];
+        uint64_t start = align_up_64(range.base < LOW_MEMORY_END ? LOW_MEMORY_END : range.base, alignment);
+
+        while(start + size <= range.base + range.size && start + size <= limit) {
+            // Skipping past the first reserved range this candidate overlaps
+            const region* overlap = nullptr;
+            for(uint32_t j = 0; j < reserved.count; j++) {
+                const region& taken = reserved.entries[j];
+                if(taken.base < start + size && start < taken.base + taken.size) {
+                    overlap = &taken;
+                    break;
+                }
+            }
+
+            if(!overlap) {
+                reserve(start, size);
+                return uint32_t(start);
+            }
+            start = align_up_64(overlap->base + overlap->size, alignment);
+        }
+    }
+
+    vga::error("memblock: out of early memory!\n");
+    return 0;
+}
+
+#pragma endregion
+
+#pragma region Printing
+
+static void print_list(const char* name, const memblock::region_list& list) {
+    vga::printf(name);
+    vga::printf('\n');
+
+    for(uint32_t i = 0; i < list.count; i++) {
+        vga::printf("  ");
+        vga::printf(list.entries[i].base);
+        vga::printf(' ');
+        vga::printf(list.entries[i].size);
+        vga::printf(' ');
+        vga::printf(list.entries[i].type);
+        vga::printf('\n');
+    }
+}
+
+void memblock::print_regions() {
+    print_list("E820 regions (base, size, type):", firmware);
+    print_list("Usable memory:", memory);
+    print_list("Reserved:", reserved);
+}
+
+#pragma endregion
@@ -0,0 +1,217 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// numa.cpp describes which memory and CPUs belong to which NUMA node
+// This file contains:
+// Parsing the ACPI SRAT and SLIT, node memory ranges, fallback order by
+// distance, per node statistics
+// =======================================================================
+
+#include <memory/physical/numa.hpp>
+#include <memory/physical/pmm.hpp>
+#include <drivers/vga_print.hpp>
+#include <acpi.hpp>
+#include <cpuid.hpp>
+
+// SRAT entry types
+#define SRAT_PROCESSOR_AFFINITY 0
+#define SRAT_MEMORY_AFFINITY 1
+#define SRAT_X2APIC_AFFINITY 2
+#define SRAT_ENABLED 1
+
+#define BLOCKS_PER_WORD 64
+
+uint32_t numa::node_count = 0;
+numa::node_t numa::nodes[NUMA_MAX_NODES];
+numa::memory_range numa::ranges[NUMA_MAX_RANGES];
+uint32_t numa::range_count = 0;
+uint8_t numa::distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+// Node of every local APIC ID below 256
+static uint8_t apic_node[256];
+
+#pragma region Parsing
+
+// Dense node index of a proximity domain, created on first use
+static uint8_t node_for_domain(const uint32_t domain) {
+    for(uint32_t i = 0; i < numa::node_count; i++)
+        if(numa::nodes[i].proximity_domain == domain) return i;
+
+    if(numa::node_count == NUMA_MAX_NODES) {
+        vga::error("NUMA: too many nodes, folding into node 0\n");
+        return 0;
+    }
+
+    numa::node_t& node = numa::nodes[numa::node_count];
+    node.proximity_domain = domain;
+    node.total_blocks = node.allocs = node.fallback_allocs = 0;
+    return numa::node_count++;
+}
+
+static void add_range(const uint8_t node, const uint64_t base, const uint64_t length, const uint32_t num_blocks) {
+    uint64_t first_block = base / BLOCK_SIZE;
+    uint64_t end_block = (base + length) / BLOCK_SIZE;
+    if(end_block > num_blocks) end_block = num_blocks;
+    if(first_block >= end_block) return;
+
+    // Only whole words, a word shared with the next range is left to neither. Sorted by address
+    uint32_t first_word = (first_block + BLOCKS_PER_WORD - 1) / BLOCKS_PER_WORD, end_word = end_block / BLOCKS_PER_WORD;
+    if(first_word >= end_word) return;
+    if(numa::range_count == NUMA_MAX_RANGES) {
+        vga::error("NUMA: too many memory ranges!\n");
+        return;
+    }
+
+    uint32_t position = numa::range_count;
+    while(position && numa::ranges[position - 1].first_word > first_word) {
+        numa::ranges[position] = numa::ranges[position - 1];
+        position--;
+    }
+    numa::ranges[position].first_word = first_word;
+    numa::ranges[position].end_word = end_word;
+    numa::ranges[position].node = node;
+    numa::range_count++;
+
+    numa::nodes[node].total_blocks += (end_word - first_word) * BLOCKS_PER_WORD;
+}
+
+static void parse_srat(const acpi_sdt_header* srat, const uint32_t num_blocks) {
+    // Affinity structures start after 12 reserved bytes
+    const uint8_t* entry = reinterpret_cast<const uint8_t*>(srat) + sizeof(acpi_sdt_header) + 12;
+    const uint8_t* end = reinterpret_cast<const uint8_t*>(srat) + srat->length;
+
+    for(; entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end; entry += entry[1]) {
+        switch(entry[0]) {
+            case SRAT_PROCESSOR_AFFINITY: {
+                if(!(*reinterpret_cast<const uint32_t*>(entry + 4) & SRAT_ENABLED)) break;
+                uint32_t domain = entry[2] | (entry[9] << 8) | (entry[10] << 16) | (entry[11] << 24);
+                apic_node[entry[3]] = node_for_domain(domain);
+                break;
+            }
+
+            case SRAT_X2APIC_AFFINITY: {
+                if(!(*reinterpret_cast<const uint32_t*>(entry + 12) & SRAT_ENABLED)) break;
+                uint32_t apic_id = *reinterpret_cast<const uint32_t*>(entry + 8);
+                uint8_t node = node_for_domain(*reinterpret_cast<const uint32_t*>(entry + 4));
+                if(apic_id < 256) apic_node[apic_id] = node;
+                break;
+            }
+
+            case SRAT_MEMORY_AFFINITY: {
+                if(!(*reinterpret_cast<const uint32_t*>(entry + 28) & SRAT_ENABLED)) break;
+                uint8_t node = node_for_domain(*reinterpret_cast<const uint32_t*>(entry + 2));
+                uint64_t base = *reinterpret_cast<const uint64_t*>(entry + 8);
+                uint64_t length = *reinterpret_cast<const uint64_t*>(entry + 16);
+                add_range(node, base, length, num_blocks);
+                break;
+            }
+        }
+    }
+}
+
+static void parse_slit(const acpi_sdt_header* slit) {
+    const uint8_t* table = reinterpret_cast<const uint8_t*>(slit) + sizeof(acpi_sdt_header);
+    const uint32_t localities = *reinterpret_cast<const uint32_t*>(table);
+    const uint8_t* matrix = table + 8;
+
+    if(sizeof(acpi_sdt_header) + 8 + localities * localities > slit->length) return;
+
+    // Localities are proximity domains
+    for(uint32_t from = 0; from < numa::node_count; from++) {
+        for(uint32_t to = 0; to < numa::node_count; to++) {
+            uint32_t a = numa::nodes[from].proximity_domain, b = numa::nodes[to].proximity_domain;
+            if(a < localities && b < localities)
+                numa::distance[from][to] = matrix[a * localities + b];
+        }
+    }
+}
+
+// Every node's fallback list: itself, then the others from closest to farthest
+static void build_fallback_order() {
+    for(uint32_t from = 0; from < numa::node_count; from++) {
+        uint8_t* order = numa::nodes[from].fallback;
+        uint32_t count = 0;
+        order[count++] = from;
+
+        // Insertion sort by distance, ties keep the lower node first
+        for(uint32_t node = 0; node < numa::node_count; node++) {
+            if(node == from) continue;
+
+            uint32_t j = count++;
+            for(; j > 1 && numa::distance[from][order[j - 1]] > numa::distance[from][node]; j--)
+                order[j] = order[j - 1];
+            order[j] = node;
+        }
+    }
+}
+
+#pragma endregion
+
+void numa::init(const uint32_t num_blocks) {
+    node_count = range_count = 0;
+    for(uint32_t i = 0; i < 256; i++) apic_node[i] = NUMA_NO_NODE;
+
+    const acpi_sdt_header* srat = acpi::find_table("SRAT");
+    if(srat) parse_srat(srat, num_blocks);
+
+    // No usable SRAT: all memory is one node, CPUs the SRAT named belong to nodes that are gone
+    if(!range_count) {
+        node_count = range_count = 0;
+        for(uint32_t i = 0; i < 256; i++) apic_node[i] = NUMA_NO_NODE;
+        node_for_domain(0);
+        add_range(0, 0, uint64_t(num_blocks) * BLOCK_SIZE, num_blocks);
+    }
+
+    for(uint32_t from = 0; from < node_count; from++)
+        for(uint32_t to = 0; to < node_count; to++)
+            distance[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+
+    const acpi_sdt_header* slit = acpi::find_table("SLIT");
+    if(slit && node_count > 1) parse_slit(slit);
+
+    build_fallback_order();
+
+    vga::printf("NUMA nodes: ");
+    vga::printf(node_count);
+    vga::printf('\n');
+}
+
+uint8_t numa::cpu_node() {
+    uint8_t node = apic_node[cpuid::apic_id()];
+    return node == NUMA_NO_NODE ? 0 : node;
+}
+
+uint8_t numa::node_of(const uint32_t address) {
+    uint32_t word = address / BLOCK_SIZE / BLOCKS_PER_WORD;
+    for(uint32_t i = 0; i < range_count; i++)
+        if(word >= ranges[i].first_word && word < ranges[i].end_word) return ranges[i].node;
+    return NUMA_NO_NODE;
+}
+
+void numa::print_stats() {
+    vga::printf("NUMA: node, domain, frames, free, allocs, fallback allocs\n");
+
+    for(uint32_t node = 0; node < node_count; node++) {
+        uint32_t free = 0;
+        for(uint32_t i = 0; i < range_count; i++)
+            if(ranges[i].node == node)
+                free += pmm::count_free_blocks(ranges[i].first_word * BLOCKS_PER_WORD,
+                                               (ranges[i].end_word - ranges[i].first_word) * BLOCKS_PER_WORD);
+
+        vga::printf(node);
+        vga::printf(' ');
+        vga::printf(nodes[node].proximity_domain);
+        vga::printf(' ');
+        vga::printf(nodes[node].total_blocks);
+        vga::printf(' ');
+        vga::printf(free);
+        vga::printf(' ');
+        vga::printf(nodes[node].allocs);
+        vga::printf(' ');
+        vga::printf(nodes[node].fallback_allocs);
+        vga::printf('\n');
+    }
+}
@@ -10,105 +10,520 @@
 // =======================================================================
 
 #include <memory/physical/pmm.hpp>
-#include <memory/physical/malloc.hpp>
+#include <memory/physical/memblock.hpp>
+#include <memory/physical/numa.hpp>
+#include <memory/virtual/swap.hpp>
+#include <memory/compact.hpp>
+#include <memory/memtrace.hpp>
 #include <drivers/vga_print.hpp>
 #include <utils/util.hpp>
+#include <cpuid.hpp>
 
 
 uint64_t pmm::usable_ram_amount = 0; // Total usable RAM
 uint64_t pmm::num_blocks = 0; // Total amount of blocks for the PMM
+uint64_t pmm::free_blocks = 0; // Blocks currently available for allocation
+pmm::pmm_stats_t pmm::stats;
 size_t bitmap_size;
+size_t summary_size;
 
+// Level 0: one bit per block (1 = allocated)
 uint64_t* frame_bitmap = nullptr;
+// Level 1: one bit per frame_bitmap word (1 = all 64 blocks of that word are allocated)
+uint64_t* frame_summary = nullptr;
+
+// Extra mappings of every frame, see pmm::ref_frame
+static uint16_t* frame_refs_table = nullptr;
+
+// Next-fit hint: summary word where the last allocation was satisfied
+size_t next_fit_hint = 0;
+// Next-fit hints of every NUMA memory range
+static size_t range_hints[NUMA_MAX_RANGES];
+
+// Per-CPU stack of free frames, the common path never touches the bitmap
+struct frame_magazine {
+    uint32_t count;
+    uint32_t frames[MAGAZINE_SIZE];
+};
+
+static frame_magazine magazines[MAX_CPUS];
+// One bit per block sitting in a magazine: free, though frame_bitmap still marks it allocated
+static uint64_t* cached_bitmap = nullptr;
 
 #pragma region Initialization
 
-void iterate_mmap_entries(uint16_t* mmap_entries) {
-    uint16_t entry_count = *mmap_entries;
+/* Returns true if free
+ * Returns false if being used */
+bool is_block_free(const uint32_t address) {
+    return !(frame_bitmap[address / 64] & (uint64_t(1) << (address % 64)));
+}
+
+static inline bool is_block_cached(const uint32_t block) {
+    return cached_bitmap[block / 64] & (uint64_t(1) << (block % 64));
+}
+
+static inline void set_block_cached(const uint32_t block, const bool cached) {
+    if(cached) cached_bitmap[block / 64] |= uint64_t(1) << (block % 64);
+    else cached_bitmap[block / 64] &= ~(uint64_t(1) << (block % 64));
+}
+
+// Noting that the specific block has been allocated
+void set_block_allocated(const uint32_t block_number) {
+    const uint32_t word = block_number / 64;
+
+    // This performes a bitwise OR and modifies the lvalue
+    frame_bitmap[word] |= (uint64_t(1) << (block_number % 64));
+
+    // A word that just became full is skipped by the summary level from now on
+    if(frame_bitmap[word] == ~uint64_t(0))
+        frame_summary[word / 64] |= (uint64_t(1) << (word % 64));
+}
+
+// Noting that the specific block has been freed
+void set_block_free(const uint32_t block_number) {
+    const uint32_t word = block_number / 64;
+
+    // This performes a bitwise AND and modifies the lvalue
+    frame_bitmap[word] &= ~(uint64_t(1) << (block_number % 64)); 
+    // The word has at least one free block now
+    frame_summary[word / 64] &= ~(uint64_t(1) << (word % 64));
+}
+
+/* Finds a free block among the bitmap words [first_word, end_word) using the summary
+ * level and a next-fit hint (a summary word index)
+ * Returns num_blocks if no block is free */
+static uint64_t find_free_in(const uint32_t first_word, const uint32_t end_word, size_t& hint) {
+    if(first_word >= end_word) return pmm::num_blocks;
+
+    const size_t first = first_word / 64, end = (end_word + 63) / 64;
+    if(hint < first || hint >= end) hint = first;
+
+    for(size_t n = 0; n < end - first; n++) {
+        size_t s = hint + n;
+        if(s >= end) s -= end - first;
+
+        // Words outside the range count as full
+        uint64_t full = frame_summary[s];
+        if(s == first) full |= (uint64_t(1) << (first_word % 64)) - 1;
+        if(s == end - 1 && end_word % 64) full |= ~((uint64_t(1) << (end_word % 64)) - 1);
 
-    uint32_t* entry_ptr = (uint32_t*)mmap_entries + 1; // This will give us 0x8004, which is the address where the mmap entries start
+        // Every word covered by this summary word is full
+        if(full == ~uint64_t(0)) continue;
 
-    // Iterating through the mmap entries
-    for(uint16_t i = 0; i < entry_count; i++) {
-        // This gives us the address of the cuurent entry
-        uint8_t* entry = reinterpret_cast<uint8_t*>(entry_ptr) + i * 24;
+        // First word with a free block, then the first free block inside it
+        size_t word = s * 64 + ctz64(~full);
+        hint = s;
+
+        return word * 64 + ctz64(~frame_bitmap[word]);
+    }
+
+    return pmm::num_blocks;
+}
+
+// Finds a free block anywhere in the bitmap, returns num_blocks if no block is free
+uint64_t find_free_block() {
+    return find_free_in(0, bitmap_size, next_fit_hint);
+}
 
-        // The get_mmap function in hardware_init.asm only gets usable memory map entries
-        // So we won't need to check if there usable here
+/* Finds a free block on the preferred node, then on the other nodes by distance
+ * node is set to where the block came from, NUMA_NO_NODE outside every node range */
+static uint64_t find_node_block(const uint8_t preferred, uint8_t& node) {
+    const uint8_t* order = numa::nodes[preferred].fallback;
 
-        uint32_t lower_length = *reinterpret_cast<uint32_t*>(entry + 8);  // Lower 32 bits
-        uint32_t upper_length = *reinterpret_cast<uint32_t*>(entry + 12); // Upper 32 bits
-        uint64_t total_length = (uint64_t) upper_length << 32 | lower_length; // Combine them
+    for(uint32_t n = 0; n < numa::node_count; n++) {
+        node = order[n];
+        for(uint32_t i = 0; i < numa::range_count; i++) {
+            if(numa::ranges[i].node != node) continue;
 
-        pmm::usable_ram_amount += total_length;
+            uint64_t block = find_free_in(numa::ranges[i].first_word, numa::ranges[i].end_word, range_hints[i]);
+            if(block < pmm::num_blocks) return block;
+        }
     }
+
+    // Rounding node boundaries to words can leave blocks outside every range
+    node = NUMA_NO_NODE;
+    return find_free_block();
 }
 
 void pmm::init() {
-    init_heap();
+    // Sorted E820 regions and the early allocator
+    memblock::init();
+
+    // The highest usable address decides how many blocks the bitmap needs
+    uint64_t max_address = 0;
+    for(uint32_t i = 0; i < memblock::memory.count; i++) {
+        const memblock::region& range = memblock::memory.entries[i];
 
-    // Getting total amount of usable memory
-    uint16_t* mmap_ent = reinterpret_cast<uint16_t*>(0x8000); // Assume memory map at 0x8000
-    iterate_mmap_entries(mmap_ent);
+        pmm::usable_ram_amount += range.size;
+        if(range.base + range.size > max_address)
+            max_address = range.base + range.size;
+    }
+    if(max_address > PMM_MAX_ADDRESS) max_address = PMM_MAX_ADDRESS;
 
-    // Calculate number of blocks and allocate the bitmap
-    pmm::num_blocks = pmm::usable_ram_amount / BLOCK_SIZE;
+    // Calculate number of blocks and allocate the bitmap from free RAM
+    pmm::num_blocks = max_address / BLOCK_SIZE;
     bitmap_size = (pmm::num_blocks + 63) / 64; // Number of uint64_t elements needed
-    frame_bitmap = reinterpret_cast<uint64_t*>(pmm::legacy_malloc(bitmap_size * sizeof(uint64_t)));
+    summary_size = (bitmap_size + 63) / 64;
+    uint32_t bitmap_address = memblock::alloc(bitmap_size * sizeof(uint64_t), BLOCK_SIZE, PMM_MAX_ADDRESS);
+    uint32_t summary_address = memblock::alloc(summary_size * sizeof(uint64_t), BLOCK_SIZE, PMM_MAX_ADDRESS);
+    uint32_t refs_address = memblock::alloc(pmm::num_blocks * sizeof(uint16_t), BLOCK_SIZE, PMM_MAX_ADDRESS);
+    uint32_t cached_address = memblock::alloc(bitmap_size * sizeof(uint64_t), BLOCK_SIZE, PMM_MAX_ADDRESS);
 
     // Error handling
-    if (!frame_bitmap) {
+    if (!bitmap_address || !summary_address || !refs_address || !cached_address) {
         vga::error("Failed to allocate frame_bitmap!\n");
         return;
     }
 
-    // Zero-initialize the bitmap
-    memset(frame_bitmap, 0, bitmap_size);
+    // Both are used through the direct map
+    frame_bitmap = phys_to_virt<uint64_t>(bitmap_address);
+    frame_summary = phys_to_virt<uint64_t>(summary_address);
+    frame_refs_table = phys_to_virt<uint16_t>(refs_address);
+    memset(frame_refs_table, 0, pmm::num_blocks * sizeof(uint16_t));
+    cached_bitmap = phys_to_virt<uint64_t>(cached_address);
+    memset(cached_bitmap, 0, bitmap_size * sizeof(uint64_t));
+
+    /* Everything starts out allocated: holes, MMIO and bits past the last block
+     * are never handed out. Then usable RAM is freed, and reserved ranges taken back */
+    memset(frame_bitmap, 0xFF, bitmap_size * sizeof(uint64_t));
+    memset(frame_summary, 0xFF, summary_size * sizeof(uint64_t));
+    pmm::free_blocks = 0;
+
+    for(uint32_t i = 0; i < memblock::memory.count; i++) {
+        const memblock::region& range = memblock::memory.entries[i];
+
+        for(uint64_t block = range.base / BLOCK_SIZE; block < (range.base + range.size) / BLOCK_SIZE && block < pmm::num_blocks; block++) {
+            set_block_free(block);
+            pmm::free_blocks++;
+        }
+    }
+
+    for(uint32_t i = 0; i < memblock::reserved.count; i++) {
+        const memblock::region& range = memblock::reserved.entries[i];
+
+        for(uint64_t block = range.base / BLOCK_SIZE; block < (range.base + range.size) / BLOCK_SIZE && block < pmm::num_blocks; block++) {
+            if(!is_block_free(block)) continue;
+            set_block_allocated(block);
+            pmm::free_blocks--;
+        }
+    }
+
+    // Memory past the direct map gets a bitmap of its own
+    init_highmem();
+
+    // From now on all memory goes through the PMM
+    memblock::retire();
+    next_fit_hint = 0;
+
+    // Splitting the bitmap into NUMA nodes, allocations prefer the CPU's own node
+    numa::init(pmm::num_blocks);
+    for(uint32_t i = 0; i < numa::range_count; i++)
+        range_hints[i] = numa::ranges[i].first_word / 64;
     
     vga::printf("PMM initialized successfully!\n");
 }
 
+#pragma endregion
+#pragma region Block Handling
+
+uint32_t pmm::allocate_frames_batch(const uint32_t count, uint32_t* frames) {
+    uint32_t flags = irq_save();
+    uint32_t taken = 0;
+    const uint8_t preferred = numa::cpu_node();
 
-/* Returns true if free
- * Returns false if being used */
-bool is_block_free(const uint32_t address) {
-    return !(frame_bitmap[address / 64] & (uint64_t(1) << (address % 64)));
+    while(taken < count && pmm::free_blocks) {
+        uint8_t node;
+        uint64_t block = find_node_block(preferred, node);
+        if(block >= pmm::num_blocks) break;
+        const uint32_t before = taken;
+
+        // Taking every free block of this word that is still needed in one go
+        const uint32_t word = block / 64;
+        uint64_t free_bits = ~frame_bitmap[word];
+        uint64_t grabbed = 0;
+
+        while(free_bits && taken < count) {
+            uint32_t bit = ctz64(free_bits);
+            free_bits &= free_bits - 1;
+
+            grabbed |= uint64_t(1) << bit;
+            frames[taken++] = (word * 64 + bit) * BLOCK_SIZE;
+            pmm::free_blocks--;
+        }
+
+        frame_bitmap[word] |= grabbed;
+        if(frame_bitmap[word] == ~uint64_t(0))
+            frame_summary[word / 64] |= (uint64_t(1) << (word % 64));
+
+        if(node != NUMA_NO_NODE) {
+            numa::nodes[node].allocs += taken - before;
+            if(node != preferred) numa::nodes[node].fallback_allocs += taken - before;
+        }
+    }
+
+    irq_restore(flags);
+    return taken;
 }
 
-// Noting that the specific block has been allocated
-void set_block_allocated(const uint32_t block_number) {
-    // This performes a bitwise OR and modifies the lvalue
-    frame_bitmap[block_number / 64] |= (uint64_t(1) << (block_number % 64));
+// Clears the collected bits of one bitmap word
+static void release_word(const uint32_t word, const uint64_t mask) {
+    if(!mask) return;
+    frame_bitmap[word] &= ~mask;
+    frame_summary[word / 64] &= ~(uint64_t(1) << (word % 64));
 }
 
-// Noting that the specific block has been freed
-void set_block_free(const uint32_t block_number) {
-    // This performes a bitwise AND and modifies the lvalue
-    frame_bitmap[block_number / 64] &= ~(uint64_t(1) << (block_number % 64)); 
+void pmm::free_frames_batch(const uint32_t count, const uint32_t* frames) {
+    uint32_t flags = irq_save();
+    uint32_t word = 0;
+    uint64_t mask = 0;
+
+    for(uint32_t i = 0; i < count; i++) {
+        uint32_t block = frames[i] / BLOCK_SIZE;
+        uint64_t bit = uint64_t(1) << (block % 64);
+
+        if(block >= pmm::num_blocks || is_block_free(block) || is_block_cached(block) || (block / 64 == word && (mask & bit))) {
+            vga::error("Invalid frame freed: ");
+            vga::error(frames[i]);
+            vga::printf('\n');
+            continue;
+        }
+
+        // Frames from the same word are cleared together
+        if(block / 64 != word) {
+            release_word(word, mask);
+            word = block / 64;
+            mask = 0;
+        }
+        mask |= bit;
+        pmm::free_blocks++;
+    }
+    release_word(word, mask);
+
+    irq_restore(flags);
 }
 
-#pragma endregion
-#pragma region Block Handling
+// Frames leaving a magazine for the bitmap
+static void release_cached(const uint32_t count, const uint32_t* frames) {
+    for(uint32_t i = 0; i < count; i++) set_block_cached(frames[i] / BLOCK_SIZE, false);
+    pmm::free_frames_batch(count, frames);
+}
+
+void pmm::drain_magazines() {
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        release_cached(magazines[cpu].count, magazines[cpu].frames);
+        magazines[cpu].count = 0;
+    }
+}
 
 uint32_t pmm::allocate_frame() {
-    // Itterating through all of the blocks untill we find an available one
-    for(uint64_t i = 0; i < pmm::num_blocks; i++) {
-        if(is_block_free(i)) {
-            // Allocating and returning address
-            set_block_allocated(i);
+    uint32_t flags = irq_save();
+    frame_magazine& magazine = magazines[cpuid::cpu_index()];
 
-            return (i * BLOCK_SIZE + pmm::data_start_address);
-        }
+    // Refilling the magazine from the bitmap when it runs out
+    if(!magazine.count) {
+        magazine.count = allocate_frames_batch(MAGAZINE_BATCH, magazine.frames);
+        for(uint32_t i = 0; i < magazine.count; i++) set_block_cached(magazine.frames[i] / BLOCK_SIZE, true);
+    }
+
+    if(magazine.count) {
+        uint32_t frame = magazine.frames[--magazine.count];
+        set_block_cached(frame / BLOCK_SIZE, false);
+        irq_restore(flags);
+        stats.frame_allocs++;
+        MEM_TRACE_ALLOC(MEMTRACE_FRAME_ALLOC, frame, BLOCK_SIZE);
+        return frame;
+    }
+
+    // Other CPUs might still be holding frames
+    drain_magazines();
+    uint32_t frame;
+    if(allocate_frames_batch(1, &frame)) {
+        irq_restore(flags);
+        stats.frame_allocs++;
+        MEM_TRACE_ALLOC(MEMTRACE_FRAME_ALLOC, frame, BLOCK_SIZE);
+        return frame;
+    }
+    irq_restore(flags);
+
+    // Frames waiting in the zeroed pool are still free memory
+    uint32_t pooled = take_zero_pool_frame();
+    if(pooled != uint32_t(-1)) {
+        stats.frame_allocs++;
+        MEM_TRACE_ALLOC(MEMTRACE_FRAME_ALLOC, pooled, BLOCK_SIZE);
+        return pooled;
     }
 
+    // Anonymous pages can be written out to swap to make room
+    if(swap::reclaim(SWAP_RECLAIM_BATCH)) return allocate_frame();
+
     // Error: no more memory!
+    stats.failures++;
     vga::error("No more free memory to allocate frame!\n");
     return -1;
 }
 
 void pmm::free_frame(const uint32_t address) {
-    // Converting the addres into a block index and setting it to allocated
-    set_block_free((address - pmm::data_start_address) / BLOCK_SIZE);
+    // Converting the addres into a block index
+    uint32_t block = address / BLOCK_SIZE;
+
+    // A frame already in a magazine is free too, freeing it again would hand it out twice
+    uint32_t flags = irq_save();
+    if(block >= pmm::num_blocks || is_block_free(block) || is_block_cached(block)) {
+        irq_restore(flags);
+        vga::error("Invalid frame freed: ");
+        vga::error(address);
+        vga::printf('\n');
+        return;
+    }
+
+    MEM_TRACE_FREE(MEMTRACE_FRAME_FREE, address);
+    frame_magazine& magazine = magazines[cpuid::cpu_index()];
+    stats.frame_frees++;
+
+    // Full magazine: the oldest half goes back to the bitmap
+    if(magazine.count == MAGAZINE_SIZE) {
+        release_cached(MAGAZINE_BATCH, magazine.frames);
+        for(uint32_t i = MAGAZINE_BATCH; i < MAGAZINE_SIZE; i++)
+            magazine.frames[i - MAGAZINE_BATCH] = magazine.frames[i];
+        magazine.count -= MAGAZINE_BATCH;
+    }
+
+    magazine.frames[magazine.count++] = address;
+    set_block_cached(block, true);
+    irq_restore(flags);
+}
+
+void pmm::ref_frame(const uint64_t address) {
+    if(is_high_frame(address)) {
+        ref_high_frame(address);
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    uint16_t& refs = frame_refs_table[uint32_t(address) / BLOCK_SIZE];
+    if(refs != FRAME_REFS_PINNED) refs++;
+    irq_restore(flags);
+}
+
+bool pmm::unref_frame(const uint64_t address) {
+    if(is_high_frame(address)) return unref_high_frame(address);
+
+    uint32_t flags = irq_save();
+    uint16_t& refs = frame_refs_table[uint32_t(address) / BLOCK_SIZE];
+
+    if(refs) {
+        if(refs != FRAME_REFS_PINNED) refs--;
+        irq_restore(flags);
+        return false;
+    }
+
+    irq_restore(flags);
+    free_frame(uint32_t(address));
+    return true;
+}
+
+uint32_t pmm::frame_refs(const uint64_t address) {
+    if(is_high_frame(address)) return high_frame_refs(address);
+    return frame_refs_table[uint32_t(address) / BLOCK_SIZE];
+}
+
+void pmm::pin_frame(const uint32_t address) {
+    frame_refs_table[address / BLOCK_SIZE] = FRAME_REFS_PINNED;
+}
+
+bool pmm::take_block(const uint32_t block) {
+    uint32_t flags = irq_save();
+    if(block >= pmm::num_blocks || !is_block_free(block)) {
+        irq_restore(flags);
+        return false;
+    }
+
+    set_block_allocated(block);
+    pmm::free_blocks--;
+    irq_restore(flags);
+    return true;
+}
+
+// Returns true if every block in [first, first + count) is free
+static bool is_range_free(const uint64_t first, const uint32_t count) {
+    uint64_t i = first;
+    const uint64_t end = first + count;
+
+    while(i < end) {
+        // Whole words can be compared at once
+        if(i % 64 == 0 && end - i >= 64) {
+            if(frame_bitmap[i / 64]) return false;
+            i += 64;
+            continue;
+        }
+        if(!is_block_free(i)) return false;
+        i++;
+    }
+    return true;
+}
+
+uint32_t pmm::allocate_contiguous(const uint32_t count, const uint32_t alignment, const uint32_t flags) {
+    if(count == 0) return -1;
+
+    uint32_t irq = irq_save();
+    // Cached frames could be sitting in the middle of a run
+    drain_magazines();
+
+    // Block indices are physical frame numbers, so aligned addresses are aligned indices
+    const uint32_t step = alignment > BLOCK_SIZE ? alignment / BLOCK_SIZE : 1;
+
+    for(uint64_t first = 0; first + count <= pmm::num_blocks; first += step) {
+        if(!is_range_free(first, count)) continue;
+
+        for(uint64_t i = first; i < first + count; i++)
+            set_block_allocated(i);
+        pmm::free_blocks -= count;
+
+        irq_restore(irq);
+        return first * BLOCK_SIZE;
+    }
+
+    irq_restore(irq);
+
+    // Moving pages out of the way can empty a whole aligned block, one pass is enough
+    if(!(flags & PMM_NO_COMPACT) && count <= COMPACT_BLOCK_FRAMES && alignment <= COMPACT_BLOCK_SIZE && compact::run())
+        return allocate_contiguous(count, alignment, PMM_NO_COMPACT);
+    return -1;
+}
+
+void pmm::free_contiguous(const uint32_t address, const uint32_t count) {
+    uint32_t flags = irq_save();
+    const uint32_t first = address / BLOCK_SIZE;
+
+    // Nothing is freed unless the whole run is allocated, a bad call must not free someone else's frames
+    bool valid = count && first < pmm::num_blocks && count <= pmm::num_blocks - first;
+    for(uint32_t block = first; valid && block < first + count; block++)
+        if(is_block_free(block) || is_block_cached(block)) valid = false;
+
+    if(!valid) {
+        irq_restore(flags);
+        vga::error("Invalid contiguous run freed: ");
+        vga::error(address);
+        vga::printf('\n');
+        return;
+    }
+
+    uint32_t word = 0;
+    uint64_t mask = 0;
+
+    // Straight back to the bitmap, so the run stays contiguous
+    for(uint32_t block = address / BLOCK_SIZE; block < address / BLOCK_SIZE + count; block++) {
+        if(block / 64 != word) {
+            release_word(word, mask);
+            word = block / 64;
+            mask = 0;
+        }
+        mask |= uint64_t(1) << (block % 64);
+    }
+    release_word(word, mask);
+    pmm::free_blocks += count;
+
+    irq_restore(flags);
 }
 
 void pmm::test_pmm() {
@@ -135,3 +550,145 @@ void pmm::test_pmm() {
 }
 
 #pragma endregion
+#pragma region Statistics
+
+// Set bits of a 32-bit value, without pulling popcount from libgcc
+static inline uint32_t count_bits(uint32_t value) {
+    value = value - ((value >> 1) & 0x55555555);
+    value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+    return (((value + (value >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+uint32_t pmm::count_free_blocks(const uint32_t first, const uint32_t count) {
+    uint32_t end = first + count;
+    if(end > pmm::num_blocks) end = pmm::num_blocks;
+
+    uint32_t free = 0;
+    for(uint32_t i = first; i < end;) {
+        // Whole words are counted at once
+        if(i % 64 == 0 && end - i >= 64) {
+            uint64_t used = frame_bitmap[i / 64];
+            free += 64 - count_bits(uint32_t(used)) - count_bits(uint32_t(used >> 32));
+            i += 64;
+            continue;
+        }
+        if(is_block_free(i)) free++;
+        i++;
+    }
+    return free;
+}
+
+uint32_t pmm::largest_free_run() {
+    uint32_t largest = 0, current = 0;
+
+    for(uint32_t word = 0; word * 64 < pmm::num_blocks; word++) {
+        // Fully used words end a run, fully free ones extend it
+        if(frame_bitmap[word] == ~uint64_t(0)) {
+            current = 0;
+            continue;
+        }
+        if(frame_bitmap[word] == 0 && (word + 1) * 64 <= pmm::num_blocks) {
+            current += 64;
+            if(current > largest) largest = current;
+            continue;
+        }
+
+        for(uint32_t i = word * 64; i < (word + 1) * 64 && i < pmm::num_blocks; i++) {
+            current = is_block_free(i) ? current + 1 : 0;
+            if(current > largest) largest = current;
+        }
+    }
+    return largest;
+}
+
+uint32_t pmm::magazine_frames() {
+    uint32_t frames = 0;
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+        frames += magazines[cpu].count;
+    return frames;
+}
+
+#pragma endregion
+#pragma region Benchmark
+
+// Number of frames the benchmark fills before measuring
+#define BENCH_FRAMES 32768
+#define BENCH_ROUNDS 256
+
+static uint32_t bench_frames[BENCH_FRAMES];
+static volatile uint64_t bench_found; // Search results land here, so the compiler keeps the searches
+
+// The allocator before the summary level: a bit-by-bit scan from block 0
+static uint64_t find_free_block_linear() {
+    for(uint64_t i = 0; i < pmm::num_blocks; i++)
+        if(is_block_free(i)) return i;
+    return pmm::num_blocks;
+}
+
+void pmm::bench_pmm() {
+    // Leaving some frames free for the measured rounds
+    uint64_t available = pmm::free_blocks > BENCH_ROUNDS ? pmm::free_blocks - BENCH_ROUNDS : 0;
+    uint32_t count = available > BENCH_FRAMES ? BENCH_FRAMES : uint32_t(available);
+    if(count == 0) {
+        vga::error("Not enough free frames for the PMM bench!\n");
+        return;
+    }
+
+    // Filling the bottom of memory so a linear scan has to walk over it
+    uint64_t start = rdtsc();
+    for(uint32_t i = 0; i < count; i++)
+        bench_frames[i] = allocate_frame();
+    uint64_t fill_cycles = rdtsc() - start;
+
+    // Old algorithm: searching from block 0 on every call
+    start = rdtsc();
+    for(uint32_t i = 0; i < BENCH_ROUNDS; i++)
+        bench_found = find_free_block_linear();
+    uint64_t linear_cycles = rdtsc() - start;
+
+    // New algorithm, the same search from block 0 through the summary level
+    start = rdtsc();
+    for(uint32_t i = 0; i < BENCH_ROUNDS; i++) {
+        size_t hint = 0;
+        bench_found = find_free_in(0, bitmap_size, hint);
+    }
+    uint64_t summary_cycles = rdtsc() - start;
+
+    // What callers pay: allocate + free pairs, mostly served by the magazine
+    start = rdtsc();
+    for(uint32_t i = 0; i < BENCH_ROUNDS; i++)
+        free_frame(allocate_frame());
+    uint64_t pair_cycles = rdtsc() - start;
+
+    for(uint32_t i = 0; i < count; i++)
+        free_frame(bench_frames[i]);
+
+    // Batched: whole bitmap words per step
+    start = rdtsc();
+    uint32_t batched = allocate_frames_batch(count, bench_frames);
+    uint64_t batch_alloc_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    free_frames_batch(batched, bench_frames);
+    uint64_t batch_free_cycles = rdtsc() - start;
+
+    vga::printf("PMM bench, frames filled: ");
+    vga::printf(count);
+    vga::printf("\n  fill cycles/frame:       ");
+    vga::printf(uint32_t(fill_cycles) / count);
+    vga::printf("\n  linear scan cycles/call: ");
+    vga::printf(uint32_t(linear_cycles) / BENCH_ROUNDS);
+    vga::printf("\n  summary cycles/call:     ");
+    vga::printf(uint32_t(summary_cycles) / BENCH_ROUNDS);
+    vga::printf("\n  alloc+free cycles/pair:  ");
+    vga::printf(uint32_t(pair_cycles) / BENCH_ROUNDS);
+    if(batched) {
+        vga::printf("\n  batch alloc cycles/frame: ");
+        vga::printf(uint32_t(batch_alloc_cycles) / batched);
+        vga::printf("\n  batch free cycles/frame:  ");
+        vga::printf(uint32_t(batch_free_cycles) / batched);
+    }
+    vga::printf('\n');
+}
+
+#pragma endregion
@@ -0,0 +1,352 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// slab.cpp provides object caches for fixed size kernel objects
+// This file contains:
+// Creating caches, slab layout and coloring, allocating and freeing objects,
+// per cache statistics
+// =======================================================================
+
+#include <memory/physical/slab.hpp>
+#include <memory/physical/buddy.hpp>
+#include <memory/physical/malloc.hpp>
+#include <memory/physical/pmm.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+#define SLAB_END 0xFFFF  // End of a slab's free list
+#define SLAB_USED 0xFFFE // Free index of an object that is handed out, a second free finds something else there
+
+/* Header at the start of every slab. It is followed by one uint16_t per object
+ * holding the index of the next free object (SLAB_USED while it is handed out),
+ * so free objects are never written to and keep the state their constructor gave them */
+struct slab {
+    kmem_cache* cache;
+    slab* next;
+    slab* prev;
+    uint32_t objects;   // Address of object 0, color included
+    uint32_t in_use;    // Objects handed out
+    uint16_t free_head; // Index of the first free object
+    uint16_t reserved;
+};
+
+// Every cache, newest first
+static kmem_cache* caches = nullptr;
+
+#pragma region Helper Functions
+
+static inline uint32_t align_up_32(const uint32_t value, const uint32_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static inline uint16_t* free_next(slab* s) {
+    return reinterpret_cast<uint16_t*>(s + 1);
+}
+
+static inline uint32_t slab_bytes(const kmem_cache* cache) {
+    return BLOCK_SIZE << cache->order;
+}
+
+// Distance between two colors, never breaking the object alignment
+static inline uint32_t color_step(const kmem_cache* cache) {
+    return cache->align > CACHE_LINE_SIZE ? cache->align : CACHE_LINE_SIZE;
+}
+
+static void push_slab(slab*& list, slab* s) {
+    s->prev = nullptr;
+    s->next = list;
+    if(list) list->prev = s;
+    list = s;
+}
+
+static void unlink_slab(slab*& list, slab* s) {
+    if(s->prev) s->prev->next = s->next;
+    else list = s->next;
+    if(s->next) s->next->prev = s->prev;
+}
+
+// Builds a new slab with every object constructed, and puts it on the empty list
+static bool grow(kmem_cache* cache) {
+    uint32_t block = pmm::allocate_frames(cache->order);
+    if(block == uint32_t(-1)) return false;
+
+    slab* s = phys_to_virt<slab>(block);
+    s->cache = cache;
+    s->in_use = 0;
+    s->free_head = 0;
+
+    // Consecutive slabs start their objects at different cache lines
+    s->objects = uint32_t(s) + cache->first_object + cache->next_color * color_step(cache);
+    cache->next_color = cache->next_color + 1 < cache->colors ? cache->next_color + 1 : 0;
+
+    uint16_t* next = free_next(s);
+    for(uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        next[i] = i + 1 < cache->objects_per_slab ? i + 1 : SLAB_END;
+        if(cache->ctor) cache->ctor(reinterpret_cast<void*>(s->objects + i * cache->object_size));
+    }
+
+    push_slab(cache->empty, s);
+    cache->stats.slabs++;
+    cache->stats.grows++;
+    cache->stats.total_objects += cache->objects_per_slab;
+    return true;
+}
+
+// Gives an empty slab back to the PMM
+static void release(kmem_cache* cache, slab* s) {
+    unlink_slab(cache->empty, s);
+    cache->stats.slabs--;
+    cache->stats.shrinks++;
+    cache->stats.total_objects -= cache->objects_per_slab;
+    pmm::free_frames(virt_to_phys(s), cache->order);
+}
+
+#pragma endregion
+
+#pragma region Caches
+
+kmem_cache* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    if(align == 0) align = 8;
+    if(align & (align - 1)) {
+        vga::error("kmem_cache_create: alignment is not a power of two!\n");
+        return nullptr;
+    }
+
+    // Free objects are not written to, so any size works
+    uint32_t object_size = align_up_32(size ? size : 1, align);
+
+    // Smallest slab order that fits enough objects
+    uint8_t order = 0;
+    uint32_t count = 0, first = 0;
+    for(;; order++) {
+        uint32_t bytes = BLOCK_SIZE << order;
+        count = (bytes - sizeof(slab)) / (object_size + sizeof(uint16_t));
+        if(count > SLAB_USED) count = SLAB_USED;
+
+        // The free index array pushes the first object forward, which can cost one object
+        while(count && align_up_32(sizeof(slab) + count * sizeof(uint16_t), align) + count * object_size > bytes)
+            count--;
+
+        first = align_up_32(sizeof(slab) + count * sizeof(uint16_t), align);
+        if(count >= SLAB_MIN_OBJECTS || order == SLAB_MAX_ORDER) break;
+    }
+
+    if(count == 0) {
+        vga::error("kmem_cache_create: object too large for a slab!\n");
+        return nullptr;
+    }
+
+    kmem_cache* cache = reinterpret_cast<kmem_cache*>(kmalloc(sizeof(kmem_cache)));
+    if(!cache) return nullptr;
+    memset(cache, 0, sizeof(kmem_cache));
+
+    for(uint32_t i = 0; name[i] && i < SLAB_NAME_LENGTH - 1; i++)
+        cache->name[i] = name[i];
+
+    cache->object_size = object_size;
+    cache->align = align;
+    cache->order = order;
+    cache->objects_per_slab = count;
+    cache->first_object = first;
+    cache->ctor = ctor;
+
+    // Space left at the end of a slab decides how many colors there are
+    uint32_t leftover = (BLOCK_SIZE << order) - first - count * object_size;
+    cache->colors = leftover / color_step(cache) + 1;
+
+    uint32_t flags = irq_save();
+    cache->next = caches;
+    caches = cache;
+    irq_restore(flags);
+
+    return cache;
+}
+
+void kmem_cache_shrink(kmem_cache* cache) {
+    uint32_t flags = irq_save();
+    while(cache->empty)
+        release(cache, cache->empty);
+    irq_restore(flags);
+}
+
+void kmem_cache_destroy(kmem_cache* cache) {
+    if(!cache) return;
+
+    if(cache->partial || cache->full) {
+        vga::error("kmem_cache_destroy: objects still in use in ");
+        vga::error(cache->name);
+        vga::printf('\n');
+        return;
+    }
+
+    kmem_cache_shrink(cache);
+
+    // Removing the cache from the list
+    uint32_t flags = irq_save();
+    kmem_cache** link = &caches;
+    while(*link && *link != cache) link = &(*link)->next;
+    if(*link) *link = cache->next;
+    irq_restore(flags);
+
+    kfree(cache);
+}
+
+#pragma endregion
+
+#pragma region Objects
+
+void* kmem_cache_alloc(kmem_cache* cache) {
+    uint32_t flags = irq_save();
+
+    // Partial slabs first, so empty ones can be given back
+    slab* s = cache->partial;
+    if(!s) {
+        if(!cache->empty && !grow(cache)) {
+            irq_restore(flags);
+            return nullptr;
+        }
+        s = cache->empty;
+        unlink_slab(cache->empty, s);
+        push_slab(cache->partial, s);
+    }
+
+    uint16_t index = s->free_head;
+    s->free_head = free_next(s)[index];
+    free_next(s)[index] = SLAB_USED;
+    s->in_use++;
+
+    if(s->free_head == SLAB_END) {
+        unlink_slab(cache->partial, s);
+        push_slab(cache->full, s);
+    }
+
+    cache->stats.allocs++;
+    cache->stats.active_objects++;
+    irq_restore(flags);
+
+    return reinterpret_cast<void*>(s->objects + index * cache->object_size);
+}
+
+void kmem_cache_free(kmem_cache* cache, void* object) {
+    if(!object) return;
+
+    // Slabs are aligned to their size, so the header is found by rounding down
+    slab* s = reinterpret_cast<slab*>(uint32_t(object) & ~(slab_bytes(cache) - 1));
+    uint32_t offset = uint32_t(object) - s->objects;
+
+    if(s->cache != cache || uint32_t(object) < s->objects || offset % cache->object_size ||
+       offset / cache->object_size >= cache->objects_per_slab) {
+        vga::error("kmem_cache_free: object not from this cache: ");
+        vga::error(uint32_t(object));
+        vga::printf('\n');
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    uint16_t index = offset / cache->object_size;
+    if(free_next(s)[index] != SLAB_USED) {
+        irq_restore(flags);
+        vga::error("kmem_cache_free: object freed twice: ");
+        vga::error(uint32_t(object));
+        vga::printf('\n');
+        return;
+    }
+
+    const bool was_full = s->free_head == SLAB_END;
+    free_next(s)[index] = s->free_head;
+    s->free_head = index;
+    s->in_use--;
+
+    cache->stats.frees++;
+    cache->stats.active_objects--;
+
+    if(was_full) {
+        unlink_slab(cache->full, s);
+        push_slab(cache->partial, s);
+    }
+
+    if(s->in_use == 0) {
+        unlink_slab(cache->partial, s);
+        // One empty slab is kept around, any further one goes back to the PMM
+        push_slab(cache->empty, s);
+        if(s->next) release(cache, s);
+    }
+
+    irq_restore(flags);
+}
+
+#pragma endregion
+
+#pragma region Statistics and Testing
+
+void print_slab_stats() {
+    vga::printf("Slab caches: name, size, active/total, slabs, allocs, frees\n");
+
+    for(kmem_cache* cache = caches; cache; cache = cache->next) {
+        vga::printf(cache->name);
+        vga::printf(' ');
+        vga::printf(cache->object_size);
+        vga::printf(' ');
+        vga::printf(cache->stats.active_objects);
+        vga::printf('/');
+        vga::printf(cache->stats.total_objects);
+        vga::printf(' ');
+        vga::printf(cache->stats.slabs);
+        vga::printf(' ');
+        vga::printf(cache->stats.allocs);
+        vga::printf(' ');
+        vga::printf(cache->stats.frees);
+        vga::printf('\n');
+    }
+}
+
+#define TEST_OBJECT_MAGIC 0x51AB0B1E
+#define TEST_OBJECTS 100
+
+struct test_object {
+    uint32_t magic;
+    uint32_t uses;
+    uint8_t payload[40];
+};
+
+static void test_object_ctor(void* object) {
+    test_object* test = reinterpret_cast<test_object*>(object);
+    test->magic = TEST_OBJECT_MAGIC;
+    test->uses = 0;
+}
+
+void test_slab() {
+    kmem_cache* cache = kmem_cache_create("test_object", sizeof(test_object), 0, &test_object_ctor);
+    if(!cache) return;
+
+    test_object* objects[TEST_OBJECTS];
+    for(uint32_t round = 0; round < 2; round++) {
+        for(uint32_t i = 0; i < TEST_OBJECTS; i++) {
+            objects[i] = reinterpret_cast<test_object*>(kmem_cache_alloc(cache));
+
+            // Objects come back constructed, even after being freed
+            if(!objects[i] || objects[i]->magic != TEST_OBJECT_MAGIC) {
+                vga::error("Slab object lost its constructed state!\n");
+                return;
+            }
+            objects[i]->uses++;
+        }
+
+        for(uint32_t i = 0; i < TEST_OBJECTS; i++)
+            kmem_cache_free(cache, objects[i]);
+    }
+
+    vga::printf("Slab colors: ");
+    vga::printf(cache->colors);
+    vga::printf(", objects per slab: ");
+    vga::printf(cache->objects_per_slab);
+    vga::printf('\n');
+    print_slab_stats();
+
+    kmem_cache_destroy(cache);
+}
+
+#pragma endregion
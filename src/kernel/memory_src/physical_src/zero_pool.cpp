@@ -0,0 +1,79 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// zero_pool.cpp keeps a pool of frames that are already zeroed
+// This file contains:
+// Refilling the pool from the idle loop, allocate_zeroed_frame
+// =======================================================================
+
+#include <memory/physical/pmm.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+pmm::zero_pool_stats_t pmm::zero_pool_stats;
+
+// Stack of zeroed frames
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+
+#pragma region Pool Handling
+
+uint32_t pmm::allocate_zeroed_frame() {
+    uint32_t flags = irq_save();
+    if(zero_pool_count) {
+        uint32_t frame = zero_pool[--zero_pool_count];
+        zero_pool_stats.hits++;
+        irq_restore(flags);
+        return frame;
+    }
+    zero_pool_stats.misses++;
+    irq_restore(flags);
+
+    // Pool is empty: zeroing now, the caller is about to use the frame anyway
+    uint32_t frame = allocate_frame();
+    if(frame != uint32_t(-1))
+        memset(phys_to_virt(frame), 0, BLOCK_SIZE);
+    return frame;
+}
+
+uint32_t pmm::take_zero_pool_frame() {
+    uint32_t flags = irq_save();
+    uint32_t frame = zero_pool_count ? zero_pool[--zero_pool_count] : uint32_t(-1);
+    irq_restore(flags);
+    return frame;
+}
+
+void pmm::refill_zero_pool(const uint32_t max_frames) {
+    for(uint32_t i = 0; i < max_frames; i++) {
+        // Keeping memory for real allocations when it runs low
+        if(zero_pool_count >= ZERO_POOL_SIZE || pmm::free_blocks <= ZERO_POOL_RESERVE) return;
+
+        uint32_t frame = allocate_frame();
+        if(frame == uint32_t(-1)) return;
+
+        // Non-temporal stores where the CPU has them, so idle zeroing does not evict the cache
+        memset_nt(phys_to_virt(frame), 0, BLOCK_SIZE);
+
+        uint32_t flags = irq_save();
+        zero_pool[zero_pool_count++] = frame;
+        zero_pool_stats.refilled++;
+        irq_restore(flags);
+    }
+}
+
+void pmm::print_zero_pool_stats() {
+    vga::printf("Zero pool: frames ");
+    vga::printf(zero_pool_count);
+    vga::printf(", hits ");
+    vga::printf(zero_pool_stats.hits);
+    vga::printf(", misses ");
+    vga::printf(zero_pool_stats.misses);
+    vga::printf(", zeroed in idle ");
+    vga::printf(zero_pool_stats.refilled);
+    vga::printf('\n');
+}
+
+#pragma endregion
@@ -10,10 +10,11 @@
 section .text
     global enable_paging
 
+; Takes the physical address of a PAE page directory pointer table
 enable_paging:
-    ; Enabling PSE
+    ; Enabling PAE
     mov eax, cr4
-    or eax, 0x10
+    or eax, 0x20
     mov cr4, eax
 
     mov eax, [esp + 4]
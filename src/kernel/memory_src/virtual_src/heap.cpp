@@ -0,0 +1,239 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// heap.cpp manages the kernel heap's virtual address range
+// This file contains:
+// Growing the heap with fresh PMM frames, free page runs, shrinking
+// The heap lives between KERNEL_HEAP_START and KERNEL_HEAP_MAX, only the
+// part below heap_end is mapped
+// =======================================================================
+
+#include <memory/virtual/heap.hpp>
+#include <memory/virtual/vmm.hpp>
+#include <memory/physical/pmm.hpp>
+#include <memory/memtrace.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+heap::heap_stats_t heap::stats;
+
+// A run of free, still mapped heap pages. Stored in its own first page
+struct free_run {
+    uint32_t pages;
+    free_run* next;
+};
+
+// Free runs sorted by address
+static free_run* free_runs = nullptr;
+// First address past the mapped part of the heap
+static uint32_t heap_end = KERNEL_HEAP_START;
+
+#pragma region Mapping
+
+// Gives back what vmm::unmap_range took out of the heap, large pages in one piece
+static void release_frames(const uint64_t frame, const uint32_t pages) {
+    if(pages == 1) {
+        pmm::free_frame(uint32_t(frame));
+        return;
+    }
+    pmm::free_contiguous(uint32_t(frame), pages);
+    heap::stats.large_pages--;
+}
+
+/* Maps count fresh frames at heap_end, aligned 2 MiB pieces become one large page if contiguous memory is free.
+ * The rest is mapped up to HEAP_MAP_BATCH frames per vmm::map_frames call */
+static bool grow(const uint32_t count) {
+    if(count > (KERNEL_HEAP_MAX - heap_end) / PAGE_SIZE) return false;
+    uint64_t frames[HEAP_MAP_BATCH];
+
+    for(uint32_t i = 0; i < count;) {
+        const uint32_t address = heap_end + i * PAGE_SIZE;
+
+        if(!(address & (LARGE_PAGE_SIZE - 1)) && count - i >= PAGE_TABLE_ENTRIES) {
+            // Only a shortcut, 4 KiB frames do just as well, so no compaction pass for it
+            uint32_t block = pmm::allocate_contiguous(PAGE_TABLE_ENTRIES, LARGE_PAGE_SIZE, PMM_NO_COMPACT);
+            if(block != uint32_t(-1) && vmm::map_large_page(address, block, PAGE_PRESENT | PAGE_WRITABLE)) {
+                heap::stats.large_pages++;
+                i += PAGE_TABLE_ENTRIES;
+                continue;
+            }
+            if(block != uint32_t(-1)) pmm::free_contiguous(block, PAGE_TABLE_ENTRIES);
+        }
+
+        // Never past the next 2 MiB boundary, which may get a large page again
+        uint32_t run = (LARGE_PAGE_SIZE - (address & (LARGE_PAGE_SIZE - 1))) / PAGE_SIZE;
+        if(run > count - i) run = count - i;
+        if(run > HEAP_MAP_BATCH) run = HEAP_MAP_BATCH;
+
+        uint32_t taken = 0;
+        for(; taken < run; taken++) {
+            uint32_t frame = pmm::allocate_frame();
+            if(frame == uint32_t(-1)) break;
+            frames[taken] = frame;
+        }
+
+        if(taken < run || !vmm::map_frames(address, frames, run, PAGE_PRESENT | PAGE_WRITABLE)) {
+            // Undoing the pages mapped so far
+            for(uint32_t j = 0; j < taken; j++) pmm::free_frame(uint32_t(frames[j]));
+            vmm::unmap_range(heap_end, (address - heap_end) / PAGE_SIZE, &release_frames);
+            return false;
+        }
+        i += run;
+    }
+
+    heap_end += count * PAGE_SIZE;
+    heap::stats.mapped_pages += count;
+    heap::stats.grows++;
+    return true;
+}
+
+// Unmaps everything from address to heap_end and gives the frames back
+static void shrink(const uint32_t address) {
+    uint32_t count = (heap_end - address) / PAGE_SIZE;
+    vmm::unmap_range(address, count, &release_frames);
+
+    heap_end = address;
+    heap::stats.mapped_pages -= count;
+    heap::stats.shrinks++;
+}
+
+#pragma endregion
+
+#pragma region Page Runs
+
+void heap::init() {
+    free_runs = nullptr;
+    heap_end = KERNEL_HEAP_START;
+    memset(&stats, 0, sizeof(stats));
+
+    vga::printf("Heap initialized!\n");
+}
+
+uint32_t heap::allocate_pages(const uint32_t count) {
+    if(count == 0) return 0;
+    uint32_t flags = irq_save();
+
+    // First fit, taking pages from the end of the run so its header stays in place
+    free_run** link = &free_runs;
+    free_run* last = nullptr;
+    for(; *link; link = &(*link)->next) {
+        free_run* run = *link;
+        last = run;
+        if(run->pages < count) continue;
+
+        run->pages -= count;
+        uint32_t address = uint32_t(run) + run->pages * PAGE_SIZE;
+        if(run->pages == 0) *link = run->next;
+
+        stats.used_pages += count;
+        if(stats.used_pages > stats.high_water_pages) stats.high_water_pages = stats.used_pages;
+        irq_restore(flags);
+        MEM_TRACE_ALLOC(MEMTRACE_HEAP_ALLOC, address, count * PAGE_SIZE);
+        return address;
+    }
+
+    // A free run at the very end only needs the rest mapped behind it
+    uint32_t address = heap_end;
+    uint32_t missing = count;
+    if(last && uint32_t(last) + last->pages * PAGE_SIZE == heap_end) {
+        address = uint32_t(last);
+        missing = count - last->pages;
+    }
+
+    if(!grow(missing)) {
+        stats.failures++;
+        irq_restore(flags);
+        vga::error("Kernel heap is out of memory!\n");
+        return 0;
+    }
+
+    // The end run is used up completely, it is the last one in the list
+    if(last && address == uint32_t(last)) {
+        free_run** unlink = &free_runs;
+        while(*unlink != last) unlink = &(*unlink)->next;
+        *unlink = nullptr;
+    }
+
+    stats.used_pages += count;
+    if(stats.used_pages > stats.high_water_pages) stats.high_water_pages = stats.used_pages;
+    irq_restore(flags);
+    MEM_TRACE_ALLOC(MEMTRACE_HEAP_ALLOC, address, count * PAGE_SIZE);
+    return address;
+}
+
+void heap::free_pages(const uint32_t address, const uint32_t count) {
+    if(count == 0) return;
+    if(address < KERNEL_HEAP_START || address + count * PAGE_SIZE > heap_end || (address & (PAGE_SIZE - 1))) {
+        vga::error("Invalid heap pages freed: ");
+        vga::error(address);
+        vga::printf('\n');
+        return;
+    }
+
+    MEM_TRACE_FREE(MEMTRACE_HEAP_FREE, address);
+    uint32_t flags = irq_save();
+    stats.used_pages -= count;
+
+    // Sorted insert
+    free_run* previous = nullptr;
+    free_run* next = free_runs;
+    while(next && uint32_t(next) < address) {
+        previous = next;
+        next = next->next;
+    }
+
+    free_run* run = reinterpret_cast<free_run*>(address);
+    run->pages = count;
+    run->next = next;
+    if(previous) previous->next = run;
+    else free_runs = run;
+
+    // Merging with the following run
+    if(next && address + run->pages * PAGE_SIZE == uint32_t(next)) {
+        run->pages += next->pages;
+        run->next = next->next;
+    }
+
+    // Merging with the preceding run
+    if(previous && uint32_t(previous) + previous->pages * PAGE_SIZE == address) {
+        previous->pages += run->pages;
+        previous->next = run->next;
+        run = previous;
+    }
+
+    /* A long free tail goes back to the PMM, keeping a few pages for the next allocation.
+     * A 2 MiB page the cut falls into is kept whole, unmapping part of it would split it */
+    if(uint32_t(run) + run->pages * PAGE_SIZE == heap_end && run->pages > HEAP_KEEP_PAGES) {
+        uint32_t cut = uint32_t(run) + HEAP_KEEP_PAGES * PAGE_SIZE;
+        if(!vmm::get_entry(cut) && vmm::get_physical(cut) != uint64_t(-1))
+            cut = (cut + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+
+        if(cut < heap_end) {
+            shrink(cut);
+            run->pages = (cut - uint32_t(run)) / PAGE_SIZE;
+        }
+    }
+
+    irq_restore(flags);
+}
+
+#pragma endregion
+
+void heap::print_stats() {
+    vga::printf("Heap: mapped pages ");
+    vga::printf(stats.mapped_pages);
+    vga::printf(", used ");
+    vga::printf(stats.used_pages);
+    vga::printf(", high water ");
+    vga::printf(stats.high_water_pages);
+    vga::printf(", grows ");
+    vga::printf(stats.grows);
+    vga::printf(", shrinks ");
+    vga::printf(stats.shrinks);
+    vga::printf(", 2 MiB pages ");
+    vga::printf(stats.large_pages);
+    vga::printf('\n');
+}
@@ -0,0 +1,298 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// swap.cpp reclaims anonymous pages and keeps them on the swap drive
+// This file contains:
+// Demand zero faults, the CLOCK hand over resident pages, swap slots,
+// writing pages out and reading them back in
+// =======================================================================
+
+#include <memory/virtual/swap.hpp>
+#include <memory/virtual/vmm.hpp>
+#include <memory/virtual/vma.hpp>
+#include <memory/physical/pmm.hpp>
+#include <drivers/ata.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+#define SECTORS_PER_PAGE (PAGE_SIZE / ATA_SECTOR_SIZE)
+
+swap::swap_stats_t swap::stats;
+
+// A resident anonymous page
+struct tracked_page {
+    uint32_t address;
+    uint32_t slot; // Copy on the swap drive that is still valid while the page is clean, or SWAP_NO_SLOT
+};
+
+// Pages the CLOCK hand sweeps over, in no particular order
+static tracked_page tracked[SWAP_MAX_TRACKED];
+static uint32_t tracked_count = 0;
+static uint32_t hand = 0;
+
+// One bit per swap slot (1 = used)
+static uint32_t slot_bitmap[SWAP_MAX_SLOTS / 32];
+static uint32_t slot_hint = 0;
+
+#pragma region Swap Slots
+
+static uint32_t allocate_slot() {
+    for(uint32_t n = 0; n < swap::stats.slots; n++) {
+        uint32_t slot = slot_hint + n < swap::stats.slots ? slot_hint + n : slot_hint + n - swap::stats.slots;
+        if(slot_bitmap[slot / 32] & (1u << (slot % 32))) continue;
+
+        slot_bitmap[slot / 32] |= 1u << (slot % 32);
+        slot_hint = slot + 1;
+        swap::stats.used_slots++;
+        return slot;
+    }
+    return SWAP_NO_SLOT;
+}
+
+static void free_slot(const uint32_t slot) {
+    if(slot == SWAP_NO_SLOT) return;
+    slot_bitmap[slot / 32] &= ~(1u << (slot % 32));
+    swap::stats.used_slots--;
+}
+
+#pragma endregion
+
+#pragma region Tracking
+
+// Removes a page from the ring, the last page takes its place
+static void untrack(const uint32_t index) {
+    tracked[index] = tracked[--tracked_count];
+    if(hand >= tracked_count) hand = 0;
+    swap::stats.resident_pages = tracked_count;
+}
+
+static int32_t find_tracked(const uint32_t address) {
+    for(uint32_t i = 0; i < tracked_count; i++)
+        if(tracked[i].address == address) return i;
+    return -1;
+}
+
+// Maps a frame into the anonymous window and hands it to the CLOCK hand
+static void track(const uint32_t address, const uint32_t frame, const uint32_t slot, const uint32_t flags) {
+    vmm::map_page(address, frame, flags);
+
+    tracked[tracked_count].address = address;
+    tracked[tracked_count].slot = slot;
+    tracked_count++;
+    swap::stats.resident_pages = tracked_count;
+}
+
+/* Evicts one page, returns false if it has to stay
+ * Dirty pages are written out, clean ones are dropped: back to their swap copy,
+ * or back to demand zero if they never had one */
+static bool evict(const uint32_t index) {
+    tracked_page& page = tracked[index];
+    PageTableEntry* entry = vmm::get_entry(page.address);
+    uint32_t frame = entry->address << 12;
+
+    if(entry->flags & PAGE_DIRTY) {
+        // The old copy is stale, a new slot is used so a failed write loses nothing
+        uint32_t slot = allocate_slot();
+        if(slot == SWAP_NO_SLOT) return false;
+
+        if(!ata::write_sectors(SWAP_DRIVE, slot * SECTORS_PER_PAGE, SECTORS_PER_PAGE, phys_to_virt(frame))) {
+            free_slot(slot);
+            return false;
+        }
+        free_slot(page.slot);
+        page.slot = slot;
+        swap::stats.swap_outs++;
+    } else {
+        swap::stats.clean_drops++;
+    }
+
+    if(page.slot == SWAP_NO_SLOT) {
+        entry->address = 0;
+        entry->flags = 0;
+    } else {
+        entry->address = page.slot;
+        entry->flags = PAGE_SWAPPED;
+    }
+    vmm::flush_page(page.address);
+
+    pmm::free_frame(frame);
+    untrack(index);
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Reclaim
+
+uint32_t swap::reclaim(const uint32_t target) {
+    uint32_t flags = irq_save();
+    uint32_t freed = 0;
+
+    // Two sweeps at most: the first one may only clear accessed bits
+    for(uint32_t budget = tracked_count * 2; freed < target && tracked_count && budget; budget--) {
+        tracked_page& page = tracked[hand];
+        PageTableEntry* entry = vmm::get_entry(page.address);
+        stats.scans++;
+
+        // Recently used: a second chance
+        if(entry->flags & PAGE_ACCESSED) {
+            entry->flags &= ~PAGE_ACCESSED;
+            vmm::flush_page(page.address);
+            hand = hand + 1 < tracked_count ? hand + 1 : 0;
+            continue;
+        }
+
+        // The last page moves into this index, so the hand stays
+        if(evict(hand)) freed++;
+        else hand = hand + 1 < tracked_count ? hand + 1 : 0;
+    }
+
+    irq_restore(flags);
+    return freed;
+}
+
+void swap::balance() {
+    if(pmm::free_blocks < SWAP_LOW_WATERMARK)
+        reclaim(SWAP_RECLAIM_BATCH);
+}
+
+bool swap::handle_fault(const uint32_t address, const uint32_t pageFlags) {
+    const uint32_t page = address & ~(PAGE_SIZE - 1);
+    uint32_t flags = irq_save();
+
+    // The ring is full: making room first, an untracked page could never be reclaimed
+    if(tracked_count == SWAP_MAX_TRACKED && !reclaim(1)) {
+        irq_restore(flags);
+        return false;
+    }
+
+    PageTableEntry* entry = vmm::get_entry(page);
+    const bool swapped = entry && (entry->flags & PAGE_SWAPPED);
+
+    // Present pages only fault on protection, which demand paging cannot fix
+    if(entry && (entry->flags & PAGE_PRESENT)) {
+        irq_restore(flags);
+        return false;
+    }
+
+    // Allocating can reclaim, which never touches the faulting page since it is not resident
+    uint32_t frame = swapped ? pmm::allocate_frame() : pmm::allocate_zeroed_frame();
+    if(frame == uint32_t(-1)) {
+        irq_restore(flags);
+        return false;
+    }
+
+    if(swapped) {
+        uint32_t slot = entry->address;
+        if(!ata::read_sectors(SWAP_DRIVE, slot * SECTORS_PER_PAGE, SECTORS_PER_PAGE, phys_to_virt(frame))) {
+            pmm::free_frame(frame);
+            irq_restore(flags);
+            return false;
+        }
+
+        // The slot stays as a clean copy until the page is written to
+        track(page, frame, slot, pageFlags);
+        stats.swap_ins++;
+    } else {
+        track(page, frame, SWAP_NO_SLOT, pageFlags);
+        stats.zero_faults++;
+    }
+
+    irq_restore(flags);
+    return true;
+}
+
+void swap::release_anonymous(const uint32_t address, const uint32_t count) {
+    uint32_t flags = irq_save();
+
+    for(uint32_t page = address & ~(PAGE_SIZE - 1), i = 0; i < count; i++, page += PAGE_SIZE) {
+        PageTableEntry* entry = vmm::get_entry(page);
+        if(!entry) continue;
+
+        if(entry->flags & PAGE_PRESENT) {
+            int32_t index = find_tracked(page);
+            if(index >= 0) {
+                free_slot(tracked[index].slot);
+                untrack(index);
+            }
+            // Untracked present pages are the shared zero page
+            pmm::unref_frame(vmm::unmap_page(page));
+        } else if(entry->flags & PAGE_SWAPPED) {
+            free_slot(entry->address);
+            entry->address = 0;
+            entry->flags = 0;
+        }
+    }
+
+    irq_restore(flags);
+}
+
+#pragma endregion
+
+void swap::init() {
+    ata::init();
+
+    uint32_t slots = ata::sector_count(SWAP_DRIVE) / SECTORS_PER_PAGE;
+    stats.slots = slots > SWAP_MAX_SLOTS ? SWAP_MAX_SLOTS : slots;
+
+    vga::printf("Swap pages: ");
+    vga::printf(stats.slots);
+    vga::printf('\n');
+}
+
+#pragma region Statistics and Testing
+
+void swap::print_stats() {
+    vga::printf("Swap: slots ");
+    vga::printf(stats.used_slots);
+    vga::printf('/');
+    vga::printf(stats.slots);
+    vga::printf(", resident ");
+    vga::printf(stats.resident_pages);
+    vga::printf(", zero faults ");
+    vga::printf(stats.zero_faults);
+    vga::printf(", ins ");
+    vga::printf(stats.swap_ins);
+    vga::printf(", outs ");
+    vga::printf(stats.swap_outs);
+    vga::printf(", clean drops ");
+    vga::printf(stats.clean_drops);
+    vga::printf('\n');
+}
+
+#define TEST_SWAP_PAGES 1024
+
+void swap::test_swap() {
+    uint32_t area = vma::reserve(TEST_SWAP_PAGES, VMA_WRITABLE);
+    if(!area) {
+        vga::error("No room for the swap test area!\n");
+        return;
+    }
+    uint32_t* pages = reinterpret_cast<uint32_t*>(area);
+
+    // First touches fault in zeroed pages
+    for(uint32_t i = 0; i < TEST_SWAP_PAGES; i++)
+        pages[i * (PAGE_SIZE / 4)] = i ^ 0x5A5A5A5A;
+
+    // Pushing everything out, then every read faults it back in
+    uint32_t freed = reclaim(TEST_SWAP_PAGES);
+
+    for(uint32_t i = 0; i < TEST_SWAP_PAGES; i++) {
+        if(pages[i * (PAGE_SIZE / 4)] != (i ^ 0x5A5A5A5A)) {
+            vga::error("Swapped page lost its contents!\n");
+            break;
+        }
+    }
+
+    vga::printf("Swap test, pages reclaimed: ");
+    vga::printf(freed);
+    vga::printf('\n');
+    print_stats();
+
+    vma::release(area);
+}
+
+#pragma endregion
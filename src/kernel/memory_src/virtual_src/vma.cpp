@@ -0,0 +1,280 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// vma.cpp hands out lazily backed areas of the anonymous window
+// This file contains:
+// Reserving and releasing areas, finding the area of a fault,
+// populating pages on first touch, fault-around
+// =======================================================================
+
+#include <memory/virtual/vma.hpp>
+#include <memory/virtual/vmm.hpp>
+#include <memory/virtual/swap.hpp>
+#include <memory/physical/pmm.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+vma::vma_stats_t vma::stats;
+
+// Sorted by start address, areas never overlap
+static vma::area_t areas[VMA_MAX_AREAS];
+static uint32_t area_count = 0;
+
+#pragma region Helper Functions
+
+// Index of the last area starting at or below address, -1 if there is none
+static int32_t lower_bound(const uint32_t address) {
+    int32_t low = 0, high = int32_t(area_count) - 1, found = -1;
+
+    while(low <= high) {
+        int32_t middle = (low + high) / 2;
+        if(areas[middle].start <= address) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+// Area containing an address, nullptr if none does
+static vma::area_t* find_area(const uint32_t address) {
+    int32_t index = lower_bound(address);
+    if(index < 0 || address >= areas[index].end) return nullptr;
+    return &areas[index];
+}
+
+// Not backed by a frame yet, swapped out anonymous pages count too
+static bool is_missing(const uint32_t page) {
+    PageTableEntry* entry = vmm::get_entry(page);
+    return !entry || !(entry->flags & PAGE_PRESENT);
+}
+
+// Backs one page of an area
+static bool populate(const vma::area_t& area, const uint32_t page) {
+    const uint32_t flags = PAGE_PRESENT | ((area.flags & VMA_WRITABLE) ? PAGE_WRITABLE : 0);
+
+    // Anonymous pages belong to the CLOCK hand, which zero fills or reads them back from swap
+    if(!area.fill) return swap::handle_fault(page, flags);
+
+    uint32_t frame = pmm::allocate_frame();
+    if(frame == uint32_t(-1)) return false;
+
+    if(!area.fill(page, phys_to_virt(frame), area.context)) {
+        pmm::free_frame(frame);
+        return false;
+    }
+
+    vmm::map_page(page, frame, flags);
+    vma::stats.fills++;
+    return true;
+}
+
+// Frames of filled areas may be shared with a clone, so they are only dropped by their last mapping
+static void unref_frame(const uint64_t frame, const uint32_t) {
+    pmm::unref_frame(frame);
+}
+
+#pragma endregion
+
+#pragma region Areas
+
+uint32_t vma::reserve(const uint32_t pages, const uint32_t flags, fill_t fill, void* context) {
+    if(!pages || pages > (KERNEL_ANON_END - KERNEL_ANON_START) / PAGE_SIZE) return 0;
+    const uint32_t size = pages * PAGE_SIZE;
+
+    uint32_t irq = irq_save();
+    if(area_count == VMA_MAX_AREAS) {
+        irq_restore(irq);
+        return 0;
+    }
+
+    // First gap that fits. One unmapped page stays between areas, so running off the end faults
+    uint32_t start = KERNEL_ANON_START;
+    uint32_t index = 0;
+    for(; index < area_count; index++) {
+        if(areas[index].start - start >= size + PAGE_SIZE) break;
+        start = areas[index].end + PAGE_SIZE;
+    }
+
+    if(start >= KERNEL_ANON_END || KERNEL_ANON_END - start < size) {
+        irq_restore(irq);
+        return 0;
+    }
+
+    for(uint32_t i = area_count; i > index; i--) areas[i] = areas[i - 1];
+    areas[index] = {start, start + size, flags, fill, context, 0};
+    area_count++;
+
+    stats.areas = area_count;
+    stats.reserved_pages += pages;
+    irq_restore(irq);
+    return start;
+}
+
+void vma::release(const uint32_t address) {
+    uint32_t irq = irq_save();
+
+    int32_t index = lower_bound(address);
+    if(index < 0 || areas[index].start != address) {
+        irq_restore(irq);
+        vga::error("Releasing an address that does not start an area: ");
+        vga::error(address);
+        vga::printf('\n');
+        return;
+    }
+
+    const area_t& area = areas[index];
+    const uint32_t pages = (area.end - area.start) / PAGE_SIZE;
+
+    if(!area.fill) {
+        swap::release_anonymous(area.start, pages);
+    } else {
+        vmm::unmap_range(area.start, pages, &unref_frame);
+    }
+
+    for(uint32_t i = index; i + 1 < area_count; i++) areas[i] = areas[i + 1];
+    area_count--;
+
+    stats.areas = area_count;
+    stats.reserved_pages -= pages;
+    irq_restore(irq);
+}
+
+const vma::area_t* vma::find(const uint32_t address) {
+    return find_area(address);
+}
+
+#pragma endregion
+
+#pragma region Faults
+
+bool vma::handle_fault(const uint32_t address, const uint32_t errorCode) {
+    area_t* area = find_area(address);
+    if(!area) {
+        stats.bad_faults++;
+        return false;
+    }
+
+    const uint32_t page = address & ~(PAGE_SIZE - 1);
+    PageTableEntry* entry = vmm::get_entry(page);
+    const bool anonymous = !area->fill;
+
+    // Error code bit 0: the page was present. Only a write (bit 1) to the zero page can be fixed, it gets a frame of its own
+    if(errorCode & 0x1) {
+        if(!anonymous || !(errorCode & 0x2) || !(entry->flags & PAGE_COW) || uint32_t(entry->address << 12) != vmm::zero_page) {
+            stats.bad_faults++;
+            return false;
+        }
+        entry->address = 0;
+        entry->flags = 0;
+        vmm::flush_page(page);
+        pmm::unref_frame(vmm::zero_page);
+    } else if(anonymous && !(errorCode & 0x2) && !(entry && (entry->flags & PAGE_SWAPPED))) {
+        // Reading untouched anonymous memory costs no frame, the first write copies the zero page
+        const uint32_t flags = (area->flags & VMA_WRITABLE) ? PAGE_PRESENT | PAGE_COW : PAGE_PRESENT;
+        pmm::ref_frame(vmm::zero_page);
+        vmm::map_page(page, vmm::zero_page, flags);
+        area->faults++;
+        stats.faults++;
+        stats.zero_maps++;
+        return true;
+    }
+
+    if(!populate(*area, page)) {
+        stats.bad_faults++;
+        return false;
+    }
+    area->faults++;
+    stats.faults++;
+
+    // Neighbours are likely next, one fault maps the missing pages of the aligned window. Failures there are harmless
+    if(area->flags & VMA_FAULT_AROUND) {
+        uint32_t first = page & ~(VMA_FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+        if(first < area->start) first = area->start;
+        uint32_t last = (page | (VMA_FAULT_AROUND_PAGES * PAGE_SIZE - 1)) + 1;
+        if(last > area->end) last = area->end;
+
+        for(uint32_t neighbour = first; neighbour < last; neighbour += PAGE_SIZE)
+            if(neighbour != page && is_missing(neighbour) && populate(*area, neighbour))
+                stats.around_pages++;
+    }
+
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Statistics and Testing
+
+void vma::print_stats() {
+    vga::printf("VMA: areas ");
+    vga::printf(stats.areas);
+    vga::printf(", reserved pages ");
+    vga::printf(stats.reserved_pages);
+    vga::printf(", faults ");
+    vga::printf(stats.faults);
+    vga::printf(", fills ");
+    vga::printf(stats.fills);
+    vga::printf(", around ");
+    vga::printf(stats.around_pages);
+    vga::printf(", zero page ");
+    vga::printf(stats.zero_maps);
+    vga::printf(", bad ");
+    vga::printf(stats.bad_faults);
+    vga::printf('\n');
+}
+
+// Every word of a test page holds its own address
+static bool fill_addresses(const uint32_t address, void* page, void*) {
+    uint32_t* words = static_cast<uint32_t*>(page);
+    for(uint32_t i = 0; i < PAGE_SIZE / 4; i++) words[i] = address + i * 4;
+    return true;
+}
+
+#define TEST_VMA_PAGES 8192 // 32 MiB, nothing of it is backed until touched
+
+void vma::test_vma() {
+    const uint32_t freeBefore = pmm::free_blocks;
+
+    // A huge anonymous area only costs the entry in the table
+    uint32_t anonymous = reserve(TEST_VMA_PAGES, VMA_WRITABLE);
+    if(!anonymous) {
+        vga::error("VMA reservation failed!\n");
+        return;
+    }
+    if(pmm::free_blocks != freeBefore) vga::error("Reserving an area allocated memory!\n");
+
+    // Three pages far apart: reading maps the zero page, writing gives each one a frame
+    const uint32_t faultsBefore = stats.faults;
+    for(uint32_t i = 0; i < 3; i++) {
+        volatile uint32_t* word = reinterpret_cast<volatile uint32_t*>(anonymous + i * (TEST_VMA_PAGES / 3) * PAGE_SIZE);
+        if(*word != 0) vga::error("Anonymous page was not zeroed!\n");
+        *word = i;
+        if(vmm::get_physical(uint32_t(word)) == vmm::zero_page) vga::error("Write went to the zero page!\n");
+    }
+    if(stats.faults - faultsBefore != 6) vga::error("Anonymous area did not fault twice per page!\n");
+
+    // A filled area with fault-around: one touch maps the whole window
+    uint32_t filled = reserve(VMA_FAULT_AROUND_PAGES * 2, VMA_FAULT_AROUND, &fill_addresses);
+    uint32_t* words = reinterpret_cast<uint32_t*>(filled);
+    const uint32_t touched = words[PAGE_SIZE / 4 + 5];
+
+    if(touched != filled + PAGE_SIZE + 20) vga::error("Fill callback did not run!\n");
+    for(uint32_t i = 0; i < VMA_FAULT_AROUND_PAGES; i++)
+        if(vmm::get_physical(filled + i * PAGE_SIZE) == uint64_t(-1))
+            vga::error("Fault-around left a page out!\n");
+    if(vmm::get_physical(filled + VMA_FAULT_AROUND_PAGES * PAGE_SIZE) != uint64_t(-1))
+        vga::error("Fault-around went past its window!\n");
+
+    print_stats();
+
+    release(filled);
+    release(anonymous);
+}
+
+#pragma endregion
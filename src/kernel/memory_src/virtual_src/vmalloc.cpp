@@ -0,0 +1,510 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// vmalloc.cpp hands out ranges of the vmalloc window
+// This file contains:
+// The AVL trees of free and used regions, best fit allocation with
+// alignment and guard pages, lazy freeing and purging, vmalloc, vmap and vfree
+// =======================================================================
+
+#include <memory/virtual/vmalloc.hpp>
+#include <memory/virtual/vmm.hpp>
+#include <memory/physical/pmm.hpp>
+#include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
+
+vrange::vrange_stats_t vrange::stats;
+
+enum region_state : uint8_t { REGION_FREE, REGION_USED, REGION_LAZY };
+
+// The two trees a region can be in
+enum { BY_ADDRESS = 0, BY_SIZE = 1 };
+
+/* A range of the vmalloc window. Free regions are in the free address tree and the size tree,
+ * used and lazy ones only in the busy tree, which is also keyed by address */
+struct vm_region {
+    uint32_t start;
+    uint32_t pages;              // Guard pages included for used regions
+    region_state state;
+    uint8_t flags;               // VRANGE_ flags
+    int8_t height[2];            // AVL height in each tree
+    vm_region* child[2][2];      // [tree][left, right]
+    vm_region* next;             // Next lazy region, or next unused node
+};
+
+static vm_region nodes[VRANGE_MAX_REGIONS];
+static vm_region* unused_nodes = nullptr;
+static uint32_t unused_count = 0;
+
+static vm_region* free_by_address = nullptr;
+static vm_region* free_by_size = nullptr;
+static vm_region* busy = nullptr;
+static vm_region* lazy = nullptr; // Freed regions waiting for a purge
+
+#pragma region AVL Trees
+
+template<int Tree>
+static inline int8_t height(const vm_region* node) {
+    return node ? node->height[Tree] : 0;
+}
+
+template<int Tree>
+static inline void update_height(vm_region* node) {
+    const int8_t left = height<Tree>(node->child[Tree][0]), right = height<Tree>(node->child[Tree][1]);
+    node->height[Tree] = (left > right ? left : right) + 1;
+}
+
+// The child on side becomes the root of the subtree
+template<int Tree>
+static vm_region* rotate(vm_region* node, const int side) {
+    vm_region* top = node->child[Tree][side];
+    node->child[Tree][side] = top->child[Tree][!side];
+    top->child[Tree][!side] = node;
+    update_height<Tree>(node);
+    update_height<Tree>(top);
+    return top;
+}
+
+template<int Tree>
+static vm_region* rebalance(vm_region* node) {
+    update_height<Tree>(node);
+    const int32_t balance = height<Tree>(node->child[Tree][1]) - height<Tree>(node->child[Tree][0]);
+    if (balance >= -1 && balance <= 1) return node;
+
+    // A child leaning the other way is straightened first
+    const int side = balance > 0;
+    vm_region* heavy = node->child[Tree][side];
+    if (height<Tree>(heavy->child[Tree][!side]) > height<Tree>(heavy->child[Tree][side]))
+        node->child[Tree][side] = rotate<Tree>(heavy, !side);
+    return rotate<Tree>(node, side);
+}
+
+// Ordered by start, the size tree by pages first. Regions never share a start, so keys are unique
+template<int Tree>
+static inline bool less(const vm_region* a, const vm_region* b) {
+    if (Tree == BY_SIZE && a->pages != b->pages) return a->pages < b->pages;
+    return a->start < b->start;
+}
+
+template<int Tree>
+static vm_region* insert(vm_region* root, vm_region* node) {
+    if (!root) {
+        node->child[Tree][0] = node->child[Tree][1] = nullptr;
+        node->height[Tree] = 1;
+        return node;
+    }
+
+    const int side = less<Tree>(root, node);
+    root->child[Tree][side] = insert<Tree>(root->child[Tree][side], node);
+    return rebalance<Tree>(root);
+}
+
+// Takes the leftmost node out of a subtree
+template<int Tree>
+static vm_region* remove_min(vm_region* root, vm_region*& min) {
+    if (!root->child[Tree][0]) {
+        min = root;
+        return root->child[Tree][1];
+    }
+    root->child[Tree][0] = remove_min<Tree>(root->child[Tree][0], min);
+    return rebalance<Tree>(root);
+}
+
+template<int Tree>
+static vm_region* remove(vm_region* root, vm_region* node) {
+    if (!root) return nullptr;
+
+    if (root != node) {
+        const int side = less<Tree>(root, node);
+        root->child[Tree][side] = remove<Tree>(root->child[Tree][side], node);
+        return rebalance<Tree>(root);
+    }
+
+    if (!root->child[Tree][0]) return root->child[Tree][1];
+    if (!root->child[Tree][1]) return root->child[Tree][0];
+
+    // The successor takes the removed node's place
+    vm_region* successor;
+    vm_region* right = remove_min<Tree>(root->child[Tree][1], successor);
+    successor->child[Tree][0] = root->child[Tree][0];
+    successor->child[Tree][1] = right;
+    return rebalance<Tree>(successor);
+}
+
+#pragma endregion
+
+#pragma region Regions
+
+static vm_region* get_node() {
+    vm_region* node = unused_nodes;
+    if (node) {
+        unused_nodes = node->next;
+        unused_count--;
+    }
+    return node;
+}
+
+static void put_node(vm_region* node) {
+    node->next = unused_nodes;
+    unused_nodes = node;
+    unused_count++;
+}
+
+static inline uint32_t region_end(const vm_region* region) {
+    return region->start + region->pages * PAGE_SIZE;
+}
+
+// Used or lazy region starting at address
+static vm_region* find_busy(const uint32_t address) {
+    vm_region* node = busy;
+    while (node && node->start != address)
+        node = node->child[BY_ADDRESS][node->start < address];
+    return node;
+}
+
+// Free region ending at start, or with above the one starting at end. nullptr if there is none
+static vm_region* free_neighbour(const uint32_t start, const uint32_t end, const bool above) {
+    vm_region* node = free_by_address;
+    while (node) {
+        if (above ? node->start == end : region_end(node) == start) return node;
+        node = node->child[BY_ADDRESS][above ? node->start < end : node->start < start];
+    }
+    return nullptr;
+}
+
+static void take_free(vm_region* region) {
+    free_by_address = remove<BY_ADDRESS>(free_by_address, region);
+    free_by_size = remove<BY_SIZE>(free_by_size, region);
+    vrange::stats.free_regions--;
+    vrange::stats.free_pages -= region->pages;
+}
+
+// Makes a region free, merged with the free regions around it
+static void add_free(vm_region* region) {
+    vm_region* below = free_neighbour(region->start, region_end(region), false);
+    if (below) {
+        take_free(below);
+        region->start = below->start;
+        region->pages += below->pages;
+        put_node(below);
+    }
+
+    vm_region* above = free_neighbour(region->start, region_end(region), true);
+    if (above) {
+        take_free(above);
+        region->pages += above->pages;
+        put_node(above);
+    }
+
+    region->state = REGION_FREE;
+    free_by_address = insert<BY_ADDRESS>(free_by_address, region);
+    free_by_size = insert<BY_SIZE>(free_by_size, region);
+    vrange::stats.free_regions++;
+    vrange::stats.free_pages += region->pages;
+}
+
+static inline uint32_t align_start(const uint32_t start, const uint32_t alignment) {
+    return (start + alignment - 1) & ~(alignment - 1);
+}
+
+// Smallest free region above the key (pages, start) in the size tree
+static vm_region* next_by_size(const uint32_t pages, const uint32_t start) {
+    vm_region* found = nullptr;
+    for (vm_region* node = free_by_size; node;) {
+        if (node->pages > pages || (node->pages == pages && node->start > start)) {
+            found = node;
+            node = node->child[BY_SIZE][0];
+        } else {
+            node = node->child[BY_SIZE][1];
+        }
+    }
+    return found;
+}
+
+/* Smallest free region that holds pages once its start is aligned. Larger alignments may skip a few
+ * regions that are big enough but badly placed */
+static vm_region* best_fit(const uint32_t pages, const uint32_t alignment) {
+    for (vm_region* region = next_by_size(pages - 1, 0xFFFFFFFF); region; region = next_by_size(region->pages, region->start)) {
+        const uint32_t skipped = align_start(region->start, alignment) - region->start;
+        if (skipped <= (region->pages - pages) * PAGE_SIZE) return region;
+    }
+    return nullptr;
+}
+
+#pragma endregion
+
+#pragma region Allocation
+
+void vrange::init() {
+    free_by_address = free_by_size = busy = lazy = nullptr;
+    unused_nodes = nullptr;
+    unused_count = 0;
+    memset(&stats, 0, sizeof(stats));
+    for (vm_region& node : nodes) put_node(&node);
+
+    // The first page stays out, an anonymous area ending at the window's start cannot run into a range
+    vm_region* window = get_node();
+    window->start = KERNEL_VMALLOC_START + PAGE_SIZE;
+    window->pages = (KERNEL_VMALLOC_END - KERNEL_VMALLOC_START) / PAGE_SIZE - 1;
+    add_free(window);
+
+    vga::printf("vmalloc initialized!\n");
+}
+
+uint32_t vrange::allocate(const uint32_t pages, const uint32_t alignment, const uint32_t flags) {
+    if (!pages || pages > (KERNEL_VMALLOC_END - KERNEL_VMALLOC_START) / PAGE_SIZE ||
+        alignment < PAGE_SIZE || (alignment & (alignment - 1)))
+        return 0;
+    const uint32_t needed = pages + VRANGE_GUARD_PAGES;
+
+    uint32_t irq = irq_save();
+    vm_region* region = best_fit(needed, alignment);
+
+    // Freed ranges may be all that is missing
+    if (!region && lazy) {
+        purge();
+        region = best_fit(needed, alignment);
+    }
+
+    // Space before and after the range may need a node each
+    if (!region || unused_count < 2) {
+        stats.failures++;
+        irq_restore(irq);
+        return 0;
+    }
+
+    take_free(region);
+    const uint32_t start = align_start(region->start, alignment);
+    const uint32_t end = start + needed * PAGE_SIZE;
+
+    if (start > region->start) {
+        vm_region* head = get_node();
+        head->start = region->start;
+        head->pages = (start - region->start) / PAGE_SIZE;
+        add_free(head);
+    }
+    if (end < region_end(region)) {
+        vm_region* tail = get_node();
+        tail->start = end;
+        tail->pages = (region_end(region) - end) / PAGE_SIZE;
+        add_free(tail);
+    }
+
+    region->start = start;
+    region->pages = needed;
+    region->state = REGION_USED;
+    region->flags = flags;
+    busy = insert<BY_ADDRESS>(busy, region);
+
+    stats.used_regions++;
+    stats.used_pages += needed;
+    stats.allocs++;
+    irq_restore(irq);
+    return start;
+}
+
+void vrange::free(const uint32_t address) {
+    uint32_t irq = irq_save();
+
+    vm_region* region = find_busy(address);
+    if (!region || region->state != REGION_USED) {
+        irq_restore(irq);
+        vga::error("Freeing an address vrange did not hand out: ");
+        vga::error(address);
+        vga::printf('\n');
+        return;
+    }
+
+    // Nothing is unmapped yet, the range just cannot be handed out again
+    region->state = REGION_LAZY;
+    region->next = lazy;
+    lazy = region;
+
+    stats.used_regions--;
+    stats.used_pages -= region->pages;
+    stats.lazy_pages += region->pages;
+    stats.frees++;
+    const bool purging = stats.lazy_pages > VRANGE_LAZY_PAGES;
+    irq_restore(irq);
+
+    if (purging) purge();
+}
+
+void vrange::purge() {
+    uint32_t irq = irq_save();
+    if (!lazy) {
+        irq_restore(irq);
+        return;
+    }
+
+    /* Only the present bits go first, the frames stay in the entries until no translation can reach them.
+     * vrange users map with 4 KiB pages, so every page has an entry */
+    uint32_t cleared = 0;
+    for (vm_region* region = lazy; region; region = region->next) {
+        for (uint32_t page = region->start; page < region_end(region); page += PAGE_SIZE) {
+            PageTableEntry* entry = vmm::get_entry(page);
+            if (!entry || !(entry->flags & PAGE_PRESENT)) continue;
+            entry->flags &= ~PAGE_PRESENT;
+            cleared++;
+        }
+    }
+
+    // One flush for every range, kernel pages are global
+    const bool full = cleared > VMM_FLUSH_THRESHOLD;
+    if (full) {
+        vmm::flush_tlb_all();
+        stats.full_flushes++;
+    }
+
+    while (lazy) {
+        vm_region* region = lazy;
+        lazy = region->next;
+
+        for (uint32_t page = region->start; page < region_end(region); page += PAGE_SIZE) {
+            PageTableEntry* entry = vmm::get_entry(page);
+            if (!entry || (!entry->flags && !entry->address)) continue;
+            if (!full) vmm::flush_page(page);
+
+            const uint64_t frame = entry->address << 12;
+            entry->address = 0;
+            entry->flags = 0;
+            if (region->flags & VRANGE_OWNS_FRAMES) pmm::unref_frame(frame);
+        }
+
+        busy = remove<BY_ADDRESS>(busy, region);
+        stats.lazy_pages -= region->pages;
+        add_free(region);
+    }
+
+    stats.purges++;
+    irq_restore(irq);
+}
+
+bool vrange::owns_frames(const uint32_t address) {
+    uint32_t irq = irq_save();
+
+    // Busy regions never overlap, so the one holding address is found like a start address
+    vm_region* node = busy;
+    while (node && (address < node->start || address >= region_end(node)))
+        node = node->child[BY_ADDRESS][node->start < address];
+    const bool owns = node && node->state == REGION_USED && (node->flags & VRANGE_OWNS_FRAMES);
+
+    irq_restore(irq);
+    return owns;
+}
+
+#pragma endregion
+
+void* vmalloc(const size_t size) {
+    const uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    const uint32_t start = vrange::allocate(pages, PAGE_SIZE, VRANGE_OWNS_FRAMES);
+    if (!start) return nullptr;
+
+    // Only the kernel touches these pages, and only through this mapping, so high memory is fine
+    uint64_t frames[VMALLOC_MAP_BATCH];
+    for (uint32_t done = 0; done < pages;) {
+        const uint32_t run = pages - done < VMALLOC_MAP_BATCH ? pages - done : VMALLOC_MAP_BATCH;
+
+        uint32_t taken = 0;
+        for (; taken < run; taken++) {
+            frames[taken] = pmm::allocate_user_frame();
+            if (frames[taken] == uint64_t(-1)) break;
+        }
+
+        if (taken < run || !vmm::map_frames(start + done * PAGE_SIZE, frames, run, PAGE_PRESENT | PAGE_WRITABLE)) {
+            // The purge frees what was mapped so far
+            for (uint32_t i = 0; i < taken; i++) pmm::unref_frame(frames[i]);
+            vrange::free(start);
+            return nullptr;
+        }
+        done += run;
+    }
+
+    return reinterpret_cast<void*>(start);
+}
+
+void vfree(void* pointer) {
+    if (pointer) vrange::free(uint32_t(pointer));
+}
+
+void* vmap(const uint64_t physicalAddress, const uint32_t pages, const uint32_t flags) {
+    const uint32_t start = vrange::allocate(pages, PAGE_SIZE, 0);
+    if (!start) return nullptr;
+
+    if (!vmm::map_range(start, physicalAddress & ~uint64_t(PAGE_SIZE - 1), pages, PAGE_PRESENT | PAGE_WRITABLE | flags)) {
+        vrange::free(start);
+        return nullptr;
+    }
+
+    // Lines cached through another mapping of the memory must not be written back over the new type later
+    if (flags & PAGE_CACHE_MASK) asm volatile ("wbinvd" : : : "memory");
+    return reinterpret_cast<void*>(start);
+}
+
+#pragma region Statistics and Testing
+
+void vrange::print_stats() {
+    vga::printf("vmalloc: used regions ");
+    vga::printf(stats.used_regions);
+    vga::printf(" (");
+    vga::printf(stats.used_pages);
+    vga::printf(" pages), free regions ");
+    vga::printf(stats.free_regions);
+    vga::printf(" (");
+    vga::printf(stats.free_pages);
+    vga::printf(" pages), lazy pages ");
+    vga::printf(stats.lazy_pages);
+    vga::printf(", purges ");
+    vga::printf(stats.purges);
+    vga::printf(" (full flushes ");
+    vga::printf(stats.full_flushes);
+    vga::printf("), failures ");
+    vga::printf(stats.failures);
+    vga::printf('\n');
+}
+
+#define TEST_VMALLOC_BUFFERS 3
+
+void vrange::test_vmalloc() {
+    static const uint32_t sizes[TEST_VMALLOC_BUFFERS] = {40 * 1024, 1024 * 1024, 8 * 1024 * 1024};
+    uint32_t* buffers[TEST_VMALLOC_BUFFERS];
+
+    for (uint32_t i = 0; i < TEST_VMALLOC_BUFFERS; i++) {
+        buffers[i] = static_cast<uint32_t*>(vmalloc(sizes[i]));
+        if (!buffers[i]) {
+            vga::error("vmalloc failed!\n");
+            return;
+        }
+
+        for (uint32_t word = 0; word < sizes[i] / 4; word++) buffers[i][word] = word ^ i;
+        if (vmm::get_physical(uint32_t(buffers[i]) + sizes[i]) != uint64_t(-1))
+            vga::error("vmalloc buffer has no guard page!\n");
+    }
+
+    // Writing one buffer must not have touched another
+    for (uint32_t i = 0; i < TEST_VMALLOC_BUFFERS; i++)
+        for (uint32_t word = 0; word < sizes[i] / 4; word++)
+            if (buffers[i][word] != (word ^ i)) {
+                vga::error("vmalloc buffers overlap!\n");
+                break;
+            }
+
+    // The middle buffer leaves a hole, an aligned range goes wherever it fits best
+    vfree(buffers[1]);
+    const uint32_t aligned = allocate(4, 0x10000, 0);
+    if (!aligned || (aligned & 0xFFFF)) vga::error("Aligned range is not aligned!\n");
+
+    print_stats();
+    free(aligned);
+    vfree(buffers[0]);
+    vfree(buffers[2]);
+    purge();
+
+    if (stats.free_regions != 1 || stats.used_regions) vga::error("Free regions were not merged back!\n");
+    print_stats();
+}
+
+#pragma endregion
@@ -6,51 +6,1079 @@
 //
 // vmm.cpp sets up the VMM
 // This file contains: 
-// Managing virtual memory and addresses, paging...
+// Managing virtual memory and addresses, paging, mapping whole ranges...
 // =======================================================================
 
 #include <memory/virtual/vmm.hpp>
 #include <memory/physical/pmm.hpp>
 #include <utils/util.hpp>
 #include <drivers/vga_print.hpp>
+#include <memory/virtual/vma.hpp>
+#include <memory/virtual/vmalloc.hpp>
+#include <memory/memtrace.hpp>
+#include <idt/idt.hpp>
+#include <utils/ports.hpp>
+#include <cpuid.hpp>
 
 // Global variable for the kernel variable
-PageDirectory* kernelPageDirectory;
+PageDirectory* kernelPageDirectory = nullptr;
+uint32_t vmm::page_table_pages = 0;
+uint32_t vmm::global_flag = 0;
+bool vmm::pat_enabled = false;
+uint32_t vmm::zero_page = 0;
+vmm::cow_stats_t vmm::cow_stats;
+vmm::range_stats_t vmm::range_stats;
+
+// Directories of every address space, through the direct map. The kernel's is the first
+static PageDirectory* address_spaces[VMM_MAX_ADDRESS_SPACES];
+// CR3 of each address space, part of the kernel image so they are below 4 GiB
+static PageDirectoryPointerTable pointer_tables[VMM_MAX_ADDRESS_SPACES];
+
+// Slots of the temporary window, one bit each (1 = in use)
+static uint32_t temporary_slots[(KERNEL_KMAP_END - KERNEL_KMAP_START) / PAGE_SIZE / 32];
+
+// The four active directories, through the recursive slots
+static inline PageDirectory* active_directory() {
+    return reinterpret_cast<PageDirectory*>(PAGE_DIRECTORY_ADDRESS);
+}
+
+// Page table covering a virtual address in the active directory, through the recursive slot
+static inline PageTable* active_table(const uint32_t virtualAddress) {
+    return reinterpret_cast<PageTable*>(PAGE_TABLES_ADDRESS + (virtualAddress >> 21) * PAGE_SIZE);
+}
+
+// The active directories through the direct map, the same pointer the address space was created with
+static inline PageDirectory* active_space() {
+    return phys_to_virt<PageDirectory>(active_directory()->entries[RECURSIVE_SLOT].address << 12);
+}
+
+// Kernel page tables are shared, so a changed kernel directory entry is copied into every other address space
+static void sync_kernel_entry(const uint32_t virtualAddress) {
+    const uint32_t index = virtualAddress >> 21;
+    if (index < (KERNEL_VIRTUAL_BASE >> 21) || index >= RECURSIVE_SLOT) return;
+
+    const PageDirectoryEntry entry = active_directory()->entries[index];
+    for (PageDirectory* space : address_spaces)
+        if (space) space->entries[index] = entry;
+}
+
+/* Flags as they go into an entry. Kernel mappings are the same in every address space, so they can stay in the TLB
+ * across CR3 reloads. The recursive slot is left out, its windows show the page tables of whichever directory is active.
+ * Without PAT the PAGE_PAT bit is reserved, the power-on entries still give WT for the PWT bit alone */
+static inline uint32_t entry_flags(const uint32_t virtualAddress, uint32_t flags) {
+    if (!vmm::pat_enabled) flags &= ~PAGE_PAT;
+    if (virtualAddress >= KERNEL_VIRTUAL_BASE && virtualAddress < PAGE_TABLES_ADDRESS && !(flags & PAGE_USER))
+        return flags | vmm::global_flag;
+    return flags;
+}
 
 // Map a virtual address to a physical address
-void map_page(uint32_t virtualAddress, uint32_t physicalAddress, PageDirectory* directory, uint32_t flags) {
-    uint32_t pageDirIndex = virtualAddress >> 22;         // Top 10 bits
-    uint32_t pageTableIndex = (virtualAddress >> 12) & 0x3FF; // Middle 10 bits
+void map_page(uint32_t virtualAddress, uint64_t physicalAddress, PageDirectory* directory, uint32_t flags) {
+    uint32_t pageDirIndex = virtualAddress >> 21;         // Top 11 bits, pointer table and directory index together
+    uint32_t pageTableIndex = (virtualAddress >> 12) & 0x1FF; // Middle 9 bits
 
     // Get or create the page table
     PageTable* pageTable;
     if (!(directory->entries[pageDirIndex].flags & PAGE_PRESENT)) {
         // Allocate a new page table
-        uint32_t newTable = (uint32_t)pmm::allocate_frame(); // From PMM
-        memset((void*)newTable, 0, PAGE_SIZE);
+        uint32_t newTable = pmm::allocate_zeroed_frame(); // From PMM, already zeroed
+        vmm::page_table_pages++;
         directory->entries[pageDirIndex].address = newTable >> 12;
         directory->entries[pageDirIndex].flags = PAGE_PRESENT | PAGE_WRITABLE;
     }
 
-    pageTable = (PageTable*)(directory->entries[pageDirIndex].address << 12);
+    pageTable = phys_to_virt<PageTable>(directory->entries[pageDirIndex].address << 12);
 
     // Map the physical address to the virtual address
     pageTable->entries[pageTableIndex].address = physicalAddress >> 12;
-    pageTable->entries[pageTableIndex].flags = flags;
+    pageTable->entries[pageTableIndex].flags = entry_flags(virtualAddress, flags);
+}
+
+PageTableEntry* vmm::get_entry(const uint32_t virtualAddress) {
+    const PageDirectoryEntry& directoryEntry = active_directory()->entries[virtualAddress >> 21];
+    if (!(directoryEntry.flags & PAGE_PRESENT) || (directoryEntry.flags & PAGE_LARGE)) return nullptr;
+
+    return &active_table(virtualAddress)->entries[(virtualAddress >> 12) & 0x1FF];
+}
+
+void vmm::map_page(const uint32_t virtualAddress, const uint64_t physicalAddress, const uint32_t flags) {
+    PageDirectoryEntry& directoryEntry = active_directory()->entries[virtualAddress >> 21];
+    PageTable* pageTable = active_table(virtualAddress);
+
+    // A single page inside a 2 MiB page needs a page table of its own
+    if ((directoryEntry.flags & PAGE_LARGE) && !split_large_page(virtualAddress)) {
+        vga::error("map_page: no memory to split a 2 MiB page!\n");
+        return;
+    }
+
+    if (!(directoryEntry.flags & PAGE_PRESENT)) {
+        uint32_t newTable = pmm::allocate_zeroed_frame();
+        page_table_pages++;
+        directoryEntry.address = newTable >> 12;
+        directoryEntry.flags = PAGE_PRESENT | PAGE_WRITABLE;
+        sync_kernel_entry(virtualAddress);
+
+        // The table's window in the recursive slot may still hold an older translation
+        flush_page(uint32_t(pageTable));
+    }
+
+    pageTable->entries[(virtualAddress >> 12) & 0x1FF].address = physicalAddress >> 12;
+    pageTable->entries[(virtualAddress >> 12) & 0x1FF].flags = entry_flags(virtualAddress, flags);
+    flush_page(virtualAddress);
+}
+
+uint64_t vmm::unmap_page(const uint32_t virtualAddress) {
+    if ((active_directory()->entries[virtualAddress >> 21].flags & PAGE_LARGE) && !split_large_page(virtualAddress))
+        return -1;
+
+    PageTableEntry* entry = get_entry(virtualAddress);
+    if (!entry || !(entry->flags & PAGE_PRESENT)) return -1;
+
+    uint64_t physicalAddress = entry->address << 12;
+    entry->address = 0;
+    entry->flags = 0;
+    flush_page(virtualAddress);
+
+    return physicalAddress;
+}
+
+uint64_t vmm::get_physical(const uint32_t virtualAddress) {
+    const PageDirectoryEntry& directoryEntry = active_directory()->entries[virtualAddress >> 21];
+    if ((directoryEntry.flags & PAGE_PRESENT) && (directoryEntry.flags & PAGE_LARGE))
+        return (directoryEntry.address << 12) | (virtualAddress & (LARGE_PAGE_SIZE - 1));
+
+    PageTableEntry* entry = get_entry(virtualAddress);
+    if (!entry || !(entry->flags & PAGE_PRESENT)) return -1;
+
+    return (entry->address << 12) | (virtualAddress & 0xFFF);
+}
+
+void vmm::flush_page(const uint32_t virtualAddress) {
+    asm volatile ("invlpg (%0)" : : "r"(virtualAddress) : "memory");
+}
+
+void* vmm::map_temporary(const uint64_t physicalAddress) {
+    uint32_t flags = irq_save();
+
+    for (uint32_t slot = 0; slot < (KERNEL_KMAP_END - KERNEL_KMAP_START) / PAGE_SIZE; slot++) {
+        if (temporary_slots[slot / 32] & (1u << (slot % 32))) continue;
+        temporary_slots[slot / 32] |= 1u << (slot % 32);
+        irq_restore(flags);
+
+        const uint32_t address = KERNEL_KMAP_START + slot * PAGE_SIZE;
+        map_page(address, physicalAddress & ~uint64_t(PAGE_SIZE - 1), PAGE_PRESENT | PAGE_WRITABLE);
+        return reinterpret_cast<void*>(address + uint32_t(physicalAddress & (PAGE_SIZE - 1)));
+    }
+
+    irq_restore(flags);
+    return nullptr;
+}
+
+void vmm::unmap_temporary(const void* address) {
+    const uint32_t slot = (uint32_t(address) - KERNEL_KMAP_START) / PAGE_SIZE;
+    unmap_page(uint32_t(address) & ~(PAGE_SIZE - 1));
+
+    uint32_t flags = irq_save();
+    temporary_slots[slot / 32] &= ~(1u << (slot % 32));
+    irq_restore(flags);
+}
+
+void vmm::flush_tlb() {
+    uint32_t cr3;
+    asm volatile ("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+}
+
+void vmm::flush_tlb_all() {
+    if (!global_flag) {
+        flush_tlb();
+        return;
+    }
+
+    // Turning PGE off and on again is what flushes global entries
+    uint32_t flags = irq_save();
+    uint32_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4 & ~0x80) : "memory");
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    irq_restore(flags);
+}
+
+#pragma region Large Pages
+
+bool vmm::map_large_page(const uint32_t virtualAddress, const uint32_t physicalAddress, const uint32_t flags) {
+    PageDirectoryEntry& directoryEntry = active_directory()->entries[virtualAddress >> 21];
+    // PAGE_PAT would be PAGE_LARGE here, the PAT bit of a 2 MiB page sits in the address
+    if (((virtualAddress | physicalAddress) & (LARGE_PAGE_SIZE - 1)) || (flags & PAGE_PAT) ||
+        ((directoryEntry.flags & PAGE_PRESENT) && !(directoryEntry.flags & PAGE_LARGE)))
+        return false;
+
+    directoryEntry.address = physicalAddress >> 12;
+    directoryEntry.flags = entry_flags(virtualAddress, flags) | PAGE_LARGE;
+    sync_kernel_entry(virtualAddress);
+    flush_page(virtualAddress); // One invlpg drops the whole 2 MiB entry
+    return true;
+}
+
+uint32_t vmm::unmap_large_page(const uint32_t virtualAddress) {
+    PageDirectoryEntry& directoryEntry = active_directory()->entries[virtualAddress >> 21];
+    if (!(directoryEntry.flags & PAGE_PRESENT) || !(directoryEntry.flags & PAGE_LARGE)) return -1;
+
+    uint32_t physicalAddress = directoryEntry.address << 12;
+    directoryEntry.address = 0;
+    directoryEntry.flags = 0;
+    sync_kernel_entry(virtualAddress);
+    flush_page(virtualAddress);
+
+    return physicalAddress;
+}
+
+bool vmm::split_large_page(const uint32_t virtualAddress) {
+    PageDirectoryEntry& directoryEntry = active_directory()->entries[virtualAddress >> 21];
+    if (!(directoryEntry.flags & PAGE_PRESENT) || !(directoryEntry.flags & PAGE_LARGE)) return true;
+
+    uint32_t table = pmm::allocate_frame();
+    if (table == uint32_t(-1)) return false;
+    page_table_pages++;
+
+    // Every 4 KiB page keeps the flags of the 2 MiB page, filled in before the table goes live
+    PageTable* pageTable = phys_to_virt<PageTable>(table);
+    const uint32_t first = directoryEntry.address;
+    const uint32_t flags = directoryEntry.flags & ~PAGE_LARGE;
+    for (uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        pageTable->entries[i].address = first + i;
+        pageTable->entries[i].flags = flags;
+    }
+
+    // The directory entry only keeps the permissions, so single pages can differ from now on
+    directoryEntry.address = table >> 12;
+    directoryEntry.flags = flags & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER);
+    sync_kernel_entry(virtualAddress);
+    flush_page(virtualAddress & ~(LARGE_PAGE_SIZE - 1));
+    flush_page(uint32_t(active_table(virtualAddress)));
+    return true;
+}
+
+bool vmm::merge_large_page(const uint32_t virtualAddress) {
+    PageDirectoryEntry& directoryEntry = active_directory()->entries[virtualAddress >> 21];
+    if (!(directoryEntry.flags & PAGE_PRESENT) || (directoryEntry.flags & PAGE_LARGE)) return false;
+
+    // Accessed and dirty bits may differ, the rest has to match. WT pages stay small like map_large_page wants
+    const uint32_t compared = PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER | PAGE_GLOBAL | PAGE_CACHE_MASK;
+    const PageTable* pageTable = active_table(virtualAddress);
+    const uint32_t first = pageTable->entries[0].address;
+    const uint32_t flags = pageTable->entries[0].flags & compared;
+    if (!(flags & PAGE_PRESENT) || (flags & PAGE_PAT) || (first & (PAGE_TABLE_ENTRIES - 1))) return false;
+
+    for (uint32_t i = 1; i < PAGE_TABLE_ENTRIES; i++)
+        if (pageTable->entries[i].address != first + i || (pageTable->entries[i].flags & compared) != flags)
+            return false;
+
+    const uint32_t table = directoryEntry.address << 12;
+    const uint32_t base = virtualAddress & ~(LARGE_PAGE_SIZE - 1);
+    directoryEntry.address = first;
+    directoryEntry.flags = flags | PAGE_LARGE;
+    sync_kernel_entry(virtualAddress);
+
+    // The 4 KiB translations are cached one by one
+    for (uint32_t page = 0; page < PAGE_TABLE_ENTRIES; page++)
+        flush_page(base + page * PAGE_SIZE);
+    flush_page(uint32_t(pageTable));
+
+    pmm::free_frame(table);
+    page_table_pages--;
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Ranges
+
+// TLB work a range operation leaves behind, and the frames it unmapped until that work is done
+struct range_flush {
+    uint32_t pages[VMM_FLUSH_THRESHOLD];
+    uint32_t count;                     // Changed pages, past VMM_FLUSH_THRESHOLD only counted
+    bool global;                        // A kernel page changed, its translation may be global
+    uint64_t frames[VMM_RELEASE_BATCH];
+    uint32_t sizes[VMM_RELEASE_BATCH];  // Pages behind each of frames
+    uint32_t released;
+};
+
+static inline void init_flush(range_flush& flush) {
+    flush.count = 0;
+    flush.global = false;
+    flush.released = 0;
+}
+
+static inline void queue_flush(range_flush& flush, const uint32_t virtualAddress) {
+    if (flush.count < VMM_FLUSH_THRESHOLD) flush.pages[flush.count] = virtualAddress;
+    flush.count++;
+    if (virtualAddress >= KERNEL_VIRTUAL_BASE) flush.global = true;
+}
+
+// A few pages get an invlpg each, more than that are cheaper to drop with the whole TLB. The frames go after that
+static void finish_flush(range_flush& flush, vmm::release_t release) {
+    if (flush.count > VMM_FLUSH_THRESHOLD) {
+        if (flush.global) vmm::flush_tlb_all();
+        else vmm::flush_tlb();
+        vmm::range_stats.full_flushes++;
+    } else {
+        for (uint32_t i = 0; i < flush.count; i++) vmm::flush_page(flush.pages[i]);
+        vmm::range_stats.page_flushes += flush.count;
+    }
+
+    for (uint32_t i = 0; i < flush.released; i++) release(flush.frames[i], flush.sizes[i]);
+    init_flush(flush);
+}
+
+// A frame must not be reused while a stale translation may still reach it, a full batch is flushed early
+static inline void queue_release(range_flush& flush, vmm::release_t release, const uint64_t frame, const uint32_t pages) {
+    if (!release) return;
+    flush.frames[flush.released] = frame;
+    flush.sizes[flush.released] = pages;
+    if (++flush.released == VMM_RELEASE_BATCH) finish_flush(flush, release);
+}
+
+// Page tables of a range, taken from the PMM VMM_TABLE_BATCH at a time
+struct table_batch {
+    uint32_t frames[VMM_TABLE_BATCH];
+    uint32_t count;
+    uint32_t missing; // Directory entries of the rest of the range without a page table
+};
+
+// Next page table for a range, zeroed. -1 once the PMM runs out
+static uint32_t take_table(table_batch& batch) {
+    if (!batch.count) {
+        uint32_t wanted = batch.missing < VMM_TABLE_BATCH ? batch.missing : VMM_TABLE_BATCH;
+        batch.count = pmm::allocate_frames_batch(wanted ? wanted : 1, batch.frames);
+        batch.missing -= batch.count < batch.missing ? batch.count : batch.missing;
+        if (!batch.count) return -1;
+    }
+
+    const uint32_t table = batch.frames[--batch.count];
+    memset(phys_to_virt(table), 0, PAGE_SIZE);
+    MEM_TRACE_ALLOC(MEMTRACE_FRAME_ALLOC, table, BLOCK_SIZE);
+    vmm::page_table_pages++;
+    vmm::range_stats.tables++;
+    return table;
+}
+
+// Page aligned, not empty, and below the recursive slots
+static inline bool valid_range(const uint32_t virtualAddress, const uint32_t pages) {
+    return pages && !(virtualAddress & (PAGE_SIZE - 1)) && virtualAddress < PAGE_TABLES_ADDRESS &&
+           pages <= (PAGE_TABLES_ADDRESS - virtualAddress) / PAGE_SIZE;
+}
+
+// Directory entries a range touches that have no page table yet, at most the tables it needs
+static uint32_t count_missing(const uint32_t virtualAddress, const uint32_t pages) {
+    const uint32_t last = (virtualAddress + (pages - 1) * PAGE_SIZE) >> 21;
+    uint32_t missing = 0;
+
+    for (uint32_t index = virtualAddress >> 21; index <= last; index++)
+        if (!(active_directory()->entries[index].flags & PAGE_PRESENT)) missing++;
+    return missing;
+}
+
+// Pages from address on, at most left, that share its page table
+static inline uint32_t table_run(const uint32_t address, const uint32_t left) {
+    const uint32_t run = PAGE_TABLE_ENTRIES - ((address >> 12) & 0x1FF);
+    return run < left ? run : left;
+}
+
+/* Maps pages from virtualAddress on, page i to frame(i). With large, a whole aligned 2 MiB piece whose
+ * first frame is aligned becomes a 2 MiB page, the caller makes sure the frames behind it are contiguous */
+template<typename Frame>
+static bool map_walk(const uint32_t virtualAddress, const uint32_t pages, const uint32_t flags, const bool large, Frame frame) {
+    if (!valid_range(virtualAddress, pages)) return false;
+
+    table_batch batch;
+    batch.count = 0;
+    batch.missing = count_missing(virtualAddress, pages);
+    if (batch.missing > pmm::free_blocks) return false;
+
+    range_flush flush;
+    init_flush(flush);
+    PageDirectory* directory = active_directory();
+    bool failed = false;
+    uint32_t done = 0;
+
+    while (done < pages) {
+        const uint32_t address = virtualAddress + done * PAGE_SIZE;
+        const uint32_t run = table_run(address, pages - done);
+        const uint32_t entryFlags = entry_flags(address, flags);
+        PageDirectoryEntry& directoryEntry = directory->entries[address >> 21];
+
+        // A page table already there is kept, replacing it would need every other mapping in it checked
+        const uint64_t physical = frame(done);
+        if (large && run == PAGE_TABLE_ENTRIES && !(physical & (LARGE_PAGE_SIZE - 1)) && !(flags & PAGE_PAT) &&
+            (!(directoryEntry.flags & PAGE_PRESENT) || (directoryEntry.flags & PAGE_LARGE))) {
+            if (directoryEntry.flags & PAGE_PRESENT) queue_flush(flush, address);
+            directoryEntry.address = physical >> 12;
+            directoryEntry.flags = entryFlags | PAGE_LARGE;
+            sync_kernel_entry(address);
+            vmm::range_stats.large_pages++;
+            done += run;
+            continue;
+        }
+
+        if ((directoryEntry.flags & PAGE_LARGE) && !vmm::split_large_page(address)) {
+            failed = true;
+            break;
+        }
+
+        if (!(directoryEntry.flags & PAGE_PRESENT)) {
+            const uint32_t table = take_table(batch);
+            if (table == uint32_t(-1)) {
+                failed = true;
+                break;
+            }
+            directoryEntry.address = table >> 12;
+            directoryEntry.flags = PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
+            sync_kernel_entry(address);
+
+            // The table's window in the recursive slot may still hold an older translation
+            vmm::flush_page(uint32_t(active_table(address)));
+        }
+
+        // Through the direct map, page tables are always below PMM_MAX_ADDRESS
+        PageTable* pageTable = phys_to_virt<PageTable>(directoryEntry.address << 12);
+        const uint32_t first = (address >> 12) & 0x1FF;
+        for (uint32_t i = 0; i < run; i++) {
+            PageTableEntry& entry = pageTable->entries[first + i];
+            // Not present entries are never cached, only replaced mappings need a flush
+            if (entry.flags & PAGE_PRESENT) queue_flush(flush, address + i * PAGE_SIZE);
+            entry.address = frame(done + i) >> 12;
+            entry.flags = entryFlags;
+        }
+        done += run;
+    }
+
+    if (batch.count) pmm::free_frames_batch(batch.count, batch.frames);
+    finish_flush(flush, nullptr);
+
+    // What was mapped so far goes again, the frames belong to the caller
+    if (failed) {
+        vmm::unmap_range(virtualAddress, done, nullptr);
+        return false;
+    }
+
+    vmm::range_stats.ranges++;
+    vmm::range_stats.pages += pages;
+    return true;
+}
+
+bool vmm::map_range(const uint32_t virtualAddress, const uint64_t physicalAddress, const uint32_t pages, const uint32_t flags) {
+    return map_walk(virtualAddress, pages, flags, true, [physicalAddress](uint32_t page) {
+        return physicalAddress + uint64_t(page) * PAGE_SIZE;
+    });
+}
+
+bool vmm::map_frames(const uint32_t virtualAddress, const uint64_t* frames, const uint32_t pages, const uint32_t flags) {
+    return map_walk(virtualAddress, pages, flags, false, [frames](uint32_t page) {
+        return frames[page];
+    });
+}
+
+void vmm::unmap_range(const uint32_t virtualAddress, const uint32_t pages, release_t release) {
+    if (!valid_range(virtualAddress, pages)) return;
+
+    range_flush flush;
+    init_flush(flush);
+    PageDirectory* directory = active_directory();
+
+    for (uint32_t done = 0; done < pages;) {
+        const uint32_t address = virtualAddress + done * PAGE_SIZE;
+        const uint32_t run = table_run(address, pages - done);
+        PageDirectoryEntry& directoryEntry = directory->entries[address >> 21];
+
+        if (!(directoryEntry.flags & PAGE_PRESENT)) {
+            done += run;
+            continue;
+        }
+
+        if (directoryEntry.flags & PAGE_LARGE) {
+            if (run == PAGE_TABLE_ENTRIES) {
+                const uint64_t block = directoryEntry.address << 12;
+                directoryEntry.address = 0;
+                directoryEntry.flags = 0;
+                sync_kernel_entry(address);
+                queue_flush(flush, address); // One invlpg drops the whole 2 MiB entry
+                queue_release(flush, release, block, PAGE_TABLE_ENTRIES);
+                done += run;
+                continue;
+            }
+
+            // Only part of it goes, the rest keeps its mapping
+            if (!split_large_page(address)) {
+                vga::error("unmap_range: no memory to split a 2 MiB page!\n");
+                done += run;
+                continue;
+            }
+        }
+
+        PageTable* pageTable = phys_to_virt<PageTable>(directoryEntry.address << 12);
+        const uint32_t first = (address >> 12) & 0x1FF;
+        for (uint32_t i = 0; i < run; i++) {
+            PageTableEntry& entry = pageTable->entries[first + i];
+            if (!(entry.flags & PAGE_PRESENT)) continue;
+
+            const uint64_t frame = entry.address << 12;
+            entry.address = 0;
+            entry.flags = 0;
+            queue_flush(flush, address + i * PAGE_SIZE);
+            queue_release(flush, release, frame, 1);
+        }
+        done += run;
+    }
+
+    finish_flush(flush, release);
+    range_stats.ranges++;
+    range_stats.pages += pages;
+}
+
+/* Present pages of a range keep the flags in kept and get the ones in set. A 2 MiB page the range covers is changed in
+ * one piece unless set needs the PAT bit, which only page table entries have. False if a 2 MiB page could not be split */
+static bool change_range(const uint32_t virtualAddress, const uint32_t pages, const uint32_t kept, const uint32_t set) {
+    if (!valid_range(virtualAddress, pages)) return false;
+
+    range_flush flush;
+    init_flush(flush);
+    PageDirectory* directory = active_directory();
+    bool split = true;
+
+    for (uint32_t done = 0; done < pages;) {
+        const uint32_t address = virtualAddress + done * PAGE_SIZE;
+        const uint32_t run = table_run(address, pages - done);
+        const uint32_t entryFlags = entry_flags(address, set);
+        PageDirectoryEntry& directoryEntry = directory->entries[address >> 21];
+
+        if (!(directoryEntry.flags & PAGE_PRESENT)) {
+            done += run;
+            continue;
+        }
+
+        if (directoryEntry.flags & PAGE_LARGE) {
+            if (run == PAGE_TABLE_ENTRIES && !(entryFlags & PAGE_PAT)) {
+                directoryEntry.flags = (directoryEntry.flags & kept) | entryFlags | PAGE_LARGE;
+                sync_kernel_entry(address);
+                queue_flush(flush, address);
+                done += run;
+                continue;
+            }
+
+            if (!vmm::split_large_page(address)) {
+                split = false;
+                done += run;
+                continue;
+            }
+        }
+
+        // The directory entry has to allow what its pages do, the pages themselves still restrict it
+        const uint32_t allowed = set & (PAGE_WRITABLE | PAGE_USER);
+        if ((directoryEntry.flags & allowed) != allowed) {
+            directoryEntry.flags |= allowed;
+            sync_kernel_entry(address);
+        }
+
+        PageTable* pageTable = phys_to_virt<PageTable>(directoryEntry.address << 12);
+        const uint32_t first = (address >> 12) & 0x1FF;
+        for (uint32_t i = 0; i < run; i++) {
+            PageTableEntry& entry = pageTable->entries[first + i];
+            if (!(entry.flags & PAGE_PRESENT)) continue;
+
+            entry.flags = (entry.flags & kept) | entryFlags;
+            queue_flush(flush, address + i * PAGE_SIZE);
+        }
+        done += run;
+    }
+
+    finish_flush(flush, nullptr);
+    vmm::range_stats.ranges++;
+    vmm::range_stats.pages += pages;
+    return split;
+}
+
+bool vmm::protect_range(const uint32_t virtualAddress, const uint32_t pages, const uint32_t flags) {
+    return change_range(virtualAddress, pages, PAGE_ACCESSED | PAGE_DIRTY, flags | PAGE_PRESENT);
+}
+
+bool vmm::set_cache_range(const uint32_t virtualAddress, const uint32_t pages, const uint32_t cache) {
+    const bool split = change_range(virtualAddress, pages, 0xFFF & ~PAGE_CACHE_MASK, cache & PAGE_CACHE_MASK);
+
+    // Lines cached under the old type must not be written back over the new one later
+    asm volatile ("wbinvd" : : : "memory");
+    return split;
+}
+
+#pragma endregion
+
+#pragma region Copy on Write
+
+// Frame contents through the direct map, or the temporary window for high memory
+static void* map_frame(const uint64_t address) {
+    return pmm::is_high_frame(address) ? vmm::map_temporary(address) : phys_to_virt(uint32_t(address));
+}
+
+static void unmap_frame(const uint64_t address, const void* mapped) {
+    if (pmm::is_high_frame(address)) vmm::unmap_temporary(mapped);
+}
+
+bool vmm::copy_frame(const uint64_t destination, const uint64_t source) {
+    void* to = map_frame(destination);
+    if (!to) return false;
+    const void* from = map_frame(source);
+    if (!from) {
+        unmap_frame(destination, to);
+        return false;
+    }
+
+    memcpy(to, from, PAGE_SIZE);
+
+    unmap_frame(source, from);
+    unmap_frame(destination, to);
+    return true;
+}
+
+// Points the pointer table of a slot at the four directories starting at directories
+static void set_pointer_table(const uint32_t slot, const uint32_t directories) {
+    for (uint32_t i = 0; i < PAGE_DIRECTORY_POINTERS; i++)
+        pointer_tables[slot].entries[i] = (directories + i * PAGE_SIZE) | PAGE_PRESENT;
+}
+
+// The four directories of an address space are one contiguous block, so the direct map shows them as one array
+static void set_recursive_slots(PageDirectory* directory, const uint32_t directories) {
+    for (uint32_t i = 0; i < PAGE_DIRECTORY_POINTERS; i++) {
+        directory->entries[RECURSIVE_SLOT + i].address = (directories >> 12) + i;
+        directory->entries[RECURSIVE_SLOT + i].flags = PAGE_PRESENT | PAGE_WRITABLE;
+    }
+}
+
+PageDirectory* vmm::clone_address_space() {
+    uint32_t slot = 0;
+    while (slot < VMM_MAX_ADDRESS_SPACES && address_spaces[slot]) slot++;
+    if (slot == VMM_MAX_ADDRESS_SPACES) return nullptr;
+
+    uint32_t directories = pmm::allocate_contiguous(PAGE_DIRECTORY_POINTERS, PAGE_DIRECTORY_POINTERS * PAGE_SIZE);
+    if (directories == uint32_t(-1)) return nullptr;
+    page_table_pages += PAGE_DIRECTORY_POINTERS;
+
+    // The kernel half is the same page tables, the copy gets its own recursive slots
+    PageDirectory* parent = active_directory();
+    PageDirectory* child = phys_to_virt<PageDirectory>(directories);
+    memset(child, 0, sizeof(PageDirectory));
+    for (uint32_t i = KERNEL_VIRTUAL_BASE >> 21; i < RECURSIVE_SLOT; i++)
+        child->entries[i] = parent->entries[i];
+    set_recursive_slots(child, directories);
+    set_pointer_table(slot, directories);
+    address_spaces[slot] = child;
+
+    // Below the kernel only the page tables are copied, the pages behind them are shared
+    for (uint32_t i = 0; i < (KERNEL_VIRTUAL_BASE >> 21); i++) {
+        const PageDirectoryEntry& directoryEntry = parent->entries[i];
+        if (!(directoryEntry.flags & PAGE_PRESENT)) continue;
+
+        uint32_t table = (directoryEntry.flags & PAGE_LARGE) ? uint32_t(-1) : pmm::allocate_zeroed_frame();
+        if (table == uint32_t(-1)) {
+            vga::error("clone_address_space: no memory or a 2 MiB page in the way!\n");
+            flush_tlb();
+            destroy_address_space(child);
+            return nullptr;
+        }
+        page_table_pages++;
+
+        PageTable* source = active_table(i << 21);
+        PageTable* copy = phys_to_virt<PageTable>(table);
+        for (uint32_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+            PageTableEntry& entry = source->entries[j];
+            if (!(entry.flags & PAGE_PRESENT)) continue;
+
+            // Both sides lose write access, the first write gets a private copy
+            if (entry.flags & PAGE_WRITABLE) entry.flags = (entry.flags & ~PAGE_WRITABLE) | PAGE_COW;
+            copy->entries[j] = entry;
+            pmm::ref_frame(entry.address << 12);
+            cow_stats.shared_pages++;
+        }
+
+        child->entries[i].address = table >> 12;
+        child->entries[i].flags = directoryEntry.flags;
+    }
+
+    // Pages below the kernel are never global, so reloading CR3 drops their old writable translations
+    flush_tlb();
+    cow_stats.clones++;
+    return child;
+}
+
+void vmm::switch_address_space(PageDirectory* directory) {
+    for (uint32_t slot = 0; slot < VMM_MAX_ADDRESS_SPACES; slot++)
+        if (address_spaces[slot] == directory)
+            asm volatile ("mov %0, %%cr3" : : "r"(virt_to_phys(&pointer_tables[slot])) : "memory");
+}
+
+void vmm::destroy_address_space(PageDirectory* directory) {
+    if (directory == kernelPageDirectory || directory == active_space()) {
+        vga::error("Cannot destroy the kernel or the active address space!\n");
+        return;
+    }
+
+    for (uint32_t i = 0; i < (KERNEL_VIRTUAL_BASE >> 21); i++) {
+        const PageDirectoryEntry& directoryEntry = directory->entries[i];
+        if (!(directoryEntry.flags & PAGE_PRESENT)) continue;
+
+        PageTable* table = phys_to_virt<PageTable>(directoryEntry.address << 12);
+        for (uint32_t j = 0; j < PAGE_TABLE_ENTRIES; j++)
+            if (table->entries[j].flags & PAGE_PRESENT) pmm::unref_frame(table->entries[j].address << 12);
+
+        pmm::free_frame(directoryEntry.address << 12);
+        page_table_pages--;
+    }
+
+    for (PageDirectory*& space : address_spaces)
+        if (space == directory) space = nullptr;
+    pmm::free_contiguous(virt_to_phys(directory), PAGE_DIRECTORY_POINTERS);
+    page_table_pages -= PAGE_DIRECTORY_POINTERS;
+}
+
+bool vmm::handle_cow_fault(const uint32_t address, const uint32_t errorCode) {
+    // Error code bits 0 and 1: a present page was written
+    if ((errorCode & 0x3) != 0x3) return false;
+
+    // The zero page belongs to anonymous areas, which hand the new frame to the swap CLOCK hand
+    PageTableEntry* entry = get_entry(address);
+    if (!entry || !(entry->flags & PAGE_COW)) return false;
+
+    const uint32_t page = address & ~(PAGE_SIZE - 1);
+    const uint64_t old = entry->address << 12;
+    if (old == zero_page) return false;
+
+    // Every other mapping is gone, the page can be written in place
+    if (!pmm::frame_refs(old)) {
+        entry->flags = (entry->flags & ~PAGE_COW) | PAGE_WRITABLE;
+        flush_page(page);
+        cow_stats.reuses++;
+        return true;
+    }
+
+    // Only this mapping reaches the copy, so it can live in high memory
+    uint64_t frame = pmm::allocate_user_frame();
+    if (frame == uint64_t(-1)) return false;
+
+    if (!copy_frame(frame, old)) {
+        pmm::unref_frame(frame);
+        return false;
+    }
+    entry->address = frame >> 12;
+    entry->flags = (entry->flags & ~PAGE_COW) | PAGE_WRITABLE;
+    flush_page(page);
+
+    pmm::unref_frame(old);
+    cow_stats.copies++;
+    return true;
+}
+
+#define TEST_COW_ADDRESS 0x40000000 // Any address below the kernel
+
+void vmm::test_cow() {
+    uint64_t frame = pmm::allocate_user_frame();
+    if (frame == uint64_t(-1)) return;
+
+    map_page(TEST_COW_ADDRESS, frame, PAGE_PRESENT | PAGE_WRITABLE);
+    volatile uint32_t* word = reinterpret_cast<volatile uint32_t*>(TEST_COW_ADDRESS);
+    *word = 0x1111;
+
+    PageDirectory* parent = active_space();
+    PageDirectory* child = clone_address_space();
+    if (!child) {
+        vga::error("Address space clone failed!\n");
+        pmm::unref_frame(unmap_page(TEST_COW_ADDRESS));
+        return;
+    }
+
+    // Parent writes first: the page is still shared, so it gets copied
+    *word = 0x2222;
+
+    switch_address_space(child);
+    if (*word != 0x1111) vga::error("Clone sees the parent's write!\n");
+    // The clone is the only one left on the old frame, it keeps it
+    *word = 0x3333;
+    switch_address_space(parent);
+
+    if (*word != 0x2222) vga::error("Parent sees the clone's write!\n");
+
+    destroy_address_space(child);
+    pmm::unref_frame(unmap_page(TEST_COW_ADDRESS));
+
+    vga::printf("COW: clones ");
+    vga::printf(cow_stats.clones);
+    vga::printf(", shared pages ");
+    vga::printf(cow_stats.shared_pages);
+    vga::printf(", copies ");
+    vga::printf(cow_stats.copies);
+    vga::printf(", reuses ");
+    vga::printf(cow_stats.reuses);
+    vga::printf('\n');
+}
+
+#pragma endregion
+
+#pragma region High Memory
+
+void vmm::test_highmem() {
+    uint64_t frame = pmm::allocate_high_frame();
+    if (frame == uint64_t(-1)) {
+        vga::printf("No high memory to test\n");
+        return;
+    }
+
+    uint32_t* words = static_cast<uint32_t*>(map_temporary(frame));
+    for (uint32_t i = 0; i < PAGE_SIZE / 4; i++) words[i] = i ^ 0xA5A5A5A5;
+    unmap_temporary(words);
+
+    // A different slot or the same one, the frame has to read back the same
+    words = static_cast<uint32_t*>(map_temporary(frame));
+    for (uint32_t i = 0; i < PAGE_SIZE / 4; i++) {
+        if (words[i] != (i ^ 0xA5A5A5A5)) {
+            vga::error("High memory frame lost its contents!\n");
+            break;
+        }
+    }
+    unmap_temporary(words);
+
+    vga::printf("High memory frame: ");
+    vga::printf(frame);
+    vga::printf('\n');
+    pmm::free_high_frame(frame);
+    pmm::print_highmem_stats();
+}
+
+#pragma endregion
+
+// Backs pages of reserved areas on first touch and copies shared pages on write, any other fault is a kernel bug
+static bool page_fault_handler(InterruptRegisters* regs) {
+    uint32_t address = regs->cr2;
+
+    if (vmm::handle_cow_fault(address, regs->err_code) || vma::handle_fault(address, regs->err_code))
+        return true;
+
+    vga::error("Page fault at ");
+    vga::error(address);
+    vga::error(", eip ");
+    vga::error(regs->eip);
+    vga::error(", error ");
+    vga::error(regs->err_code);
+    vga::printf('\n');
+    return false;
 }
 
 void vmm::init() {
-    // Allocate the kernel page directory
-    kernelPageDirectory = (PageDirectory*)pmm::allocate_frame();
-    memset(kernelPageDirectory, 0, PAGE_SIZE);
+    // Global pages have to be on before the kernel mappings below are made
+    if (cpuid::has_edx_feature(CPUID_FEAT_EDX_PGE)) {
+        uint32_t cr4;
+        asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile ("mov %0, %%cr4" : : "r"(cr4 | 0x80) : "memory");
+        global_flag = PAGE_GLOBAL;
+    }
+
+    // PAT entry 1 becomes write-combining. Nothing is mapped with PWT yet, so no cached line has the old type
+    if (cpuid::has_edx_feature(CPUID_FEAT_EDX_PAT)) {
+        wrmsr(PAT_MSR, PAT_VALUE);
+        pat_enabled = true;
+    }
+
+    // The boot directories from kernel_entry.asm stay in use, they already have the recursive slots
+    kernelPageDirectory = &boot_page_directory;
+    address_spaces[0] = kernelPageDirectory;
+    set_pointer_table(0, virt_to_phys(kernelPageDirectory));
+    page_table_pages = PAGE_DIRECTORY_POINTERS;
+
+    /* The direct map covers the RAM the PMM manages. Whole 2 MiB pieces keep the boot stub's 2 MiB pages, the one
+     * holding the end of RAM is split and loses what lies past it */
+    const uint32_t directMapEnd = pmm::num_blocks * BLOCK_SIZE; // Never past PMM_MAX_ADDRESS
+    const uint32_t largeEnd = directMapEnd & ~(LARGE_PAGE_SIZE - 1);
 
-    // Identity map the kernel (map virtual == physical for now)
-    for (uint32_t addr = 0; addr < 0x100000; addr += PAGE_SIZE) { // Map the first 1 MB
-        map_page(addr, addr, kernelPageDirectory, PAGE_PRESENT | PAGE_WRITABLE);
+    map_range(KERNEL_VIRTUAL_BASE, 0, directMapEnd / PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE);
+    if (largeEnd < directMapEnd)
+        unmap_range(KERNEL_VIRTUAL_BASE + directMapEnd, (largeEnd + LARGE_PAGE_SIZE - directMapEnd) / PAGE_SIZE, nullptr);
+
+    // What is left of the boot pages: the identity map of the first 4 MiB and the direct map past the end of RAM
+    for (uint32_t index = 0; index < RECURSIVE_SLOT; index++) {
+        const bool directMap = index >= (KERNEL_VIRTUAL_BASE >> 21) && index < ((KERNEL_VIRTUAL_BASE + largeEnd) >> 21);
+        if (!directMap && (kernelPageDirectory->entries[index].flags & PAGE_LARGE)) {
+            kernelPageDirectory->entries[index].address = 0;
+            kernelPageDirectory->entries[index].flags = 0;
+        }
     }
 
-    // Load the page directory into CR3 and enable paging
-    enable_paging(uint32_t(kernelPageDirectory));
+    // Reloading CR3 drops every translation of the boot pages at once (they are not global), paging itself is already on
+    idt::isr_install_handler(14, &page_fault_handler);
+    enable_paging(virt_to_phys(&pointer_tables[0]));
+
+    // Read only pages have to fault for the kernel too, or copy on write would not see its writes (CR0.WP)
+    uint32_t cr0;
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile ("mov %0, %%cr0" : : "r"(cr0 | 0x10000) : "memory");
 
-    vga::printf("VMM initialized!\n");
+    zero_page = pmm::allocate_zeroed_frame();
+    pmm::pin_frame(zero_page);
+
+    vga::printf(global_flag ? "VMM initialized with global kernel pages" : "VMM initialized");
+    vga::printf(pat_enabled ? " and PAT!\n" : "!\n");
 }
+
+#pragma region Benchmark
+
+#define BENCH_LARGE_BYTES 0x4000000 // 64 MiB, far more pages than the TLB holds
+#define BENCH_LARGE_ROUNDS 4
+
+// Reads one word from every page, moving the offset so the reads do not share cache sets
+static uint64_t walk_pages(const uint32_t start, const uint32_t end) {
+    uint32_t sum = 0;
+    uint64_t begin = rdtsc();
+
+    for (uint32_t round = 0; round < BENCH_LARGE_ROUNDS; round++) {
+        uint32_t offset = 0;
+        for (uint32_t page = start; page < end; page += PAGE_SIZE) {
+            sum += *reinterpret_cast<volatile uint32_t*>(page + offset);
+            offset = (offset + 64) & (PAGE_SIZE - 1);
+        }
+    }
+
+    uint64_t cycles = rdtsc() - begin;
+    asm volatile ("" : : "r"(sum));
+    return cycles;
+}
+
+void vmm::bench_large_pages() {
+    // Whole 2 MiB pieces of the direct map, after the first 4 MiB which hold the kernel
+    const uint32_t start = KERNEL_VIRTUAL_BASE + 2 * LARGE_PAGE_SIZE;
+    uint32_t end = KERNEL_VIRTUAL_BASE + ((pmm::num_blocks * BLOCK_SIZE) & ~(LARGE_PAGE_SIZE - 1));
+    if (end > start + BENCH_LARGE_BYTES) end = start + BENCH_LARGE_BYTES;
+    if (end <= start) {
+        vga::error("Not enough RAM for the large page bench!\n");
+        return;
+    }
+    const uint32_t accesses = (end - start) / PAGE_SIZE * BENCH_LARGE_ROUNDS;
+
+    // The first walk of each kind only warms the caches
+    walk_pages(start, end);
+    uint64_t large_cycles = walk_pages(start, end);
+
+    // Same memory through 4 KiB pages
+    const uint32_t tables_before = page_table_pages;
+    for (uint32_t page = start; page < end; page += LARGE_PAGE_SIZE)
+        split_large_page(page);
+    const uint32_t tables = page_table_pages - tables_before;
+
+    walk_pages(start, end);
+    uint64_t small_cycles = walk_pages(start, end);
+
+    for (uint32_t page = start; page < end; page += LARGE_PAGE_SIZE)
+        merge_large_page(page);
+
+    vga::printf("Large page bench, MiB walked: ");
+    vga::printf((end - start) >> 20);
+    vga::printf("\n  2 MiB pages cycles/access: ");
+    vga::printf(uint32_t(large_cycles) / accesses);
+    vga::printf("\n  4 KiB pages cycles/access: ");
+    vga::printf(uint32_t(small_cycles) / accesses);
+    vga::printf("\n  page tables the 4 KiB pages needed: ");
+    vga::printf(tables);
+    vga::printf('\n');
+}
+
+#define BENCH_RANGE_ADDRESS 0x40000000 // Below the kernel, nothing maps there in the kernel's address space
+#define BENCH_RANGE_PAGES 4096         // 16 MiB
+
+void vmm::bench_ranges() {
+    // One page past an aligned address, so map_range cannot take 2 MiB pages and does the same work
+    const uint64_t physical = PAGE_SIZE;
+
+    // Warming up: the page tables stay allocated for both runs
+    map_range(BENCH_RANGE_ADDRESS, physical, BENCH_RANGE_PAGES, PAGE_PRESENT);
+    unmap_range(BENCH_RANGE_ADDRESS, BENCH_RANGE_PAGES, nullptr);
+
+    uint64_t begin = rdtsc();
+    for (uint32_t i = 0; i < BENCH_RANGE_PAGES; i++)
+        map_page(BENCH_RANGE_ADDRESS + i * PAGE_SIZE, physical + i * PAGE_SIZE, PAGE_PRESENT);
+    const uint64_t page_map = rdtsc() - begin;
+
+    begin = rdtsc();
+    for (uint32_t i = 0; i < BENCH_RANGE_PAGES; i++)
+        unmap_page(BENCH_RANGE_ADDRESS + i * PAGE_SIZE);
+    const uint64_t page_unmap = rdtsc() - begin;
+
+    begin = rdtsc();
+    map_range(BENCH_RANGE_ADDRESS, physical, BENCH_RANGE_PAGES, PAGE_PRESENT);
+    const uint64_t range_map = rdtsc() - begin;
+
+    begin = rdtsc();
+    unmap_range(BENCH_RANGE_ADDRESS, BENCH_RANGE_PAGES, nullptr);
+    const uint64_t range_unmap = rdtsc() - begin;
+
+    vga::printf("Range bench, pages: ");
+    vga::printf(uint32_t(BENCH_RANGE_PAGES));
+    vga::printf("\n  map_page cycles/page: ");
+    vga::printf(uint32_t(page_map) / BENCH_RANGE_PAGES);
+    vga::printf("\n  map_range cycles/page: ");
+    vga::printf(uint32_t(range_map) / BENCH_RANGE_PAGES);
+    vga::printf("\n  unmap_page cycles/page: ");
+    vga::printf(uint32_t(page_unmap) / BENCH_RANGE_PAGES);
+    vga::printf("\n  unmap_range cycles/page: ");
+    vga::printf(uint32_t(range_unmap) / BENCH_RANGE_PAGES);
+    vga::printf("\n  range tables batched: ");
+    vga::printf(range_stats.tables);
+    vga::printf(", page flushes ");
+    vga::printf(range_stats.page_flushes);
+    vga::printf(", full flushes ");
+    vga::printf(range_stats.full_flushes);
+    vga::printf('\n');
+}
+
+#define BENCH_WC_ROUNDS 64
+
+// Fills VGA memory past the first page, the visible text screen is only 4000 bytes so nothing shows
+static uint64_t write_vga(const uint32_t start, const uint32_t end) {
+    uint64_t begin = rdtsc();
+
+    for (uint32_t round = 0; round < BENCH_WC_ROUNDS; round++)
+        for (uint32_t address = start; address < end; address += 4)
+            *reinterpret_cast<volatile uint32_t*>(address) = address ^ round;
+
+    // A locked instruction drains the write-combining buffers before the clock stops
+    asm volatile ("lock orl $0, (%%esp)" : : : "memory", "cc");
+    return rdtsc() - begin;
+}
+
+void vmm::bench_write_combining() {
+    // Aliases of their own, retyping the direct map would split its first 2 MiB page
+    const uint32_t pages = VGA_SIZE / PAGE_SIZE - 1;
+    const uint32_t kib = pages * PAGE_SIZE / 1024 * BENCH_WC_ROUNDS;
+    void* uncachedAlias = vmap(VGA_PHYSICAL + PAGE_SIZE, pages, PAGE_CACHE_UC);
+    void* combinedAlias = vmap(VGA_PHYSICAL + PAGE_SIZE, pages, PAGE_CACHE_WC);
+    if (!uncachedAlias || !combinedAlias) {
+        vga::error("Write-combining bench could not map VGA memory!\n");
+        vfree(uncachedAlias);
+        vfree(combinedAlias);
+        return;
+    }
+
+    uint32_t start = uint32_t(uncachedAlias);
+    write_vga(start, start + pages * PAGE_SIZE);
+    uint64_t uncached = write_vga(start, start + pages * PAGE_SIZE);
+
+    start = uint32_t(combinedAlias);
+    write_vga(start, start + pages * PAGE_SIZE);
+    uint64_t combined = write_vga(start, start + pages * PAGE_SIZE);
+
+    vfree(combinedAlias);
+    vfree(uncachedAlias);
+
+    vga::printf(pat_enabled ? "Write-combining bench, KiB written: " : "Write-combining bench (no PAT, WT instead), KiB written: ");
+    vga::printf(kib);
+    vga::printf("\n  UC cycles/KiB: ");
+    vga::printf(uint32_t(uncached) / kib);
+    vga::printf("\n  WC cycles/KiB: ");
+    vga::printf(uint32_t(combined) / kib);
+    vga::printf('\n');
+}
+
+#pragma endregion
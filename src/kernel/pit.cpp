@@ -11,9 +11,10 @@
 #include <utils/ports.hpp>
 #include <idt/idt.hpp>
 #include <drivers/vga_print.hpp>
+#include <utils/util.hpp>
 
 volatile uint64_t ticks;
-const uint32_t frequency = 100;
+const uint32_t frequency = PIT_FREQUENCY;
 
 // PIT is IRQ0
 void onIrq0(InterruptRegisters* regs) {
@@ -47,6 +48,14 @@ void pit::delay(uint64_t ms) {
     }
 }
 
+uint64_t pit::get_ticks() {
+    // 64-bit reads are two loads, the IRQ must not land in between
+    uint32_t flags = irq_save();
+    uint64_t now = ticks;
+    irq_restore(flags);
+    return now;
+}
+
 void pit::test() {
     vga::printf("Starting timer\n");
     pit::delay(300);
@@ -28,4 +28,16 @@ uint8_t inPortB(const uint16_t port) {
     return value;
 }
 
+// Reads count 16-bit values from a port into buffer (rep insw)
+void inPortWords(const uint16_t port, uint16_t* buffer, const uint32_t count) {
+    uint32_t remaining = count;
+    asm volatile("rep insw" : "+D"(buffer), "+c"(remaining) : "d"(port) : "memory");
+}
+
+// Writes count 16-bit values from buffer to a port (rep outsw)
+void outPortWords(const uint16_t port, const uint16_t* buffer, const uint32_t count) {
+    uint32_t remaining = count;
+    asm volatile("rep outsw" : "+S"(buffer), "+c"(remaining) : "d"(port) : "memory");
+}
+
 } // Namespace ports
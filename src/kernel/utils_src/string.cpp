@@ -0,0 +1,329 @@
+// =======================================================================
+// Copyright Ioane Baidoshvili 2024.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://www.opensource.org/licenses/MIT_1_0.txt)
+//
+// string.cpp copies, fills and compares blocks of memory
+// This file contains:
+// rep string and SSE2 routines, picking them from CPUID at boot,
+// memcpy, memmove, memset, memcmp and their non-temporal variants, the benchmark
+// =======================================================================
+
+#include <utils/string.hpp>
+#include <utils/util.hpp>
+#include <memory/virtual/vmalloc.hpp>
+#include <drivers/vga_print.hpp>
+#include <cpuid.hpp>
+#include <fpu.hpp>
+
+// The value of a fill is repeated in every byte of the pattern
+typedef void (*copy_t)(uint8_t* destination, const uint8_t* source, uint32_t count);
+typedef void (*set_t)(uint8_t* destination, uint32_t pattern, uint32_t count);
+
+// Defined in string_sse.asm, 16 byte aligned destination and whole 64 byte blocks only
+extern "C" void sse2_copy(void* destination, const void* source, uint32_t count);
+extern "C" void sse2_copy_nt(void* destination, const void* source, uint32_t count);
+extern "C" void sse2_set(void* destination, uint32_t pattern, uint32_t count);
+extern "C" void sse2_set_nt(void* destination, uint32_t pattern, uint32_t count);
+
+// Lets memcmp read dwords out of byte buffers
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+#pragma region Routines
+
+// Dwords first, then the up to 3 bytes left
+static void copy_movsd(uint8_t* destination, const uint8_t* source, uint32_t count) {
+    uint32_t dwords = count / 4;
+    asm volatile ("rep movsl\n\t"
+                  "mov %3, %%ecx\n\t"
+                  "rep movsb"
+                  : "+D"(destination), "+S"(source), "+c"(dwords) : "r"(count % 4) : "memory");
+}
+
+// With ERMS the CPU picks the widest moves itself, alignment included
+static void copy_movsb(uint8_t* destination, const uint8_t* source, uint32_t count) {
+    asm volatile ("rep movsb" : "+D"(destination), "+S"(source), "+c"(count) : : "memory");
+}
+
+static void set_stosd(uint8_t* destination, uint32_t pattern, uint32_t count) {
+    uint32_t dwords = count / 4;
+    asm volatile ("rep stosl\n\t"
+                  "mov %2, %%ecx\n\t"
+                  "rep stosb"
+                  : "+D"(destination), "+c"(dwords) : "r"(count % 4), "a"(pattern) : "memory");
+}
+
+static void set_stosb(uint8_t* destination, uint32_t pattern, uint32_t count) {
+    asm volatile ("rep stosb" : "+D"(destination), "+c"(count) : "a"(pattern) : "memory");
+}
+
+// Routines for blocks under STRING_SSE_MIN, and for the edges of the SSE2 ones
+static copy_t copy_small = &copy_movsd;
+static set_t set_small = &set_stosd;
+
+/* Head bytes up to a 16 byte aligned destination and the tail go through the small routine, the blocks in between through XMM.
+ * An interrupt that comes during another copy cannot have the XMM registers, it copies with the small routine */
+static void copy_blocks(uint8_t* destination, const uint8_t* source, uint32_t count, void (*blocks)(void*, const void*, uint32_t)) {
+    if(!kernel_fpu_begin()) {
+        copy_small(destination, source, count);
+        return;
+    }
+
+    uint32_t head = -uint32_t(destination) & 15;
+    if(head > count) head = count;
+    copy_small(destination, source, head);
+    destination += head;
+    source += head;
+    count -= head;
+
+    const uint32_t bulk = count & ~63u;
+    blocks(destination, source, bulk);
+    kernel_fpu_end();
+
+    copy_small(destination + bulk, source + bulk, count - bulk);
+}
+
+static void set_blocks(uint8_t* destination, uint32_t pattern, uint32_t count, void (*blocks)(void*, uint32_t, uint32_t)) {
+    if(!kernel_fpu_begin()) {
+        set_small(destination, pattern, count);
+        return;
+    }
+
+    uint32_t head = -uint32_t(destination) & 15;
+    if(head > count) head = count;
+    set_small(destination, pattern, head);
+    destination += head;
+    count -= head;
+
+    const uint32_t bulk = count & ~63u;
+    blocks(destination, pattern, bulk);
+    kernel_fpu_end();
+
+    set_small(destination + bulk, pattern, count - bulk);
+}
+
+static void copy_sse2(uint8_t* destination, const uint8_t* source, uint32_t count) {
+    copy_blocks(destination, source, count, &sse2_copy);
+}
+
+static void copy_sse2_nt(uint8_t* destination, const uint8_t* source, uint32_t count) {
+    copy_blocks(destination, source, count, &sse2_copy_nt);
+}
+
+static void set_sse2(uint8_t* destination, uint32_t pattern, uint32_t count) {
+    set_blocks(destination, pattern, count, &sse2_set);
+}
+
+static void set_sse2_nt(uint8_t* destination, uint32_t pattern, uint32_t count) {
+    set_blocks(destination, pattern, count, &sse2_set_nt);
+}
+
+// Blocks from STRING_SSE_MIN and from STRING_NONTEMPORAL_MIN on
+static copy_t copy_large = &copy_movsd;
+static copy_t copy_huge = &copy_movsd;
+static set_t set_large = &set_stosd;
+static set_t set_huge = &set_stosd;
+
+static bool sse_enabled = false;
+
+#pragma endregion
+
+#pragma region Dispatch
+
+void string::init() {
+    const bool erms = cpuid::has_ext_feature(CPUID_FEAT_EXT_EBX_ERMS);
+    sse_enabled = fpu::enabled();
+
+    // Fast strings beat hand written loops for anything that stays in the cache
+    if(erms) {
+        copy_small = copy_large = copy_huge = &copy_movsb;
+        set_small = set_large = set_huge = &set_stosb;
+    }
+
+    if(sse_enabled) {
+        // Without ERMS, rep movsd is slower than XMM moves once blocks get large
+        if(!erms) {
+            copy_large = &copy_sse2;
+            set_large = &set_sse2;
+        }
+        copy_huge = &copy_sse2_nt;
+        set_huge = &set_sse2_nt;
+    }
+
+    vga::printf("String routines: ");
+    vga::printf(erms ? "rep movsb" : "rep movsd");
+    if(sse_enabled) vga::printf(erms ? ", SSE2 non-temporal" : ", SSE2");
+    vga::printf('\n');
+}
+
+extern "C" void* memcpy(void* destination, const void* source, size_t count) {
+    uint8_t* to = static_cast<uint8_t*>(destination);
+    const uint8_t* from = static_cast<const uint8_t*>(source);
+
+    if(count < STRING_SSE_MIN) copy_small(to, from, count);
+    else if(count < STRING_NONTEMPORAL_MIN) copy_large(to, from, count);
+    else copy_huge(to, from, count);
+    return destination;
+}
+
+extern "C" void* memcpy_nt(void* destination, const void* source, size_t count) {
+    uint8_t* to = static_cast<uint8_t*>(destination);
+    const uint8_t* from = static_cast<const uint8_t*>(source);
+
+    if(count < STRING_SSE_MIN) copy_small(to, from, count);
+    else copy_huge(to, from, count);
+    return destination;
+}
+
+extern "C" void* memmove(void* destination, const void* source, size_t count) {
+    const uint32_t to = uint32_t(destination), from = uint32_t(source);
+
+    // Every forward routine loads a block before storing it, so a destination below the source is safe too
+    if(to <= from || to - from >= count) return memcpy(destination, source, count);
+
+    /* The destination overlaps the end of the source: dwords from the top down, then the bytes left at the bottom.
+     * No interrupt may run while the direction flag is set */
+    uint32_t dwords = count / 4;
+    uint32_t last_to = to + count - 4, last_from = from + count - 4;
+    uint32_t flags = irq_save();
+    asm volatile ("std\n\t"
+                  "rep movsl\n\t"
+                  "add $3, %%edi\n\t"
+                  "add $3, %%esi\n\t"
+                  "mov %3, %%ecx\n\t"
+                  "rep movsb\n\t"
+                  "cld"
+                  : "+D"(last_to), "+S"(last_from), "+c"(dwords) : "r"(count % 4) : "memory", "cc");
+    irq_restore(flags);
+    return destination;
+}
+
+extern "C" void* memset(void* destination, int value, size_t count) {
+    uint8_t* to = static_cast<uint8_t*>(destination);
+    const uint32_t pattern = uint8_t(value) * 0x01010101u;
+
+    if(count < STRING_SSE_MIN) set_small(to, pattern, count);
+    else if(count < STRING_NONTEMPORAL_MIN) set_large(to, pattern, count);
+    else set_huge(to, pattern, count);
+    return destination;
+}
+
+extern "C" void* memset_nt(void* destination, int value, size_t count) {
+    uint8_t* to = static_cast<uint8_t*>(destination);
+    const uint32_t pattern = uint8_t(value) * 0x01010101u;
+
+    if(count < STRING_SSE_MIN) set_small(to, pattern, count);
+    else set_huge(to, pattern, count);
+    return destination;
+}
+
+// Whole dwords until one differs, then its bytes decide
+extern "C" int memcmp(const void* left, const void* right, size_t count) {
+    const uint8_t* a = static_cast<const uint8_t*>(left);
+    const uint8_t* b = static_cast<const uint8_t*>(right);
+
+    while(count >= 4 && *reinterpret_cast<const word_t*>(a) == *reinterpret_cast<const word_t*>(b)) {
+        a += 4;
+        b += 4;
+        count -= 4;
+    }
+    for(; count; count--, a++, b++)
+        if(*a != *b) return int(*a) - int(*b);
+    return 0;
+}
+
+#pragma endregion
+
+#pragma region Benchmark
+
+#define BENCH_STRING_MAX 0x400000   // 4 MiB, the largest block measured
+#define BENCH_STRING_BYTES 0x400000 // Bytes each routine moves per size, small blocks are repeated until then
+
+struct copy_routine {
+    const char* name;
+    copy_t copy;
+    bool sse;
+};
+
+struct set_routine {
+    const char* name;
+    set_t set;
+    bool sse;
+};
+
+static const copy_routine copy_routines[] = {
+    {"movsd", &copy_movsd, false},
+    {"movsb", &copy_movsb, false},
+    {"sse2", &copy_sse2, true},
+    {"sse2 nt", &copy_sse2_nt, true}
+};
+
+static const set_routine set_routines[] = {
+    {"stosd", &set_stosd, false},
+    {"stosb", &set_stosb, false},
+    {"sse2", &set_sse2, true},
+    {"sse2 nt", &set_sse2_nt, true}
+};
+
+static const uint32_t bench_sizes[] = {8, 64, 512, 0x1000, 0x8000, 0x40000, 0x100000, BENCH_STRING_MAX};
+
+// Average cycles of one call, a warm-up call first
+template<typename Call>
+static uint32_t measure(const uint32_t size, Call call) {
+    const uint32_t rounds = BENCH_STRING_BYTES / size;
+    call();
+
+    uint64_t begin = rdtsc();
+    for(uint32_t i = 0; i < rounds; i++) call();
+    return uint32_t(rdtsc() - begin) / rounds;
+}
+
+template<typename Routine, typename Run>
+static void print_table(const char* title, const Routine (&routines)[4], Run run) {
+    vga::printf(title);
+    for(const Routine& routine : routines) {
+        vga::printf(", ");
+        vga::printf(routine.name);
+    }
+    vga::printf('\n');
+
+    for(const uint32_t size : bench_sizes) {
+        vga::printf("  ");
+        vga::printf(size);
+        vga::printf(" B:");
+        for(const Routine& routine : routines) {
+            vga::printf(' ');
+            if(routine.sse && !sse_enabled) vga::printf('-');
+            else vga::printf(run(routine, size));
+        }
+        vga::printf('\n');
+    }
+}
+
+void string::bench_string() {
+    // Page aligned, so the SSE2 rows measure the blocks and not their edges
+    uint8_t* source = static_cast<uint8_t*>(vmalloc(BENCH_STRING_MAX));
+    uint8_t* destination = static_cast<uint8_t*>(vmalloc(BENCH_STRING_MAX));
+    if(!source || !destination) {
+        vga::error("String bench could not allocate its buffers!\n");
+        if(source) vfree(source);
+        if(destination) vfree(destination);
+        return;
+    }
+    memset(source, 0x5A, BENCH_STRING_MAX);
+
+    print_table("Copy cycles per call", copy_routines, [=](const copy_routine& routine, uint32_t size) {
+        return measure(size, [=] { routine.copy(destination, source, size); });
+    });
+    if(memcmp(source, destination, BENCH_STRING_MAX) != 0) vga::error("Copy routines left the buffers different!\n");
+
+    print_table("Fill cycles per call", set_routines, [=](const set_routine& routine, uint32_t size) {
+        return measure(size, [=] { routine.set(destination, 0, size); });
+    });
+
+    vfree(destination);
+    vfree(source);
+}
+
+#pragma endregion
@@ -0,0 +1,129 @@
+; =======================================================================
+; Copyright Ioane Baidoshvili 2024.
+; Distributed under the terms of the MIT License.
+; (See accompanying file LICENSE or copy at
+; http://www.opensource.org/licenses/MIT_1_0.txt)
+;
+; string_sse.asm moves memory 64 bytes at a time through the XMM registers
+; This file contains:
+; Cached and non-temporal SSE2 copies and fills
+; The kernel is built without SSE, so these live outside of C++
+; =======================================================================
+
+[BITS 32]
+
+section .text
+    global sse2_copy
+    global sse2_copy_nt
+    global sse2_set
+    global sse2_set_nt
+
+; Every routine takes a 16 byte aligned destination and a count that is a multiple of 64
+; The caller holds a kernel FPU section (kernel_fpu_begin), nothing else uses the XMM registers meanwhile
+
+; void sse2_copy(void* destination, const void* source, uint32_t count)
+; The source may be unaligned
+sse2_copy:
+    push esi
+    push edi
+    mov edi, [esp + 12]            ; Destination
+    mov esi, [esp + 16]            ; Source
+    mov ecx, [esp + 20]
+    shr ecx, 6                     ; 64 byte blocks
+    jz .done
+
+.loop:
+    movdqu xmm0, [esi]
+    movdqu xmm1, [esi + 16]
+    movdqu xmm2, [esi + 32]
+    movdqu xmm3, [esi + 48]
+    movdqa [edi], xmm0
+    movdqa [edi + 16], xmm1
+    movdqa [edi + 32], xmm2
+    movdqa [edi + 48], xmm3
+    add esi, 64
+    add edi, 64
+    dec ecx
+    jnz .loop
+
+.done:
+    pop edi
+    pop esi
+    ret
+
+; void sse2_copy_nt(void* destination, const void* source, uint32_t count)
+; Same as sse2_copy, but the stores go around the cache
+sse2_copy_nt:
+    push esi
+    push edi
+    mov edi, [esp + 12]
+    mov esi, [esp + 16]
+    mov ecx, [esp + 20]
+    shr ecx, 6
+    jz .done
+
+.loop:
+    movdqu xmm0, [esi]
+    movdqu xmm1, [esi + 16]
+    movdqu xmm2, [esi + 32]
+    movdqu xmm3, [esi + 48]
+    movntdq [edi], xmm0
+    movntdq [edi + 16], xmm1
+    movntdq [edi + 32], xmm2
+    movntdq [edi + 48], xmm3
+    add esi, 64
+    add edi, 64
+    dec ecx
+    jnz .loop
+
+    sfence                         ; Non-temporal stores are weakly ordered
+
+.done:
+    pop edi
+    pop esi
+    ret
+
+; void sse2_set(void* destination, uint32_t pattern, uint32_t count)
+; The pattern holds the fill byte four times
+sse2_set:
+    mov edx, [esp + 4]             ; Destination
+    movd xmm0, [esp + 8]
+    pshufd xmm0, xmm0, 0           ; Pattern in all four dwords
+    mov ecx, [esp + 12]
+    shr ecx, 6
+    jz .done
+
+.loop:
+    movdqa [edx], xmm0
+    movdqa [edx + 16], xmm0
+    movdqa [edx + 32], xmm0
+    movdqa [edx + 48], xmm0
+    add edx, 64
+    dec ecx
+    jnz .loop
+
+.done:
+    ret
+
+; void sse2_set_nt(void* destination, uint32_t pattern, uint32_t count)
+sse2_set_nt:
+    mov edx, [esp + 4]
+    movd xmm0, [esp + 8]
+    pshufd xmm0, xmm0, 0
+    mov ecx, [esp + 12]
+    shr ecx, 6
+    jz .done
+
+.loop:
+    movntdq [edx], xmm0
+    movntdq [edx + 16], xmm0
+    movntdq [edx + 32], xmm0
+    movntdq [edx + 48], xmm0
+    add edx, 64
+    dec ecx
+    jnz .loop
+
+    sfence
+
+.done:
+    ret
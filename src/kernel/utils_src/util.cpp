@@ -6,16 +6,36 @@
 //
 // util.cpp defines utility functions
 // This file contains: 
-// memset, strcmpr
+// rdtsc, MSR access, saving and restoring interrupts
 // =======================================================================
 
 #include <utils/util.hpp>
 
-// Memset sets a block of memory to a specific value for a given number of bytes
-void memset(const void *dest, const char val, uint32_t count){
-    char *temp = (char*) dest;
-    for (; count != 0; count--){
-        *temp++ = val;
-    }
+// Reads the timestamp counter, used for measuring cycles
+uint64_t rdtsc() {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return (uint64_t(high) << 32) | low;
+}
+
+// The bootloader's check_msr already made sure rdmsr and wrmsr exist
+uint64_t rdmsr(const uint32_t msr) {
+    uint32_t low, high;
+    asm volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return (uint64_t(high) << 32) | low;
+}
+
+void wrmsr(const uint32_t msr, const uint64_t value) {
+    asm volatile ("wrmsr" : : "c"(msr), "a"(uint32_t(value)), "d"(uint32_t(value >> 32)) : "memory");
+}
+
+// Disables interrupts, the returned flags tell irq_restore if they were on
+uint32_t irq_save() {
+    uint32_t flags;
+    asm volatile ("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
 
+void irq_restore(const uint32_t flags) {
+    asm volatile ("push %0\n\tpopf" : : "r"(flags) : "memory", "cc");
 }